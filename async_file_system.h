@@ -0,0 +1,120 @@
+#pragma once
+
+#include "base.h"
+#include "executor.h"
+#include "file_system.h"
+
+//Awaitable file system calls, many clients share a few executor threads
+
+/*
+ASYNC FILE SYSTEM INFO -
+
+every call returns a Task, e.g. int bytes = co_await fs.read_async(h, buffer), and resumes on an executor worker
+a suspended client costs its coroutine frame, not a worker
+
+pread_async suspends on its block reads with executor.on_completion (FileSystem::pread_start lets go of the locks first),
+so it holds no thread at all while the disk works
+the other calls hold the file system's locks until they are done (locks can't move between threads), so they run start to
+finish on one of the blocking threads, the client is suspended meanwhile and the workers keep running other coroutines
+more blocking calls than blocking threads queue up, run_blocking puts any other blocking call on the same threads
+buffers and spans have to stay valid until the call's task finishes
+*/
+
+template<class Geometry = DefaultGeometry>
+class AsyncFileSystem {
+
+private:
+
+	FileSystem<Geometry> & file_system;
+	Executor & executor;
+	BlockingPool blocking;   //destroyed first, calls still queued finish and resume their clients
+
+public:
+
+	AsyncFileSystem(FileSystem<Geometry> & fs, Executor & runner, int blocking_threads = 4) : file_system(fs), executor(runner), blocking(blocking_threads) {}
+
+	template<class Call>
+	Task<int> run_blocking(Call call);   //call() runs on a blocking thread, its result is the task's
+
+	Task<int> create_async(std::string file_name);
+	Task<int> destroy_async(std::string file_name);
+	Task<int> clone_async(std::string source_name, std::string file_name);
+	Task<int> open_async(std::string file_name);
+	Task<int> close_async(int index);
+
+	Task<int> read_async(int index, std::span<std::byte> dst);
+	Task<int> write_async(int index, std::span<const std::byte> src);
+	Task<int> pread_async(int index, std::span<std::byte> dst, int offset);
+	Task<int> pwrite_async(int index, std::span<const std::byte> src, int offset);
+	Task<int> lseek_async(int index, int pos);
+
+	inline Executor & get_executor() { return executor; }
+};
+
+template<class Geometry>
+template<class Call>
+Task<int> AsyncFileSystem<Geometry>::run_blocking(Call call) {
+
+	co_return co_await executor.on_completion([this, call](std::function<void(int)> done) { blocking.post([call, done] { done(call()); }); });
+}
+
+template<class Geometry>
+Task<int> AsyncFileSystem<Geometry>::create_async(std::string file_name) {
+
+	co_return co_await run_blocking([=, this] { return file_system.create(file_name); });
+}
+
+template<class Geometry>
+Task<int> AsyncFileSystem<Geometry>::destroy_async(std::string file_name) {
+
+	co_return co_await run_blocking([=, this] { return file_system.destroy(file_name); });
+}
+
+template<class Geometry>
+Task<int> AsyncFileSystem<Geometry>::clone_async(std::string source_name, std::string file_name) {
+
+	co_return co_await run_blocking([=, this] { return file_system.clone(source_name, file_name); });
+}
+
+template<class Geometry>
+Task<int> AsyncFileSystem<Geometry>::open_async(std::string file_name) {
+
+	co_return co_await run_blocking([=, this] { return file_system.open(file_name); });
+}
+
+template<class Geometry>
+Task<int> AsyncFileSystem<Geometry>::close_async(int index) {
+
+	co_return co_await run_blocking([=, this] { return file_system.close(index); });
+}
+
+template<class Geometry>
+Task<int> AsyncFileSystem<Geometry>::read_async(int index, std::span<std::byte> dst) {
+
+	co_return co_await run_blocking([=, this] { return file_system.read(index, dst); });
+}
+
+template<class Geometry>
+Task<int> AsyncFileSystem<Geometry>::write_async(int index, std::span<const std::byte> src) {
+
+	co_return co_await run_blocking([=, this] { return file_system.write(index, src); });
+}
+
+template<class Geometry>
+Task<int> AsyncFileSystem<Geometry>::pread_async(int index, std::span<std::byte> dst, int offset) {
+
+	co_await executor.schedule();
+	co_return co_await executor.on_completion([=, this](std::function<void(int)> done) { file_system.pread_start(index, dst, offset, std::move(done)); });
+}
+
+template<class Geometry>
+Task<int> AsyncFileSystem<Geometry>::pwrite_async(int index, std::span<const std::byte> src, int offset) {
+
+	co_return co_await run_blocking([=, this] { return file_system.pwrite(index, src, offset); });
+}
+
+template<class Geometry>
+Task<int> AsyncFileSystem<Geometry>::lseek_async(int index, int pos) {
+
+	co_return co_await run_blocking([=, this] { return file_system.lseek(index, pos); });
+}
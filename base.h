@@ -4,18 +4,53 @@
 #include<bitset>
 #include<iostream>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <vector>
+#include <deque>
+#include <unordered_map>
 #include <sstream>
 #include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <memory>
+#include <bit>
+#include <span>
+#include <limits>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <functional>
+#include <future>
+#include <thread>
+#include <condition_variable>
+#include <coroutine>
+#include <optional>
+#include <exception>
+#include <utility>
+#include <chrono>
+#include <filesystem>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
 
-//FROM http://stackoverflow.com/questions/2844817/how-do-i-check-if-a-c-string-is-an-int
-inline bool isInteger(const std::string & s) {
 
-	if (s.empty() || ((!isdigit(s[0])) && (s[0] != '-') && (s[0] != '+'))) return false;
+//whole token has to be a number, an optional sign in front like strtol takes
+inline bool parse_int(std::string_view s, int & value) {
 
-	char * p;
-	strtol(s.c_str(), &p, 10);
+	if (!s.empty() && (s[0] == '+'))
+		s.remove_prefix(1);
 
-	return (*p == 0);
-}
\ No newline at end of file
+	auto [end, error] = std::from_chars(s.data(), s.data() + s.size(), value);
+	return !s.empty() && (error == std::errc()) && (end == s.data() + s.size());
+}
@@ -0,0 +1,508 @@
+#pragma once
+
+#include "base.h"
+#include "disk_geometry.h"
+
+//Free block allocator over the ldisk bitmap
+
+/*
+ALLOCATOR INFO -
+
+bitmap - one bit per block (1 = used), stored in 64 bit words, block n is bit (n % 64) of word (n / 64)
+summary - one bit per bitmap word (1 = word has a free block), lets a scan skip full words 64 at a time
+cursor - next fit, allocation continues from the last block handed out
+caches - per thread reservations, up to CACHE_BATCH blocks of one word taken from the bitmap at once
+         and handed out one at a time without touching shared state
+
+every bitmap/summary word is changed with compare and swap (std::atomic_ref), so threads never lock,
+a block in a cache is used in the bitmap until it is handed out or the cache is given back
+
+blocks below FILE_BLOCK_START (bitmap/descriptors) are never handed out
+*/
+
+template<class Geometry = DefaultGeometry>
+class BlockAllocator {
+
+private:
+
+	static const int WORD_SIZE = 64;   //bits
+	static const int NUM_BLOCKS = Geometry::NUM_BLOCKS;
+	static const int FILE_BLOCK_START = Geometry::FILE_BLOCK_START;
+	static const int NUM_WORDS = (NUM_BLOCKS + WORD_SIZE - 1) / WORD_SIZE;
+	static const int NUM_SUMMARY_WORDS = (NUM_WORDS + WORD_SIZE - 1) / WORD_SIZE;
+	static const int CACHE_SLOTS = 16;   //threads past this share a slot
+	static const int CACHE_BATCH = 8;    //blocks reserved per refill
+
+	struct BLOCK_CACHE {
+
+		std::atomic<bool> busy;      //a thread is using it, others go to the bitmap
+		int word;                    //bitmap word of the reserved blocks
+		std::uint64_t bits;          //reserved blocks (used in the bitmap, not handed out yet)
+
+		BLOCK_CACHE() : busy(false), word(0), bits(0) {}
+	};
+
+	std::uint64_t * bitmap;                        //bitmap words (owned by ldisk)
+	std::uint64_t summary[NUM_SUMMARY_WORDS];
+	std::atomic<int> cursor;
+	std::atomic<int> free_blocks;                  //free in the bitmap
+	std::atomic<int> reserved_blocks;              //sitting in caches
+	BLOCK_CACHE caches[CACHE_SLOTS];
+
+	static inline std::uint64_t valid_mask(int word);                   //bits of a word that are allocatable blocks
+	static inline std::uint64_t load(std::uint64_t & word) { return std::atomic_ref<std::uint64_t>(word).load(std::memory_order_acquire); }
+	inline std::uint64_t free_bits(int word) { return ~load(bitmap[word]) & valid_mask(word); }
+
+	inline void update_summary(int word);
+	int next_free_word(int word);                                       //first word at/after word with a free block, -1 if none
+	int next_free_block(int start);                                     //first free block at/after start, -1 if none
+	int free_run(int start, int max_length);                            //free blocks in a row from start (up to max_length)
+
+	bool claim(int word, std::uint64_t bits);                           //set bits if all of them are free
+	std::uint64_t claim_free(int word, int first_bit, int max_count);   //set up to max_count free bits at/after first_bit, returns them
+	std::uint64_t unclaim(int word, std::uint64_t bits);                //clear bits, returns the ones that were set
+	bool claim_run(int start, int length);                              //all or nothing
+	void unclaim_run(int start, int length);
+
+	std::uint64_t take_blocks(int max_count, int & word);               //up to max_count free blocks of one word, next fit
+	BLOCK_CACHE & thread_cache();
+	void drain(BLOCK_CACHE & cache);                                    //give a cache's blocks back (caller owns it)
+
+public:
+
+	BlockAllocator() : bitmap(nullptr), cursor(FILE_BLOCK_START), free_blocks(0), reserved_blocks(0) {}
+
+	void attach(std::uint64_t * bitmap_words);       //use the bitmap at bitmap_words and rebuild the summary
+	void rebuild();                                  //recompute summary/free count after the bitmap was loaded (no other threads)
+
+	int allocate();                                  //returns block, -1 if disk is full
+	int allocate_contiguous(int count);              //returns first block of count free blocks in a row, -1 if none
+	bool allocate_at(int block_num);                 //take a specific block if it is free
+	void release(int block_num);
+	void release_contiguous(int start, int count);
+
+	void return_reservations();                      //give back every idle cache, needed before the bitmap is written out
+
+	inline bool is_free(int block_num) { return !((load(bitmap[block_num / WORD_SIZE]) >> (block_num % WORD_SIZE)) & 1); }
+	inline int get_free_blocks() { return free_blocks + reserved_blocks; }
+};
+
+template<class Geometry>
+inline std::uint64_t BlockAllocator<Geometry>::valid_mask(int word) {
+
+	int first = word * WORD_SIZE;
+	int low = (FILE_BLOCK_START > first) ? (FILE_BLOCK_START - first) : 0;
+	int high = ((NUM_BLOCKS - first) < WORD_SIZE) ? (NUM_BLOCKS - first) : WORD_SIZE;
+
+	if (low >= high)
+		return 0;
+
+	std::uint64_t mask = (high == WORD_SIZE) ? ~std::uint64_t(0) : ((std::uint64_t(1) << high) - 1);
+	return mask & (~std::uint64_t(0) << low);
+}
+
+template<class Geometry>
+void BlockAllocator<Geometry>::attach(std::uint64_t * bitmap_words) {
+
+	bitmap = bitmap_words;
+	rebuild();
+}
+
+template<class Geometry>
+void BlockAllocator<Geometry>::rebuild() {
+
+	int free_count = 0;
+	std::memset(summary, 0, sizeof(summary));
+
+	for (int i = 0; i < NUM_WORDS; i++) {
+
+		update_summary(i);
+		free_count += std::popcount(free_bits(i));
+	}
+
+	//reservations were against the old bitmap
+	for (auto & cache : caches)
+		cache.bits = 0;
+
+	free_blocks = free_count;
+	reserved_blocks = 0;
+
+	if ((cursor < FILE_BLOCK_START) || (cursor >= NUM_BLOCKS))
+		cursor = FILE_BLOCK_START;
+}
+
+//a release can set the bit between our clear and our check, so check again after clearing
+template<class Geometry>
+inline void BlockAllocator<Geometry>::update_summary(int word) {
+
+	std::atomic_ref<std::uint64_t> summary_word(summary[word / WORD_SIZE]);
+	std::uint64_t bit = std::uint64_t(1) << (word % WORD_SIZE);
+
+	if (free_bits(word) != 0)
+		summary_word.fetch_or(bit);
+	else {
+
+		summary_word.fetch_and(~bit);
+		if (free_bits(word) != 0)
+			summary_word.fetch_or(bit);
+	}
+}
+
+template<class Geometry>
+int BlockAllocator<Geometry>::next_free_word(int word) {
+
+	if (word >= NUM_WORDS)
+		return -1;
+
+	int summary_index = word / WORD_SIZE;
+	std::uint64_t candidates = load(summary[summary_index]) & (~std::uint64_t(0) << (word % WORD_SIZE));
+
+	while (true) {
+
+		if (candidates != 0)
+			return (summary_index * WORD_SIZE) + std::countr_zero(candidates);
+
+		if (++summary_index >= NUM_SUMMARY_WORDS)
+			return -1;
+		candidates = load(summary[summary_index]);
+	}
+}
+
+template<class Geometry>
+int BlockAllocator<Geometry>::next_free_block(int start) {
+
+	if (start >= NUM_BLOCKS)
+		return -1;
+
+	int word = start / WORD_SIZE;
+	std::uint64_t candidates = free_bits(word) & (~std::uint64_t(0) << (start % WORD_SIZE));
+
+	while (candidates == 0) {  //summary can be behind a word another thread just filled
+
+		word = next_free_word(word + 1);
+		if (word == -1)
+			return -1;
+		candidates = free_bits(word);
+	}
+
+	return (word * WORD_SIZE) + std::countr_zero(candidates);
+}
+
+template<class Geometry>
+int BlockAllocator<Geometry>::free_run(int start, int max_length) {
+
+	int length = 0;
+	int block_num = start;
+
+	while ((length < max_length) && (block_num < NUM_BLOCKS)) {
+
+		int offset = block_num % WORD_SIZE;
+		std::uint64_t free_word = free_bits(block_num / WORD_SIZE) >> offset;
+		int run = std::countr_one(free_word);
+		if (run > WORD_SIZE - offset)
+			run = WORD_SIZE - offset;
+
+		length += run;
+		block_num += run;
+
+		if (run < WORD_SIZE - offset)   //run ended inside this word
+			break;
+	}
+
+	return (length < max_length) ? length : max_length;
+}
+
+template<class Geometry>
+bool BlockAllocator<Geometry>::claim(int word, std::uint64_t bits) {
+
+	std::atomic_ref<std::uint64_t> bitmap_word(bitmap[word]);
+	std::uint64_t old = bitmap_word.load(std::memory_order_acquire);
+
+	do {
+
+		if ((old & bits) != 0)  //someone has one of them
+			return false;
+	} while (!bitmap_word.compare_exchange_weak(old, old | bits, std::memory_order_acq_rel));
+
+	update_summary(word);
+	return true;
+}
+
+template<class Geometry>
+std::uint64_t BlockAllocator<Geometry>::claim_free(int word, int first_bit, int max_count) {
+
+	std::atomic_ref<std::uint64_t> bitmap_word(bitmap[word]);
+	std::uint64_t old = bitmap_word.load(std::memory_order_acquire);
+	std::uint64_t taken = 0;
+
+	do {
+
+		std::uint64_t candidates = ~old & valid_mask(word) & (~std::uint64_t(0) << first_bit);
+
+		taken = 0;
+		for (int i = 0; (i < max_count) && (candidates != 0); i++) {
+
+			taken |= candidates & (~candidates + 1);  //lowest free bit
+			candidates &= candidates - 1;
+		}
+
+		if (taken == 0)
+			return 0;
+	} while (!bitmap_word.compare_exchange_weak(old, old | taken, std::memory_order_acq_rel));
+
+	update_summary(word);
+	return taken;
+}
+
+template<class Geometry>
+std::uint64_t BlockAllocator<Geometry>::unclaim(int word, std::uint64_t bits) {
+
+	std::uint64_t old = std::atomic_ref<std::uint64_t>(bitmap[word]).fetch_and(~bits, std::memory_order_acq_rel);
+
+	update_summary(word);
+	return old & bits;
+}
+
+template<class Geometry>
+bool BlockAllocator<Geometry>::claim_run(int start, int length) {
+
+	for (int block_num = start; block_num < start + length; ) {
+
+		int word = block_num / WORD_SIZE;
+		int offset = block_num % WORD_SIZE;
+		int count = std::min(WORD_SIZE - offset, start + length - block_num);
+		std::uint64_t bits = ((count == WORD_SIZE) ? ~std::uint64_t(0) : ((std::uint64_t(1) << count) - 1)) << offset;
+
+		if (!claim(word, bits)) {  //lost a race, undo the words already taken
+
+			unclaim_run(start, block_num - start);
+			return false;
+		}
+
+		block_num += count;
+	}
+
+	return true;
+}
+
+template<class Geometry>
+void BlockAllocator<Geometry>::unclaim_run(int start, int length) {
+
+	for (int block_num = start; block_num < start + length; ) {
+
+		int word = block_num / WORD_SIZE;
+		int offset = block_num % WORD_SIZE;
+		int count = std::min(WORD_SIZE - offset, start + length - block_num);
+		std::uint64_t bits = ((count == WORD_SIZE) ? ~std::uint64_t(0) : ((std::uint64_t(1) << count) - 1)) << offset;
+
+		unclaim(word, bits);
+		block_num += count;
+	}
+}
+
+template<class Geometry>
+std::uint64_t BlockAllocator<Geometry>::take_blocks(int max_count, int & word) {
+
+	int start = cursor.load(std::memory_order_relaxed);
+
+	for (int pass = 0; pass < 2; pass++) {  //second pass wraps around
+
+		for (int block_num = next_free_block(start); block_num != -1; ) {
+
+			word = block_num / WORD_SIZE;
+			std::uint64_t taken = claim_free(word, block_num % WORD_SIZE, max_count);
+
+			if (taken != 0) {
+
+				int last = (word * WORD_SIZE) + (WORD_SIZE - 1 - std::countl_zero(taken));
+				cursor.store((last + 1 < NUM_BLOCKS) ? last + 1 : FILE_BLOCK_START, std::memory_order_relaxed);
+				free_blocks -= std::popcount(taken);
+				return taken;
+			}
+
+			block_num = next_free_block((word + 1) * WORD_SIZE);  //word filled up under us
+		}
+
+		start = FILE_BLOCK_START;
+	}
+
+	return 0;
+}
+
+template<class Geometry>
+typename BlockAllocator<Geometry>::BLOCK_CACHE & BlockAllocator<Geometry>::thread_cache() {
+
+	static std::atomic<int> next_slot(0);
+	thread_local int slot = next_slot.fetch_add(1, std::memory_order_relaxed) % CACHE_SLOTS;
+
+	return caches[slot];
+}
+
+template<class Geometry>
+void BlockAllocator<Geometry>::drain(BLOCK_CACHE & cache) {
+
+	if (cache.bits != 0) {
+
+		int count = std::popcount(unclaim(cache.word, cache.bits));
+		reserved_blocks -= count;
+		free_blocks += count;
+		cache.bits = 0;
+	}
+}
+
+template<class Geometry>
+int BlockAllocator<Geometry>::allocate() {
+
+	BLOCK_CACHE & cache = thread_cache();
+	int word = 0;
+
+	if (!cache.busy.exchange(true, std::memory_order_acquire)) {  //slot is ours
+
+		if (cache.bits == 0) {  //refill
+
+			cache.bits = take_blocks(CACHE_BATCH, cache.word);
+			reserved_blocks += std::popcount(cache.bits);
+		}
+
+		if (cache.bits != 0) {
+
+			int block_num = (cache.word * WORD_SIZE) + std::countr_zero(cache.bits);
+			cache.bits &= cache.bits - 1;
+			reserved_blocks--;
+			cache.busy.store(false, std::memory_order_release);
+			return block_num;
+		}
+
+		cache.busy.store(false, std::memory_order_release);
+	}
+
+	//slot shared with a busy thread, or nothing left to reserve
+	std::uint64_t taken = take_blocks(1, word);
+
+	if (taken == 0) {  //free blocks may be sitting in other caches
+
+		return_reservations();
+		taken = take_blocks(1, word);
+	}
+
+	if (taken == 0)
+		return -1;   //disk full
+
+	return (word * WORD_SIZE) + std::countr_zero(taken);
+}
+
+template<class Geometry>
+int BlockAllocator<Geometry>::allocate_contiguous(int count) {
+
+	BLOCK_CACHE & cache = thread_cache();
+
+	//our own reservation shouldn't split a run
+	if (!cache.busy.exchange(true, std::memory_order_acquire)) {
+
+		drain(cache);
+		cache.busy.store(false, std::memory_order_release);
+	}
+
+	if ((count <= 0) || (count > free_blocks))
+		return -1;
+
+	int first = cursor.load(std::memory_order_relaxed);
+	int start = first;
+	bool wrapped = false;
+
+	while (true) {
+
+		int block_num = next_free_block(start);
+
+		if ((block_num == -1) || (wrapped && (block_num >= first))) {
+
+			if (wrapped)
+				return -1;   //no run long enough
+
+			wrapped = true;
+			start = FILE_BLOCK_START;
+			continue;
+		}
+
+		int run = free_run(block_num, count);
+		if ((run == count) && claim_run(block_num, count)) {
+
+			free_blocks -= count;
+			cursor.store((block_num + count < NUM_BLOCKS) ? block_num + count : FILE_BLOCK_START, std::memory_order_relaxed);
+			return block_num;
+		}
+
+		start = block_num + ((run > 0) ? run : 1);
+	}
+}
+
+template<class Geometry>
+bool BlockAllocator<Geometry>::allocate_at(int block_num) {
+
+	if ((block_num < FILE_BLOCK_START) || (block_num >= NUM_BLOCKS))
+		return false;
+
+	int word = block_num / WORD_SIZE;
+	std::uint64_t bit = std::uint64_t(1) << (block_num % WORD_SIZE);
+	BLOCK_CACHE & cache = thread_cache();
+
+	//could be in our own reservation
+	if (!cache.busy.exchange(true, std::memory_order_acquire)) {
+
+		bool reserved = (cache.word == word) && ((cache.bits & bit) != 0);
+		if (reserved) {
+
+			cache.bits &= ~bit;
+			reserved_blocks--;
+		}
+
+		cache.busy.store(false, std::memory_order_release);
+		if (reserved)
+			return true;
+	}
+
+	if (!claim(word, bit))
+		return false;
+
+	free_blocks--;
+	return true;
+}
+
+template<class Geometry>
+void BlockAllocator<Geometry>::release(int block_num) {
+
+	release_contiguous(block_num, 1);
+}
+
+template<class Geometry>
+void BlockAllocator<Geometry>::release_contiguous(int start, int count) {
+
+	//only allocatable blocks, freeing a free block does nothing
+	int first = (start > FILE_BLOCK_START) ? start : FILE_BLOCK_START;
+	int last = (start + count < NUM_BLOCKS) ? start + count : NUM_BLOCKS;
+
+	for (int block_num = first; block_num < last; ) {
+
+		int word = block_num / WORD_SIZE;
+		int offset = block_num % WORD_SIZE;
+		int length = std::min(WORD_SIZE - offset, last - block_num);
+		std::uint64_t bits = ((length == WORD_SIZE) ? ~std::uint64_t(0) : ((std::uint64_t(1) << length) - 1)) << offset;
+
+		free_blocks += std::popcount(unclaim(word, bits));
+		block_num += length;
+	}
+}
+
+//a cache in use by its thread is skipped
+template<class Geometry>
+void BlockAllocator<Geometry>::return_reservations() {
+
+	for (auto & cache : caches) {
+
+		if (!cache.busy.exchange(true, std::memory_order_acquire)) {
+
+			drain(cache);
+			cache.busy.store(false, std::memory_order_release);
+		}
+	}
+}
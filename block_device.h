@@ -0,0 +1,561 @@
+#pragma once
+
+#include "base.h"
+
+#if !defined(_WIN32) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE  //linux/fs.h comes along and defines it, the geometry uses the name
+#define HAS_IO_URING
+#endif
+
+//Block devices, an ldisk kept in a real file does its block I/O through one of these
+
+/*
+BLOCK DEVICE INFO -
+
+BLOCK_REQUEST - one read or write of length bytes at a byte offset in the file
+submit - starts a request, on_complete gets the bytes moved (or -errno) on the device's completion thread
+         callbacks can submit more requests but shouldn't wait on the device
+         a read past the end of the file comes back as zeros
+submit_batch - starts several requests at once (one syscall on io_uring), transfer uses it
+
+UringDevice - io_uring through the raw syscalls (no liburing), a reaper thread takes completions off the ring,
+              requests past the ring size wait in overflow until slots free up, then go in together
+ThreadPoolDevice - worker threads doing pread/pwrite, used when io_uring can't be set up
+open_block_device - io_uring if the kernel has it with IORING_OP_READ/WRITE (probed), the thread pool otherwise
+*/
+
+struct BLOCK_REQUEST {
+
+	bool is_write;
+	std::int64_t offset;           //bytes from the start of the file
+	char * buffer;                 //has to stay valid until the request completes
+	int length;                    //bytes
+};
+
+class BlockDevice {
+
+public:
+
+	virtual ~BlockDevice() {}
+
+	virtual void submit(const BLOCK_REQUEST & request, std::function<void(int)> on_complete) = 0;
+	virtual void submit_batch(const BLOCK_REQUEST * requests, int count, std::function<void(int, int)> on_complete);  //on_complete(request index, bytes) for each
+	virtual int sync() = 0;                                   //flush the file to stable storage, -1 on failure
+	virtual int resize(std::int64_t size) = 0;                //bytes, new space reads as zeros
+	virtual std::int64_t size() = 0;                          //bytes, -1 on failure
+	virtual bool is_file(const std::string & file_name) = 0;  //same file the device has open
+	virtual const char * name() = 0;
+
+	std::future<int> submit_async(const BLOCK_REQUEST & request);
+	int transfer(const BLOCK_REQUEST * requests, int count);  //submit them all and wait, -1 if any failed
+};
+
+inline std::future<int> BlockDevice::submit_async(const BLOCK_REQUEST & request) {
+
+	auto done = std::make_shared<std::promise<int>>();
+	std::future<int> result = done->get_future();
+
+	submit(request, [done](int bytes) { done->set_value(bytes); });
+	return result;
+}
+
+//one at a time unless the device does better
+inline void BlockDevice::submit_batch(const BLOCK_REQUEST * requests, int count, std::function<void(int, int)> on_complete) {
+
+	auto done = std::make_shared<std::function<void(int, int)>>(std::move(on_complete));
+
+	for (int i = 0; i < count; i++)
+		submit(requests[i], [done, i](int bytes) { (*done)(i, bytes); });
+}
+
+inline int BlockDevice::transfer(const BLOCK_REQUEST * requests, int count) {
+
+	std::mutex wait_lock;
+	std::condition_variable finished;
+	int pending = count;
+	bool failed = false;
+
+	if (count == 0)
+		return 0;
+
+	submit_batch(requests, count, [&](int index, int bytes) {
+
+		std::lock_guard<std::mutex> guard(wait_lock);
+		failed |= (bytes != requests[index].length);
+		if (--pending == 0)
+			finished.notify_one();
+	});
+
+	std::unique_lock<std::mutex> guard(wait_lock);
+	finished.wait(guard, [&] { return pending == 0; });
+	return failed ? -1 : 0;
+}
+
+#ifndef _WIN32
+
+//owns the file descriptor, requests that come up short are finished here
+class FileBlockDevice : public BlockDevice {
+
+protected:
+
+	struct PENDING {
+
+		BLOCK_REQUEST request;
+		int done;                                   //bytes moved so far
+		std::function<void(int)> on_complete;
+	};
+
+	int fd;
+
+	//true once the request is over, otherwise the rest of it still has to go
+	static bool advance(PENDING * pending, int result);
+
+public:
+
+	explicit FileBlockDevice(int file) : fd(file) {}
+	~FileBlockDevice() { ::close(fd); }
+
+	FileBlockDevice(const FileBlockDevice &) = delete;
+	FileBlockDevice & operator=(const FileBlockDevice &) = delete;
+
+	int sync() { return fsync(fd); }
+	int resize(std::int64_t size) { return ftruncate(fd, (off_t)size); }
+	std::int64_t size();
+	bool is_file(const std::string & file_name);
+};
+
+inline bool FileBlockDevice::advance(PENDING * pending, int result) {
+
+	BLOCK_REQUEST & request = pending->request;
+
+	if (result < 0) {
+
+		pending->done = result;
+		return true;
+	}
+
+	if ((result == 0) && !request.is_write) {  //end of the file
+
+		std::memset(request.buffer + pending->done, 0, request.length - pending->done);
+		pending->done = request.length;
+		return true;
+	}
+
+	pending->done += result;
+	if (result == 0)  //write that made no progress
+		pending->done = -EIO;
+
+	return (pending->done < 0) || (pending->done == request.length);
+}
+
+inline std::int64_t FileBlockDevice::size() {
+
+	struct stat file_info;
+	return (fstat(fd, &file_info) == 0) ? (std::int64_t)file_info.st_size : -1;
+}
+
+inline bool FileBlockDevice::is_file(const std::string & file_name) {
+
+	struct stat device_info, file_info;
+
+	return (fstat(fd, &device_info) == 0) && (stat(file_name.c_str(), &file_info) == 0) &&
+		(device_info.st_dev == file_info.st_dev) && (device_info.st_ino == file_info.st_ino);
+}
+
+class ThreadPoolDevice : public FileBlockDevice {
+
+private:
+
+	std::vector<std::thread> workers;
+	std::deque<PENDING> requests;
+	std::mutex queue_lock;
+	std::condition_variable queue_ready;
+	bool stopping;
+
+	void run();
+
+public:
+
+	ThreadPoolDevice(int file, int num_threads);
+	~ThreadPoolDevice();
+
+	void submit(const BLOCK_REQUEST & request, std::function<void(int)> on_complete);
+	const char * name() { return "thread pool"; }
+};
+
+inline ThreadPoolDevice::ThreadPoolDevice(int file, int num_threads) : FileBlockDevice(file), stopping(false) {
+
+	for (int i = 0; i < ((num_threads > 0) ? num_threads : 1); i++)
+		workers.emplace_back(&ThreadPoolDevice::run, this);
+}
+
+//queued requests still run before the workers stop
+inline ThreadPoolDevice::~ThreadPoolDevice() {
+
+	{
+		std::lock_guard<std::mutex> guard(queue_lock);
+		stopping = true;
+	}
+	queue_ready.notify_all();
+
+	for (auto & worker : workers)
+		worker.join();
+}
+
+inline void ThreadPoolDevice::submit(const BLOCK_REQUEST & request, std::function<void(int)> on_complete) {
+
+	{
+		std::lock_guard<std::mutex> guard(queue_lock);
+		requests.push_back({ request, 0, std::move(on_complete) });
+	}
+	queue_ready.notify_one();
+}
+
+inline void ThreadPoolDevice::run() {
+
+	while (true) {
+
+		std::unique_lock<std::mutex> guard(queue_lock);
+		queue_ready.wait(guard, [this] { return stopping || !requests.empty(); });
+
+		if (requests.empty())  //stopping
+			return;
+
+		PENDING pending = std::move(requests.front());
+		requests.pop_front();
+		guard.unlock();
+
+		BLOCK_REQUEST & request = pending.request;
+		bool finished = false;
+
+		while (!finished) {
+
+			char * buffer = request.buffer + pending.done;
+			std::size_t length = request.length - pending.done;
+			off_t offset = (off_t)(request.offset + pending.done);
+			ssize_t result = request.is_write ? ::pwrite(fd, buffer, length, offset) : ::pread(fd, buffer, length, offset);
+
+			if ((result == -1) && (errno == EINTR))
+				continue;
+			finished = advance(&pending, (result == -1) ? -errno : (int)result);
+		}
+
+		pending.on_complete(pending.done);
+	}
+}
+
+#ifdef HAS_IO_URING
+
+class UringDevice : public FileBlockDevice {
+
+private:
+
+	static const unsigned RING_ENTRIES = 64;
+
+	int ring_fd;
+	unsigned entries;                  //submission slots
+
+	//rings shared with the kernel
+	void * sq_ring;
+	std::size_t sq_ring_size;
+	void * cq_ring;
+	std::size_t cq_ring_size;
+	io_uring_sqe * sqes;
+	std::size_t sqes_size;
+
+	unsigned * sq_tail;
+	unsigned * sq_mask;
+	unsigned * sq_array;
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned * cq_mask;
+	io_uring_cqe * cqes;
+
+	std::mutex submit_lock;
+	unsigned in_flight;                //requests on the ring, at most entries so completions never overflow
+	unsigned unsubmitted;              //on the ring but not handed to the kernel yet
+	std::deque<PENDING *> overflow;    //requests waiting for a slot
+	bool stopping;
+	std::thread reaper;
+
+	UringDevice(int file, int ring, const io_uring_params & params);
+
+	//caller holds submit_lock for both, pushed requests only start at the next submit_pushed
+	void push(PENDING * pending);      //pending is nullptr for the wake up at shutdown
+	void submit_pushed();
+	int enter(unsigned to_submit, unsigned min_complete, unsigned flags);
+	void reap();
+
+	static bool has_read_write(int ring);  //IORING_OP_READ/WRITE came in later than io_uring itself
+
+public:
+
+	~UringDevice();
+
+	static std::shared_ptr<BlockDevice> open(int file);  //nullptr if the kernel has no io_uring (file stays open)
+
+	void submit(const BLOCK_REQUEST & request, std::function<void(int)> on_complete);
+	void submit_batch(const BLOCK_REQUEST * requests, int count, std::function<void(int, int)> on_complete);
+	const char * name() { return "io_uring"; }
+};
+
+inline std::shared_ptr<BlockDevice> UringDevice::open(int file) {
+
+	io_uring_params params = {};
+	int ring = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+
+	if (ring < 0)
+		return nullptr;
+
+	if (!has_read_write(ring)) {
+
+		::close(ring);
+		return nullptr;
+	}
+
+	std::shared_ptr<UringDevice> device(new UringDevice(file, ring, params));
+	if (device->sqes == nullptr) {  //couldn't map the rings
+
+		device->fd = -1;  //the caller keeps the file
+		return nullptr;
+	}
+
+	device->reaper = std::thread(&UringDevice::reap, device.get());
+	return device;
+}
+
+//a kernel without the probe (before 5.6) doesn't have the opcodes either
+inline bool UringDevice::has_read_write(int ring) {
+
+	static const int PROBE_OPS = 256;
+	std::vector<char> buffer(sizeof(io_uring_probe) + (PROBE_OPS * sizeof(io_uring_probe_op)), 0);
+	io_uring_probe * probe = (io_uring_probe *)buffer.data();
+
+	if (syscall(__NR_io_uring_register, ring, IORING_REGISTER_PROBE, probe, PROBE_OPS) < 0)
+		return false;
+
+	auto supported = [probe](int op) { return (op < probe->ops_len) && (probe->ops[op].flags & IO_URING_OP_SUPPORTED); };
+	return supported(IORING_OP_READ) && supported(IORING_OP_WRITE);
+}
+
+inline UringDevice::UringDevice(int file, int ring, const io_uring_params & params) : FileBlockDevice(file), ring_fd(ring),
+	entries(params.sq_entries), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sqes(nullptr), in_flight(0), unsubmitted(0), stopping(false) {
+
+	sq_ring_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+	cq_ring_size = params.cq_off.cqes + (params.cq_entries * sizeof(io_uring_cqe));
+	sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_ring_size = cq_ring_size = (sq_ring_size > cq_ring_size) ? sq_ring_size : cq_ring_size;
+
+	sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+		return;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ring = sq_ring;
+	else {
+
+		cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED)
+			return;
+	}
+
+	void * sqe_mapping = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sqe_mapping == MAP_FAILED)
+		return;
+	sqes = (io_uring_sqe *)sqe_mapping;
+
+	sq_tail = (unsigned *)((char *)sq_ring + params.sq_off.tail);
+	sq_mask = (unsigned *)((char *)sq_ring + params.sq_off.ring_mask);
+	sq_array = (unsigned *)((char *)sq_ring + params.sq_off.array);
+	cq_head = (unsigned *)((char *)cq_ring + params.cq_off.head);
+	cq_tail = (unsigned *)((char *)cq_ring + params.cq_off.tail);
+	cq_mask = (unsigned *)((char *)cq_ring + params.cq_off.ring_mask);
+	cqes = (io_uring_cqe *)((char *)cq_ring + params.cq_off.cqes);
+}
+
+//the wake up request goes in after everything else, the reaper stops once the ring is empty
+inline UringDevice::~UringDevice() {
+
+	if (reaper.joinable()) {
+
+		{
+			std::lock_guard<std::mutex> guard(submit_lock);
+			stopping = true;
+			push(nullptr);
+			submit_pushed();
+		}
+		reaper.join();
+	}
+
+	if (sqes != nullptr)
+		munmap(sqes, sqes_size);
+	if ((cq_ring != MAP_FAILED) && (cq_ring != sq_ring))
+		munmap(cq_ring, cq_ring_size);
+	if (sq_ring != MAP_FAILED)
+		munmap(sq_ring, sq_ring_size);
+	::close(ring_fd);
+}
+
+inline int UringDevice::enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+
+	int result;
+
+	do
+		result = (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+	while ((result == -1) && (errno == EINTR));
+
+	return result;
+}
+
+inline void UringDevice::push(PENDING * pending) {
+
+	if (in_flight == entries) {
+
+		overflow.push_back(pending);
+		return;
+	}
+
+	//only one submitter at a time (submit_lock), the kernel reads the tail
+	std::atomic_ref<unsigned> tail(*sq_tail);
+	unsigned index = tail.load(std::memory_order_relaxed) & *sq_mask;
+	io_uring_sqe * sqe = &sqes[index];
+
+	std::memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (std::uint64_t)(std::uintptr_t)pending;
+	sqe->fd = fd;
+
+	if (pending == nullptr)
+		sqe->opcode = IORING_OP_NOP;
+	else {
+
+		BLOCK_REQUEST & request = pending->request;
+		sqe->opcode = request.is_write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->off = (std::uint64_t)(request.offset + pending->done);
+		sqe->addr = (std::uint64_t)(std::uintptr_t)(request.buffer + pending->done);
+		sqe->len = (unsigned)(request.length - pending->done);
+	}
+
+	sq_array[index] = index;
+	tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	in_flight++;
+	unsubmitted++;
+}
+
+//whatever the kernel doesn't take now stays on the ring and goes with the next enter
+inline void UringDevice::submit_pushed() {
+
+	if (unsubmitted == 0)
+		return;
+
+	int submitted = enter(unsubmitted, 0, 0);
+	if (submitted > 0)
+		unsubmitted -= ((unsigned)submitted < unsubmitted) ? (unsigned)submitted : unsubmitted;
+}
+
+inline void UringDevice::submit(const BLOCK_REQUEST & request, std::function<void(int)> on_complete) {
+
+	PENDING * pending = new PENDING{ request, 0, std::move(on_complete) };
+
+	std::lock_guard<std::mutex> guard(submit_lock);
+	push(pending);
+	submit_pushed();
+}
+
+inline void UringDevice::submit_batch(const BLOCK_REQUEST * requests, int count, std::function<void(int, int)> on_complete) {
+
+	auto done = std::make_shared<std::function<void(int, int)>>(std::move(on_complete));
+	std::vector<PENDING *> batch;
+
+	for (int i = 0; i < count; i++)
+		batch.push_back(new PENDING{ requests[i], 0, [done, i](int bytes) { (*done)(i, bytes); } });
+
+	std::lock_guard<std::mutex> guard(submit_lock);
+	for (auto pending : batch)
+		push(pending);
+	submit_pushed();
+}
+
+inline void UringDevice::reap() {
+
+	std::atomic_ref<unsigned> head(*cq_head);
+	std::atomic_ref<unsigned> tail(*cq_tail);
+	std::vector<PENDING *> finished;
+	bool woken = false;
+
+	while (true) {
+
+		if (head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire))
+			enter(0, 1, IORING_ENTER_GETEVENTS);
+
+		std::unique_lock<std::mutex> guard(submit_lock);
+
+		for (unsigned i = head.load(std::memory_order_relaxed); i != tail.load(std::memory_order_acquire); i++) {
+
+			io_uring_cqe * cqe = &cqes[i & *cq_mask];
+			PENDING * pending = (PENDING *)(std::uintptr_t)cqe->user_data;
+			int result = cqe->res;
+
+			head.store(i + 1, std::memory_order_release);
+			in_flight--;
+
+			if (pending == nullptr)
+				woken = true;
+			else if (advance(pending, result))
+				finished.push_back(pending);
+			else
+				overflow.push_front(pending);  //short transfer, the rest goes next
+		}
+
+		while ((in_flight < entries) && !overflow.empty()) {
+
+			PENDING * next = overflow.front();
+			overflow.pop_front();
+			push(next);
+		}
+		submit_pushed();
+
+		bool done = woken && (in_flight == 0) && overflow.empty();
+		guard.unlock();
+
+		//callbacks run without the lock so they can submit
+		for (auto pending : finished) {
+
+			pending->on_complete(pending->done);
+			delete pending;
+		}
+		finished.clear();
+
+		if (done)
+			return;
+	}
+}
+
+#endif
+
+//io_uring when it can be set up, the thread pool otherwise, nullptr if the file can't be opened
+inline std::shared_ptr<BlockDevice> open_block_device(const std::string & file_name, bool use_uring = true) {
+
+	int fd = ::open(file_name.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd == -1)
+		return nullptr;
+
+#ifdef HAS_IO_URING
+	if (use_uring) {
+
+		std::shared_ptr<BlockDevice> device = UringDevice::open(fd);
+		if (device)
+			return device;
+	}
+#endif
+
+	return std::make_shared<ThreadPoolDevice>(fd, 4);
+}
+
+#else
+
+inline std::shared_ptr<BlockDevice> open_block_device(const std::string & file_name, bool use_uring = true) { return nullptr; }
+
+#endif
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "base.h"
+#include "ldisk.h"
+
+//In memory block map of an open file
+
+/*
+BLOCK MAP INFO -
+
+extents - the file's extents in order
+ends - file block just past each extent (running total), binary searched for random access
+cursor - extent of the last lookup, sequential access stays on it or moves to the next one
+         (concurrent readers pass their own hint instead)
+*/
+
+class BlockMap {
+
+private:
+
+	std::vector<EXTENT> extents;
+	std::vector<int> ends;
+	std::size_t cursor;
+
+	inline int extent_begin(std::size_t i) const { return (i == 0) ? 0 : ends[i - 1]; }
+
+public:
+
+	BlockMap() : cursor(0) {}
+
+	void assign(const std::vector<EXTENT> & file_extents);
+	void append(EXTENT extent);            //merges with the last extent when contiguous
+	void clear() { extents.clear(); ends.clear(); cursor = 0; }
+
+	int lookup(int file_block, std::size_t & hint) const;   //disk block holding file_block, -1 if past the end of the map
+	inline int lookup(int file_block) { return lookup(file_block, cursor); }
+	inline int blocks() const { return ends.empty() ? 0 : ends.back(); }
+	inline const std::vector<EXTENT> & get_extents() const { return extents; }
+};
+
+inline void BlockMap::assign(const std::vector<EXTENT> & file_extents) {
+
+	clear();
+	for (auto extent : file_extents)
+		append(extent);
+}
+
+inline void BlockMap::append(EXTENT extent) {
+
+	if (!extents.empty() && (extents.back().start + extents.back().length == extent.start)) {
+
+		extents.back().length += extent.length;
+		ends.back() += extent.length;
+	}
+	else {
+
+		extents.push_back(extent);
+		ends.push_back(blocks() + extent.length);
+	}
+}
+
+inline int BlockMap::lookup(int file_block, std::size_t & hint) const {
+
+	if ((file_block < 0) || (file_block >= blocks()))
+		return -1;
+
+	//sequential access, same or next extent
+	if ((hint < extents.size()) && (file_block >= extent_begin(hint)) && (file_block < ends[hint]))
+		return extents[hint].start + (file_block - extent_begin(hint));
+
+	if ((hint + 1 < extents.size()) && (file_block >= ends[hint]) && (file_block < ends[hint + 1])) {
+
+		hint++;
+		return extents[hint].start + (file_block - extent_begin(hint));
+	}
+
+	//random access
+	hint = std::upper_bound(ends.begin(), ends.end(), file_block) - ends.begin();
+	return extents[hint].start + (file_block - extent_begin(hint));
+}
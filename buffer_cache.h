@@ -0,0 +1,346 @@
+#pragma once
+
+#include "base.h"
+#include "ldisk.h"
+#include "stats.h"
+
+//Write-back block cache between the filesystem and ldisk
+
+/*
+BUFFER CACHE INFO -
+
+frames - capacity blocks held in memory, each with the block it holds and dirty/referenced bits
+block_frames - block -> frame holding it, -1 if not cached
+dirty_blocks - blocks written since the last flush (can repeat or be clean already, flush skips those)
+hand - CLOCK hand, a referenced frame gets a second chance before it is evicted
+
+a dirty frame goes back to ldisk when it is evicted or on flush, flush writes in block order as one batch
+read_blocks/write_blocks take cached blocks from the frames and send the rest to ldisk as one batch without caching them,
+the caller keeps other threads off those blocks until they return (the file lock does that)
+every public call holds cache_lock, so threads can share the cache
+*/
+
+template<class Geometry = DefaultGeometry>
+class BufferCache {
+
+private:
+
+	static const int BLOCK_SIZE = Geometry::BLOCK_SIZE;
+	static const int NUM_BLOCKS = Geometry::NUM_BLOCKS;
+
+	struct FRAME {
+
+		int block;                 //block in the frame, -1 if empty
+		bool dirty;                //newer than the block on ldisk
+		bool referenced;           //used since the hand last passed
+	};
+
+	Ldisk<Geometry> & ldisk;
+	Stats * stats;                                  //hits and misses, nullptr to not count
+	int capacity;                                   //frames
+	std::vector<char> frame_data;                   //capacity * BLOCK_SIZE bytes
+	std::vector<FRAME> frames;
+	std::vector<int> block_frames;
+	std::vector<int> dirty_blocks;
+	int hand;
+	std::mutex cache_lock;
+
+	inline char * frame_buffer(int frame) { return frame_data.data() + (std::size_t)frame * BLOCK_SIZE; }
+
+	int get_frame(int block_num, bool load);        //frame for a block, read from ldisk on a miss if load
+	int evict();                                    //free a frame, writing it back if dirty
+	void write_back(int frame);
+	void mark_dirty(int frame);
+	void compact_dirty_blocks();                    //drop entries that are no longer dirty or repeat
+
+public:
+
+	BufferCache(Ldisk<Geometry> & disk, int cache_blocks, Stats * counters = nullptr);
+
+	void read_block(int block_num, char * p);
+	void write_block(int block_num, const char * p);
+	void read(int block_num, int offset, char * p, int count);         //count bytes from offset in a block
+	bool read_cached(int block_num, int offset, char * p, int count);  //same, but only from a frame, false on a miss (nothing is read)
+	void write(int block_num, int offset, const char * p, int count);  //count bytes at offset, rest of the block is kept
+	void zero_block(int block_num);
+	void read_blocks(const BLOCK_IO * ios, int count);                 //whole blocks, misses are all in flight at once
+	void write_blocks(const BLOCK_IO * ios, int count);
+
+	void flush();                                   //write every dirty block back, lowest block first
+	void invalidate(int start, int count);          //forget released blocks without writing them
+	void clear();                                   //forget everything (ldisk was reloaded)
+
+	inline int get_capacity() { return capacity; }
+};
+
+template<class Geometry>
+BufferCache<Geometry>::BufferCache(Ldisk<Geometry> & disk, int cache_blocks, Stats * counters) : ldisk(disk), stats(counters) {
+
+	capacity = (cache_blocks > 0) ? cache_blocks : 1;
+	frame_data.resize((std::size_t)capacity * BLOCK_SIZE);
+	clear();
+}
+
+template<class Geometry>
+void BufferCache<Geometry>::clear() {
+
+	std::lock_guard<std::mutex> guard(cache_lock);
+	frames.assign(capacity, { -1, false, false });
+	block_frames.assign(NUM_BLOCKS, -1);
+	dirty_blocks.clear();
+	hand = 0;
+}
+
+template<class Geometry>
+void BufferCache<Geometry>::write_back(int frame) {
+
+	if (frames[frame].dirty) {
+
+		ldisk.write_block(frames[frame].block, frame_buffer(frame));
+		frames[frame].dirty = false;
+	}
+}
+
+template<class Geometry>
+int BufferCache<Geometry>::evict() {
+
+	while (true) {
+
+		int frame = hand;
+		hand = (hand + 1) % capacity;
+
+		if (frames[frame].block == -1)  //empty frame
+			return frame;
+
+		if (frames[frame].referenced) {  //second chance
+
+			frames[frame].referenced = false;
+			continue;
+		}
+
+		write_back(frame);
+		block_frames[frames[frame].block] = -1;
+		frames[frame].block = -1;
+		return frame;
+	}
+}
+
+template<class Geometry>
+int BufferCache<Geometry>::get_frame(int block_num, bool load) {
+
+	int frame = block_frames[block_num];
+
+	if (stats_on(stats)) {
+
+		if (frame == -1)
+			stats->add_cache_misses(1);
+		else
+			stats->add_cache_hits(1);
+	}
+
+	if (frame == -1) {  //miss
+
+		frame = evict();
+		if (load)
+			ldisk.read_block(block_num, frame_buffer(frame));
+
+		frames[frame].block = block_num;
+		frames[frame].dirty = false;
+		block_frames[block_num] = frame;
+	}
+
+	frames[frame].referenced = true;
+	return frame;
+}
+
+template<class Geometry>
+void BufferCache<Geometry>::read_block(int block_num, char * p) {
+
+	std::lock_guard<std::mutex> guard(cache_lock);
+	std::memcpy(p, frame_buffer(get_frame(block_num, true)), BLOCK_SIZE);
+}
+
+template<class Geometry>
+void BufferCache<Geometry>::read(int block_num, int offset, char * p, int count) {
+
+	std::lock_guard<std::mutex> guard(cache_lock);
+	std::memcpy(p, frame_buffer(get_frame(block_num, true)) + offset, count);
+}
+
+template<class Geometry>
+bool BufferCache<Geometry>::read_cached(int block_num, int offset, char * p, int count) {
+
+	std::lock_guard<std::mutex> guard(cache_lock);
+	int frame = block_frames[block_num];
+
+	if (stats_on(stats)) {
+
+		if (frame == -1)
+			stats->add_cache_misses(1);
+		else
+			stats->add_cache_hits(1);
+	}
+
+	if (frame == -1)
+		return false;
+
+	std::memcpy(p, frame_buffer(frame) + offset, count);
+	frames[frame].referenced = true;
+	return true;
+}
+
+//whole block is replaced, so a miss doesn't read the old block first
+template<class Geometry>
+void BufferCache<Geometry>::write_block(int block_num, const char * p) {
+
+	std::lock_guard<std::mutex> guard(cache_lock);
+	int frame = get_frame(block_num, false);
+
+	std::memcpy(frame_buffer(frame), p, BLOCK_SIZE);
+	mark_dirty(frame);
+}
+
+template<class Geometry>
+void BufferCache<Geometry>::write(int block_num, int offset, const char * p, int count) {
+
+	std::lock_guard<std::mutex> guard(cache_lock);
+	int frame = get_frame(block_num, true);
+
+	std::memcpy(frame_buffer(frame) + offset, p, count);
+	mark_dirty(frame);
+}
+
+template<class Geometry>
+void BufferCache<Geometry>::zero_block(int block_num) {
+
+	std::lock_guard<std::mutex> guard(cache_lock);
+	int frame = get_frame(block_num, false);
+
+	std::memset(frame_buffer(frame), 0, BLOCK_SIZE);
+	mark_dirty(frame);
+}
+
+//misses go past the cache, streaming a large file through doesn't push everything else out
+template<class Geometry>
+void BufferCache<Geometry>::read_blocks(const BLOCK_IO * ios, int count) {
+
+	std::vector<BLOCK_IO> misses;
+
+	{
+		std::lock_guard<std::mutex> guard(cache_lock);
+		for (int i = 0; i < count; i++) {
+
+			int frame = block_frames[ios[i].block];
+			if (frame == -1)
+				misses.push_back(ios[i]);
+			else {
+
+				std::memcpy(ios[i].buffer, frame_buffer(frame), BLOCK_SIZE);
+				frames[frame].referenced = true;
+			}
+		}
+	}
+
+	if (stats_on(stats)) {
+
+		stats->add_cache_hits(count - (int)misses.size());
+		stats->add_cache_misses((int)misses.size());
+	}
+
+	ldisk.read_blocks(misses.data(), (int)misses.size());
+}
+
+template<class Geometry>
+void BufferCache<Geometry>::write_blocks(const BLOCK_IO * ios, int count) {
+
+	std::vector<BLOCK_IO> misses;
+
+	{
+		std::lock_guard<std::mutex> guard(cache_lock);
+		for (int i = 0; i < count; i++) {
+
+			int frame = block_frames[ios[i].block];
+			if (frame == -1)
+				misses.push_back(ios[i]);
+			else {
+
+				std::memcpy(frame_buffer(frame), ios[i].buffer, BLOCK_SIZE);
+				frames[frame].referenced = true;
+				mark_dirty(frame);
+			}
+		}
+	}
+
+	if (stats_on(stats)) {
+
+		stats->add_cache_hits(count - (int)misses.size());
+		stats->add_cache_misses((int)misses.size());
+	}
+
+	ldisk.write_blocks(misses.data(), (int)misses.size());
+}
+
+template<class Geometry>
+void BufferCache<Geometry>::mark_dirty(int frame) {
+
+	if (!frames[frame].dirty) {
+
+		frames[frame].dirty = true;
+		dirty_blocks.push_back(frames[frame].block);
+
+		if ((int)dirty_blocks.size() > 2 * capacity)  //evictions left clean entries behind
+			compact_dirty_blocks();
+	}
+}
+
+template<class Geometry>
+void BufferCache<Geometry>::compact_dirty_blocks() {
+
+	auto is_clean = [this](int block_num) {
+
+		int frame = block_frames[block_num];
+		return (frame == -1) || !frames[frame].dirty;
+	};
+
+	dirty_blocks.erase(std::remove_if(dirty_blocks.begin(), dirty_blocks.end(), is_clean), dirty_blocks.end());
+
+	//a block dirtied again after an eviction shows up twice
+	std::sort(dirty_blocks.begin(), dirty_blocks.end());
+	dirty_blocks.erase(std::unique(dirty_blocks.begin(), dirty_blocks.end()), dirty_blocks.end());
+}
+
+template<class Geometry>
+void BufferCache<Geometry>::flush() {
+
+	std::lock_guard<std::mutex> guard(cache_lock);
+	std::vector<BLOCK_IO> writes;
+	std::sort(dirty_blocks.begin(), dirty_blocks.end());
+
+	for (auto block_num : dirty_blocks) {
+
+		int frame = block_frames[block_num];
+		if ((frame != -1) && frames[frame].dirty) {
+
+			writes.push_back({ block_num, frame_buffer(frame) });
+			frames[frame].dirty = false;  //repeats are skipped
+		}
+	}
+
+	ldisk.write_blocks(writes.data(), (int)writes.size());
+	dirty_blocks.clear();
+}
+
+template<class Geometry>
+void BufferCache<Geometry>::invalidate(int start, int count) {
+
+	std::lock_guard<std::mutex> guard(cache_lock);
+	for (int block_num = start; block_num < start + count; block_num++) {
+
+		int frame = block_frames[block_num];
+		if (frame != -1) {
+
+			frames[frame] = { -1, false, false };
+			block_frames[block_num] = -1;
+		}
+	}
+}
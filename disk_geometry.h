@@ -0,0 +1,50 @@
+#pragma once
+
+//Disk geometry, every layout constant of Ldisk and FileSystem comes from here
+
+/*
+GEOMETRY -
+
+[0 - (BITMAP_BLOCKS - 1)] - bitmap, one bit per block
+[DESCRIPTOR_START - DESCRIPTOR_END] - file descriptors (NUM_DESCRIPTORS of DESC_SIZE bytes)
+[FILE_BLOCK_START - (NUM_BLOCKS - 1)] - file blocks and extent blocks, the directory starts with DIRECTORY_BLOCKS of them
+
+DiskGeometry<64, 64> - bitmap in block 0, 24 descriptors in blocks 1 - 12
+*/
+
+template<int BlockSize, int NumBlocks>
+struct DiskGeometry {
+
+	static constexpr int BLOCK_SIZE = BlockSize;    //bytes
+	static constexpr int NUM_BLOCKS = NumBlocks;    //blocks
+	static constexpr int BYTE_SIZE = 8;             //bits
+	static constexpr int INT_SIZE = 4;              //bytes
+
+	//descriptors (file size, extent bookkeeping, then the first extents of the file)
+	static constexpr int EXTENT_SIZE = 2 * INT_SIZE;                        //bytes (start block, length)
+	static constexpr int DIRECT_EXTENTS = 2;                                //extents held in the descriptor
+	static constexpr int EXTENTS_PER_BLOCK = (BLOCK_SIZE / EXTENT_SIZE) - 1;  //extents per extent block (last slot links the next block)
+	static constexpr int DESC_SIZE = (4 * INT_SIZE) + (DIRECT_EXTENTS * EXTENT_SIZE);  //bytes (sizeof(DESCRIPTOR))
+	static constexpr int DESC_PER_BLOCK = BLOCK_SIZE / DESC_SIZE;
+	static constexpr int NUM_DESCRIPTORS = (NUM_BLOCKS * 3) / 8;            //24 on a 64 block disk
+
+	//layout
+	static constexpr int BITMAP_BLOCKS = (NUM_BLOCKS + (BLOCK_SIZE * BYTE_SIZE) - 1) / (BLOCK_SIZE * BYTE_SIZE);
+	static constexpr int DESCRIPTOR_BLOCKS = (NUM_DESCRIPTORS + DESC_PER_BLOCK - 1) / DESC_PER_BLOCK;
+	static constexpr int DESCRIPTOR_START = BITMAP_BLOCKS;
+	static constexpr int DESCRIPTOR_END = DESCRIPTOR_START + DESCRIPTOR_BLOCKS - 1;
+	static constexpr int FILE_BLOCK_START = DESCRIPTOR_END + 1;
+	static constexpr int CACHE_SIZE = FILE_BLOCK_START;                     //bitmap and descriptors are cached
+
+	//file system
+	static constexpr int DIRECTORY_BLOCKS = 3;                              //blocks given to a new directory, it grows after that
+	static constexpr int MAX_NAME_LENGTH = 4;
+
+	static_assert(BLOCK_SIZE % 8 == 0, "block must hold whole 64 bit bitmap words");
+	static_assert(EXTENTS_PER_BLOCK > 0, "block too small for an extent block");
+	static_assert(DESC_PER_BLOCK > 0, "block too small for a descriptor");
+	static_assert(FILE_BLOCK_START + DIRECTORY_BLOCKS <= NUM_BLOCKS, "disk too small for its metadata");
+};
+
+typedef DiskGeometry<64, 64> DefaultGeometry;       //original 4 KiB disk
+typedef DiskGeometry<4096, 65536> LargeGeometry;    //256 MiB disk
@@ -0,0 +1,322 @@
+#pragma once
+
+#include "base.h"
+
+//Coroutine tasks and the small executor they run on
+
+/*
+EXECUTOR INFO -
+
+Executor - a few worker threads resuming coroutines from one ready queue
+schedule - co_await executor.schedule() moves the coroutine onto a worker
+on_completion - co_await on a callback style call (start gets the callback), the coroutine is suspended
+                without holding a worker and resumes on one with the callback's int result
+
+Task<T> - lazy coroutine, starts when it is awaited and resumes whoever awaited it when it finishes
+spawn - starts a Task<void> on the executor without waiting for it
+sync_wait - starts a task and blocks the calling (non worker) thread until it is done
+
+an executor is destroyed after its tasks are done, whatever is still queued runs first
+
+BlockingPool - threads for calls that block, a coroutine waits on one through on_completion so the call
+               holds a pool thread instead of a worker
+*/
+
+class Executor {
+
+private:
+
+	std::vector<std::thread> workers;
+	std::deque<std::coroutine_handle<>> ready;
+	std::mutex queue_lock;
+	std::condition_variable queue_ready;
+	bool stopping;
+
+	void run();
+
+	struct SCHEDULE_AWAITER {
+
+		Executor * executor;
+
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<> handle) { executor->post(handle); }
+		void await_resume() {}
+	};
+
+	template<class Start>
+	struct COMPLETION_AWAITER {
+
+		Executor * executor;
+		Start start;
+		int result;
+
+		bool await_ready() { return false; }
+
+		//the callback can run before start returns, nothing here is touched after it
+		void await_suspend(std::coroutine_handle<> handle) {
+
+			start([this, handle](int value) {
+
+				result = value;
+				executor->post(handle);
+			});
+		}
+
+		int await_resume() { return result; }
+	};
+
+public:
+
+	explicit Executor(int num_threads = 2);
+	~Executor();
+
+	Executor(const Executor &) = delete;
+	Executor & operator=(const Executor &) = delete;
+
+	void post(std::coroutine_handle<> handle);
+	inline SCHEDULE_AWAITER schedule() { return { this }; }
+
+	template<class Start>
+	inline COMPLETION_AWAITER<Start> on_completion(Start start) { return { this, std::move(start), 0 }; }
+};
+
+inline Executor::Executor(int num_threads) : stopping(false) {
+
+	for (int i = 0; i < ((num_threads > 0) ? num_threads : 1); i++)
+		workers.emplace_back(&Executor::run, this);
+}
+
+inline Executor::~Executor() {
+
+	{
+		std::lock_guard<std::mutex> guard(queue_lock);
+		stopping = true;
+	}
+	queue_ready.notify_all();
+
+	for (auto & worker : workers)
+		worker.join();
+}
+
+//notified under the lock, a post from a device thread can finish the last task and the executor can't be destroyed under it
+inline void Executor::post(std::coroutine_handle<> handle) {
+
+	std::lock_guard<std::mutex> guard(queue_lock);
+	ready.push_back(handle);
+	queue_ready.notify_one();
+}
+
+inline void Executor::run() {
+
+	while (true) {
+
+		std::unique_lock<std::mutex> guard(queue_lock);
+		queue_ready.wait(guard, [this] { return stopping || !ready.empty(); });
+
+		if (ready.empty())  //stopping
+			return;
+
+		std::coroutine_handle<> handle = ready.front();
+		ready.pop_front();
+		guard.unlock();
+
+		handle.resume();
+	}
+}
+
+class BlockingPool {
+
+private:
+
+	std::vector<std::thread> threads;
+	std::deque<std::function<void()>> jobs;
+	std::mutex jobs_lock;
+	std::condition_variable jobs_ready;
+	bool stopping;
+
+	void run();
+
+public:
+
+	explicit BlockingPool(int num_threads = 4);
+	~BlockingPool();
+
+	BlockingPool(const BlockingPool &) = delete;
+	BlockingPool & operator=(const BlockingPool &) = delete;
+
+	void post(std::function<void()> job);
+};
+
+inline BlockingPool::BlockingPool(int num_threads) : stopping(false) {
+
+	for (int i = 0; i < ((num_threads > 0) ? num_threads : 1); i++)
+		threads.emplace_back(&BlockingPool::run, this);
+}
+
+//queued jobs still run, their callbacks post to an executor that has to outlive the pool
+inline BlockingPool::~BlockingPool() {
+
+	{
+		std::lock_guard<std::mutex> guard(jobs_lock);
+		stopping = true;
+	}
+	jobs_ready.notify_all();
+
+	for (auto & thread : threads)
+		thread.join();
+}
+
+inline void BlockingPool::post(std::function<void()> job) {
+
+	std::lock_guard<std::mutex> guard(jobs_lock);
+	jobs.push_back(std::move(job));
+	jobs_ready.notify_one();
+}
+
+inline void BlockingPool::run() {
+
+	while (true) {
+
+		std::unique_lock<std::mutex> guard(jobs_lock);
+		jobs_ready.wait(guard, [this] { return stopping || !jobs.empty(); });
+
+		if (jobs.empty())  //stopping
+			return;
+
+		std::function<void()> job = std::move(jobs.front());
+		jobs.pop_front();
+		guard.unlock();
+
+		job();
+	}
+}
+
+template<class T>
+class Task;
+
+//result storage, split out so Task<void> can share the rest
+template<class T>
+struct TASK_RESULT {
+
+	std::optional<T> value;
+	std::exception_ptr error;
+
+	void return_value(T result) { value.emplace(std::move(result)); }
+	T take() {
+
+		if (error)
+			std::rethrow_exception(error);
+		return std::move(*value);
+	}
+};
+
+template<>
+struct TASK_RESULT<void> {
+
+	std::exception_ptr error;
+
+	void return_void() {}
+	void take() {
+
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+
+template<class T = void>
+class Task {
+
+public:
+
+	struct promise_type : TASK_RESULT<T> {
+
+		std::coroutine_handle<> continuation;   //whoever awaited the task
+
+		struct FINAL_AWAITER {
+
+			bool await_ready() noexcept { return false; }
+			void await_resume() noexcept {}
+
+			//hand the thread straight to the awaiting coroutine
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+
+				std::coroutine_handle<> next = handle.promise().continuation;
+				return next ? next : std::noop_coroutine();
+			}
+		};
+
+		Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		FINAL_AWAITER final_suspend() noexcept { return {}; }
+		void unhandled_exception() { this->error = std::current_exception(); }
+	};
+
+private:
+
+	std::coroutine_handle<promise_type> handle;
+
+	explicit Task(std::coroutine_handle<promise_type> coroutine) : handle(coroutine) {}
+
+public:
+
+	Task(Task && other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	Task & operator=(Task && other) noexcept { std::swap(handle, other.handle); return *this; }
+	~Task() { if (handle) handle.destroy(); }
+
+	bool await_ready() { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+
+		handle.promise().continuation = caller;
+		return handle;
+	}
+	T await_resume() { return handle.promise().take(); }
+};
+
+//coroutine that owns itself, frees its frame when it finishes
+struct DETACHED_TASK {
+
+	struct promise_type {
+
+		DETACHED_TASK get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+inline DETACHED_TASK spawn(Executor & executor, Task<void> task) {
+
+	co_await executor.schedule();
+	co_await task;
+}
+
+template<class T>
+DETACHED_TASK run_to_promise(Executor & executor, Task<T> task, std::promise<T> & done) {
+
+	co_await executor.schedule();
+	try {
+
+		if constexpr (std::is_void_v<T>) {
+
+			co_await task;
+			done.set_value();
+		}
+		else
+			done.set_value(co_await task);
+	}
+	catch (...) {
+
+		done.set_exception(std::current_exception());
+	}
+}
+
+template<class T>
+T sync_wait(Executor & executor, Task<T> task) {
+
+	std::promise<T> done;
+	std::future<T> result = done.get_future();
+
+	run_to_promise(executor, std::move(task), done);
+	return result.get();
+}
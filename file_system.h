@@ -1,98 +1,336 @@
 #pragma once
 
-#include "base.h";
+#include "base.h"
 #include "ldisk.h"
+#include "block_map.h"
+#include "buffer_cache.h"
+#include "stats.h"
+#include "trace.h"
 
+template<class Geometry = DefaultGeometry>
 struct FILE_TABLE {
 
-	char r_w[64];              //buffer for file
+	char r_w[Geometry::BLOCK_SIZE];  //buffer for file
 	int index;                 //index for file descriptor
 	int buffer_index;		   //index in buffer
 	int buffer_block;          //block in memory
+	int file_block;            //position of buffer_block in the file (blocks)
+	int generation;            //bumped on close, stale handles no longer match
+	BlockMap block_map;        //extents of the file
+	std::shared_mutex lock;    //exclusive for cursor moves and growth, shared for positional reads
+	std::atomic<int> reads;    //pread_start calls still waiting on block I/O, writes and close wait for them
 };
 
+//fixed size directory record, DIR_ENTRY_SIZE bytes
+struct DIR_ENTRY {
+
+	std::uint8_t name_length;      //0 when the slot is free
+	char name[11];                 //name bytes, zero padded
+	std::uint32_t descriptor;      //index of the file descriptor
+};
+
+static_assert(sizeof(DIR_ENTRY) == 16, "directory records must stay 16 bytes");
+
+struct DIR_LOCATION {
+
+	int block;                 //directory block holding the entry
+	int offset;                //start of the entry in that block
+	int descriptor;            //index of the file descriptor
+};
+
+/*
+LOCKING -
+
+checkpoint_lock - held while a checkpoint is taken and written, and by the commands that replace or save the disk
+journal_lock - shared by every call that changes the disk, exclusive while a commit seals its transaction or a checkpoint takes its snapshot
+               (so nothing half done goes in)
+oft_lock - shared by every call on an open file, exclusive to open/close (the table and its slots change)
+directory_lock - shared for name lookups, exclusive to create/destroy
+FILE_TABLE lock - one per open file, positional reads share it
+                 (pread_start lets go of it while its blocks are read, the file's reads count keeps writes and close off until they are in)
+
+taken in that order, the buffer cache and ldisk lock their own shared state underneath
+
+CHECKPOINTS -
+
+a checkpoint writes the disk into its image (or device file) without closing files: the snapshot is taken like a commit seals,
+then the blocks are written while calls go on (see Ldisk::begin_checkpoint), with a journal the snapshot is committed first
+(the checkpoint fails and writes nothing if that commit does) and the journal is trimmed to what came after it once the image is synced
+the checkpointer thread takes one every interval and when the disk has a number of dirty blocks
+*/
+
+template<class Geometry = DefaultGeometry>
 class FileSystem {
 
 private:
 
-	Ldisk ldisk;
-	const int OFT_SIZE = 4;
+	static const int BLOCK_SIZE = Geometry::BLOCK_SIZE;
+	static const int DIRECTORY_BLOCKS = Geometry::DIRECTORY_BLOCKS;
+	static const int MAX_NAME_LENGTH = Geometry::MAX_NAME_LENGTH;
+	static const int DIR_ENTRY_SIZE = sizeof(DIR_ENTRY);
+	static const int NUM_DESCRIPTORS = Geometry::NUM_DESCRIPTORS;
+	static const int DEFAULT_CACHE_BLOCKS = 64;   //buffer cache frames
+	static const int MAX_TOKENS = 8;              //shell command words, the rest of a line is ignored
+	static const int FILL_CHUNK = 16384;          //bytes per write call for wr
+	static const int IO_BATCH = 32;               //whole blocks handed to the buffer cache at once (in flight together on a device)
+	static const int JOURNAL_GROUP_OPS = 64;      //calls per journal transaction before the next call commits them
+	static const std::int64_t JOURNAL_GROUP_BYTES = 4 << 20;   //or bytes written
+
+	//handle = (generation << HANDLE_SLOT_BITS) | slot, the shell only shows and takes the slot
+	static const int HANDLE_SLOT_BITS = 20;
+	static const int HANDLE_SLOT_MASK = (1 << HANDLE_SLOT_BITS) - 1;
+	static const int HANDLE_GENERATION_MASK = (1 << (31 - HANDLE_SLOT_BITS)) - 1;
+
+	Stats stats;                                                      //off until enabled (stats on)
+	TraceRecorder trace;                                              //off until started (trace <file>)
+	Ldisk<Geometry> ldisk;
+	BufferCache<Geometry> buffer_cache;                               //data and directory blocks go through here
 	bool is_initialized;
-	FILE_TABLE open_file_table[4];
+	std::deque<FILE_TABLE<Geometry>> open_file_table;                 //slot 0 is the directory, grows as files are opened
+	std::vector<int> free_oft_entries;                                //closed slots, reused before the table grows
+	std::vector<int> descriptor_handles;                              //descriptor index -> handle of its open file, -1 if closed
+	std::unordered_map<std::string, DIR_LOCATION> directory_index;   //file name -> directory entry
+	std::vector<DIR_LOCATION> free_directory_slots;                   //unused records, lowest last
+	std::shared_mutex journal_lock;
+	std::shared_mutex oft_lock;
+	std::shared_mutex directory_lock;
+	std::atomic<int> journal_ops;                                     //calls in the open journal transaction
+	std::atomic<std::int64_t> journal_bytes;                          //bytes they wrote
+	std::mutex checkpoint_lock;
+	std::thread checkpointer;                                         //background checkpoints, not joinable when off
+	std::mutex checkpointer_lock;                                     //the settings below
+	std::condition_variable checkpointer_wake;
+	int checkpoint_seconds;                                           //interval, 0 for none
+	bool checkpointer_stop;
+	std::atomic<int> checkpoint_blocks;                               //dirty blocks that start one, 0 for no limit
+	std::atomic<bool> checkpoint_due;                                 //the limit was reached
 
 	void init_directory();
+	void build_directory_index();
+	int grow_directory();
 	void init_fs();
 
 	void remove_descriptor(int desc_index);
 
-	void defrag_block(char * block);
-
-	void create_directory_entry(std::string file_name, int descriptor_index);
-	int find_directory_entry(std::string file_name);
+	int create_directory_entry(std::string file_name, int descriptor_index);
 	void print_directory();
 
-	int get_desc_index(std::string file_name);
+	int get_desc_index(std::string file_name);                         //caller holds directory_lock
+
+	int find_oft_entry();                                              //free slot, -1 if the table is at its limit
+	FILE_TABLE<Geometry> * get_oft_entry(int handle);                  //open file for a handle, nullptr if closed or stale
+	int shell_handle(std::string_view token);                          //the shell shows slot numbers, handle of an open slot, -1 if not
+	inline int make_handle(int slot) { return ((open_file_table[slot].generation & HANDLE_GENERATION_MASK) << HANDLE_SLOT_BITS) | slot; }
 
-	void insert_into_buffer(std::string data, char * buffer, int position);
+	std::shared_lock<std::shared_mutex> begin_change(std::size_t bytes);   //journal_lock for a call that changes the disk, commits a full group first
+	void run_checkpointer();
 
-	int find_oft_entry();
-	bool is_oft_entry(int index);
+	bool load_block(FILE_TABLE<Geometry> * file, int file_block);    //bring a block of the file into r_w
+	int grow_file(FILE_TABLE<Geometry> * file, int bytes);          //add blocks for bytes more data, returns blocks added
+	bool unshare_blocks(FILE_TABLE<Geometry> * file, int position, int length);   //own copies of shared blocks about to be written, false if the disk is full
+	void wait_for_reads(FILE_TABLE<Geometry> * file);                //until no pread_start is reading the file's blocks
+	void wait_for_all_reads();                                       //every open file, before the disk is replaced
+
+	//callers hold oft_lock exclusive
+	int close_handle(int index);
+	void close_all();
+
+	//shell commands, tokens[0] is the command name
+	typedef void (FileSystem::*COMMAND_HANDLER)(const std::string_view * tokens, int count);
+
+	struct COMMAND {
+
+		std::string_view name;
+		COMMAND_HANDLER run;
+		bool needs_init;                   //disk has to be initialized first
+	};
+
+	std::vector<char> read_buffer;         //rd output, reused
+
+	static int tokenize(std::string_view command, std::string_view * tokens);   //returns token count, at most MAX_TOKENS
+
+	void command_create(const std::string_view * tokens, int count);
+	void command_destroy(const std::string_view * tokens, int count);
+	void command_clone(const std::string_view * tokens, int count);
+	void command_open(const std::string_view * tokens, int count);
+	void command_close(const std::string_view * tokens, int count);
+	void command_write(const std::string_view * tokens, int count);
+	void command_read(const std::string_view * tokens, int count);
+	void command_seek(const std::string_view * tokens, int count);
+	void command_directory(const std::string_view * tokens, int count);
+	void command_init(const std::string_view * tokens, int count);
+	void command_device(const std::string_view * tokens, int count);
+	void command_save(const std::string_view * tokens, int count);
+	void command_export(const std::string_view * tokens, int count);
+	void command_dump(const std::string_view * tokens, int count);
+	void command_descriptors(const std::string_view * tokens, int count);
+	void command_oft(const std::string_view * tokens, int count);
+	void command_stats(const std::string_view * tokens, int count);
+	void command_trace(const std::string_view * tokens, int count);
+	void command_journal(const std::string_view * tokens, int count);
+	void command_commit(const std::string_view * tokens, int count);
+	void command_checkpoint(const std::string_view * tokens, int count);
+
+public:
+
+	FileSystem(Ldisk<Geometry> disk, int cache_blocks = DEFAULT_CACHE_BLOCKS);   //starts on disk if it holds a filesystem, else wait for in
+	~FileSystem();
 
 	int create(std::string file_name);
 	int destroy(std::string file_name);
+	int clone(std::string source_name, std::string file_name);        //new file sharing the source's blocks until either one writes them
 
-	int open(std::string file_name);
+	int open(std::string file_name);                                  //returns handle
 	int close(int index);
-	void close_all();
 
-	int read(int index, std::string &mem_area, int count);
-	int write(int index, std::string data);
+	int read(int index, std::span<std::byte> dst);                    //returns bytes read (stops at EOF)
+	int write(int index, std::span<const std::byte> src);             //returns bytes written (stops when the disk is full)
+
+	//positional, start at offset and leave the file position alone
+	int readv(int index, std::span<const std::span<std::byte>> iov, int offset);         //fills each buffer in turn, returns bytes read
+	int writev(int index, std::span<const std::span<const std::byte>> iov, int offset);  //offset can be at most the file size
+	inline int pread(int index, std::span<std::byte> dst, int offset) { return readv(index, std::span(&dst, 1), offset); }
+	inline int pwrite(int index, std::span<const std::byte> src, int offset) { return writev(index, std::span(&src, 1), offset); }
+
+	//pread that doesn't wait for block I/O: cached blocks are copied now, the others are read with Ldisk::read_block_async
+	//and done gets the bytes read (-1 for a bad handle or a failed read) once all of them are in, maybe on the device's thread
+	void pread_start(int index, std::span<std::byte> dst, int offset, std::function<void(int)> done);
+
+	inline Stats & get_stats() { return stats; }                      //snapshot()/reset()/set_enabled() from code
+	inline TraceRecorder & get_trace() { return trace; }              //start()/stop() from code
 
 	int lseek(int index, int pos);
 
 	std::vector<std::string> directory();
 
-public:
+	int commit();   //journal transaction sealed and on disk when it returns, -1 when not journaling or the write failed
+	Ldisk<Geometry> snapshot();   //copy of the disk as it is now (files stay open), shares its blocks until either side writes them
 
-	FileSystem(Ldisk disk);
-	~FileSystem() { close_all(); }   //close all files while being destroyed
+	int checkpoint();                                   //disk written into its image when it returns, -1 if it has none or the write failed
+	void start_checkpointer(int seconds, int blocks);   //every seconds and every blocks dirty blocks (0 for either is never)
+	void stop_checkpointer();                           //waits for a running checkpoint
 
-	void give_command(std::string command);
+	void give_command(std::string_view command);   //one shell command, output is not flushed
 };
 
 
-FileSystem::FileSystem(Ldisk ldisk) : ldisk(ldisk), is_initialized(false) { /* need to call init_fs before using */}
+template<class Geometry>
+FileSystem<Geometry>::FileSystem(Ldisk<Geometry> ldisk, int cache_blocks) : ldisk(ldisk), buffer_cache(this->ldisk, cache_blocks, &stats), is_initialized(false),
+	journal_ops(0), journal_bytes(0), checkpoint_seconds(0), checkpointer_stop(false), checkpoint_blocks(0), checkpoint_due(false) {
+
+	this->ldisk.set_stats(&stats);
+
+	//a copy of a disk in use (snapshot()) carries on from there, anything else needs in first
+	if (this->ldisk.is_formatted()) {
+
+		is_initialized = true;
+		init_fs();
+	}
+}
+
+//close all files while being destroyed, what they wrote is committed
+template<class Geometry>
+FileSystem<Geometry>::~FileSystem() {
+
+	stop_checkpointer();
+	{
+		std::unique_lock<std::shared_mutex> table_guard(oft_lock);
+		close_all();
+	}
+	commit();
+}
 
-void FileSystem::init_fs() {
+template<class Geometry>
+void FileSystem<Geometry>::init_fs() {
+
+	if (open_file_table.empty())
+		open_file_table.emplace_back();  //directory entry
+	open_file_table[0].generation = 0;
 
 	init_directory();
 
-	//init all other OFT entries
-	for (int i = 1; i < OFT_SIZE; i++) {
+	//init all other OFT entries (keep their generations so old handles stay stale)
+	free_oft_entries.clear();
+	for (int i = (int)open_file_table.size() - 1; i >= 1; i--) {
 
 		open_file_table[i].index = -1;
 		open_file_table[i].buffer_index = 0;
 		open_file_table[i].buffer_block = 0;
-
-		//init buffers
-		for (int j = 0; j < 64; j++)
-			open_file_table[i].r_w[j] = 0;
+		open_file_table[i].file_block = 0;
+		open_file_table[i].generation++;
+		open_file_table[i].block_map.clear();
+		free_oft_entries.push_back(i);
 	}
+
+	descriptor_handles.assign(NUM_DESCRIPTORS, -1);
 }
 
-void FileSystem::init_directory() {
+template<class Geometry>
+void FileSystem<Geometry>::init_directory() {
+
+	FILE_TABLE<Geometry> * directory = &open_file_table[0];
+	std::vector<EXTENT> extents;
 
 	//init directory
-	open_file_table[0].index = ldisk.get_directory_index();
-	open_file_table[0].buffer_index = 0;
+	directory->index = ldisk.get_directory_index();
+	directory->buffer_index = 0;
 
-	//read first block into buffer
-	std::vector<int> directory_descriptor = ldisk.get_descriptor(open_file_table[0].index);
-	ldisk.read_block(directory_descriptor[1], open_file_table[0].r_w);
-	open_file_table[0].buffer_block = directory_descriptor[1];
+	ldisk.get_extents(directory->index, extents);
+	directory->block_map.assign(extents);
+
+	build_directory_index();
 }
 
-void FileSystem::print_directory() {
+//scan the directory once, afterwards entries are found through directory_index
+template<class Geometry>
+void FileSystem<Geometry>::build_directory_index() {
+
+	BlockMap & dir_map = open_file_table[0].block_map;
+	DIR_ENTRY dir_buffer[BLOCK_SIZE / DIR_ENTRY_SIZE];
+
+	directory_index.clear();
+	free_directory_slots.clear();
+
+	for (int dir_block = dir_map.blocks() - 1; dir_block >= 0; dir_block--) {  //each block (last first, so the free list pops in order)
+
+		int block_num = dir_map.lookup(dir_block);
+		buffer_cache.read_block(block_num, (char *)dir_buffer);
+		for (int j = (BLOCK_SIZE / DIR_ENTRY_SIZE) - 1; j >= 0; j--) {  //each record in block
+
+			DIR_LOCATION location = { block_num, j * DIR_ENTRY_SIZE, (int)dir_buffer[j].descriptor };
+
+			if (dir_buffer[j].name_length == 0)
+				free_directory_slots.push_back(location);
+			else
+				directory_index[std::string(dir_buffer[j].name, dir_buffer[j].name_length)] = location;
+		}
+	}
+}
+
+//add a block to the directory when every record is used
+template<class Geometry>
+int FileSystem<Geometry>::grow_directory() {
+
+	FILE_TABLE<Geometry> * directory = &open_file_table[0];
+	EXTENT added = ldisk.grow_descriptor(directory->index, 1);
+
+	if (added.length == 0)  //disk full
+		return -1;
+
+	directory->block_map.append(added);
+	ldisk.update_descriptor_size(directory->index, directory->block_map.blocks() * BLOCK_SIZE);
+
+	//new block starts with every record free
+	buffer_cache.zero_block(added.start);
+
+	for (int j = (BLOCK_SIZE / DIR_ENTRY_SIZE) - 1; j >= 0; j--)
+		free_directory_slots.push_back({ added.start, j * DIR_ENTRY_SIZE, 0 });
+
+	return 0;
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::print_directory() {
 
 	std::vector<std::string> file_names = directory();
 	if (file_names.size() > 0) {
@@ -100,585 +338,1478 @@ void FileSystem::print_directory() {
 		for (auto file_name : file_names)
 			std::cout << file_name << " ";
 	}
-	std::cout << std::endl;
+	std::cout << '\n';
 }
 
-std::vector<std::string> FileSystem::directory() {
+template<class Geometry>
+std::vector<std::string> FileSystem<Geometry>::directory() {
 
-	FILE_TABLE * directory = &open_file_table[0];
-	std::vector<int> dir_descriptor = ldisk.get_descriptor(directory->index);
+	TraceScope trace_scope(&trace, TRACE_DIRECTORY);
+	std::shared_lock<std::shared_mutex> table_guard(oft_lock);  //open can grow the table under the directory's slot
+	std::shared_lock<std::shared_mutex> directory_guard(directory_lock);
+	const BlockMap & dir_map = open_file_table[0].block_map;
 	std::vector<std::string> file_names;
-	std::string file_name;
-
-	//find open entry (start with current block)
-	for (int dir_block = 1; dir_block < 4; dir_block++) {  //each block
+	DIR_ENTRY entries[BLOCK_SIZE / DIR_ENTRY_SIZE];
+	std::size_t hint = 0;
 
-		ldisk.read_block(dir_descriptor[dir_block], directory->r_w);
-		directory->buffer_block = dir_descriptor[dir_block];
-		for (int j = 0; j < 64; j++) {  //each index in block
+	for (int dir_block = 0; dir_block < dir_map.blocks(); dir_block++) {  //each block
 
-			if (directory->r_w[j] != NULL) {  //ignore empty spaces
+		buffer_cache.read_block(dir_map.lookup(dir_block, hint), (char *)entries);
+		for (int j = 0; j < BLOCK_SIZE / DIR_ENTRY_SIZE; j++) {  //each record in block
 
-				if (isInteger(std::string(1, directory->r_w[j]))) {
-
-					file_names.push_back(file_name);
-					file_name = "";
-				}
-				else
-					file_name += directory->r_w[j];
-			}
+			if (entries[j].name_length != 0)  //ignore free slots
+				file_names.push_back(std::string(entries[j].name, entries[j].name_length));
 		}
 	}
 
+	trace_scope.result((int)file_names.size());
 	return file_names;
 }
 
-int FileSystem::lseek(int index, int pos) {
+template<class Geometry>
+bool FileSystem<Geometry>::load_block(FILE_TABLE<Geometry> * file, int file_block) {
 
-	FILE_TABLE * curr_file = nullptr;
-	std::vector<int> file_desc;
-	int block_index = 0;
-	int old_block = 0;
+	int block_num = file->block_map.lookup(file_block);
 
-	if (is_oft_entry(index)) {
+	if (block_num == -1)  //past the end of the file
+		return false;
 
-		curr_file = &open_file_table[index];
-		file_desc = ldisk.get_descriptor(curr_file->index);
-		old_block = curr_file->buffer_block;
-		
-		if (pos < file_desc[0]) {  //can't seek beyond EOF
+	if (block_num != file->buffer_block)
+		buffer_cache.read_block(block_num, file->r_w);
 
-			if (pos < 64)
-				block_index = 1;
-			else if ((pos >= 64) && (pos < 128))
-				block_index = 2;
-			else if ((pos >= 128) && (pos < 192))
-				block_index = 3;
+	file->buffer_block = block_num;
+	file->file_block = file_block;
+	return true;
+}
 
-			if (file_desc[block_index] != 0) {  //check if in files range
+template<class Geometry>
+int FileSystem<Geometry>::grow_file(FILE_TABLE<Geometry> * file, int bytes) {
 
-				curr_file->buffer_index = (pos) - ((block_index - 1) * 64); //adjust index
-				curr_file->buffer_block = file_desc[block_index];         //store current block
+	EXTENT added = ldisk.grow_descriptor(file->index, (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE);
 
-				if (curr_file->buffer_block != old_block)
-					ldisk.read_block(curr_file->buffer_block, curr_file->r_w);  //read new block in if need be
-			}
+	if (added.length > 0)
+		file->block_map.append(added);
+
+	return added.length;
+}
+
+//every shared block is replaced in one new extent list, blocks the write covers whole aren't copied,
+//the old ones are let go afterwards (freed if the other holders copied theirs meanwhile)
+template<class Geometry>
+bool FileSystem<Geometry>::unshare_blocks(FILE_TABLE<Geometry> * file, int position, int length) {
+
+	if ((ldisk.get_shared_blocks() == 0) || (length <= 0))
+		return true;
+
+	long long end = (long long)position + length;
+	int last_block = (int)std::min<long long>((end - 1) / BLOCK_SIZE, file->block_map.blocks() - 1);
+	std::vector<int> shared;   //file blocks
+	std::vector<int> old_blocks;
+	std::vector<int> new_blocks;
+
+	for (int file_block = position / BLOCK_SIZE; file_block <= last_block; file_block++) {
+
+		int block_num = file->block_map.lookup(file_block);
+		if (ldisk.is_shared(block_num)) {
+
+			shared.push_back(file_block);
+			old_blocks.push_back(block_num);
+		}
+	}
+
+	if (shared.empty())
+		return true;
+
+	//one run if there is one, else block by block
+	int count = (int)shared.size();
+	int start = ldisk.allocate_contiguous(count);
+
+	for (int i = 0; i < count; i++) {
+
+		int block_num = (start != -1) ? start + i : ldisk.find_free_block();
+		if (block_num == -1) {  //disk full
+
+			for (auto taken : new_blocks)
+				ldisk.release_block(taken);
+			return false;
 		}
+		new_blocks.push_back(block_num);
+	}
+
+	char copy[BLOCK_SIZE];
+	for (int i = 0; i < count; i++) {
+
+		long long first_byte = (long long)shared[i] * BLOCK_SIZE;
+		if ((first_byte < position) || (first_byte + BLOCK_SIZE > end)) {
+
+			buffer_cache.read_block(old_blocks[i], copy);
+			buffer_cache.write_block(new_blocks[i], copy);
+		}
+	}
+
+	//same extents with the copies spliced in
+	std::vector<EXTENT> extents;
+	auto add = [&extents](EXTENT extent) {
+
+		if (!extents.empty() && (extents.back().start + extents.back().length == extent.start))
+			extents.back().length += extent.length;
 		else
-			return -1;
+			extents.push_back(extent);
+	};
+
+	int file_block = 0;
+	std::size_t next = 0;
+	for (auto extent : file->block_map.get_extents()) {
+
+		int extent_end = file_block + extent.length;
+		int from = file_block;
+
+		for (; (next < shared.size()) && (shared[next] < extent_end); next++) {
+
+			if (shared[next] > from)
+				add({ extent.start + (from - file_block), shared[next] - from });
+			add({ new_blocks[next], 1 });
+			from = shared[next] + 1;
+		}
+
+		if (extent_end > from)
+			add({ extent.start + (from - file_block), extent_end - from });
+		file_block = extent_end;
+	}
+
+	if (!ldisk.set_extents(file->index, extents)) {  //no room for the longer list
+
+		for (auto taken : new_blocks) {
+
+			buffer_cache.invalidate(taken, 1);
+			ldisk.release_block(taken);
+		}
+		return false;
 	}
 
-	return curr_file->buffer_index;
+	file->block_map.assign(extents);
+	for (int i = 0; i < count; i++) {
+
+		if (file->buffer_block == old_blocks[i])  //r_w holds the block, it lives in the copy now
+			file->buffer_block = new_blocks[i];
+		ldisk.drop_blocks(old_blocks[i], 1, [this](int first, int blocks) { buffer_cache.invalidate(first, blocks); });
+	}
+
+	return true;
 }
 
+template<class Geometry>
+std::shared_lock<std::shared_mutex> FileSystem<Geometry>::begin_change(std::size_t bytes) {
 
-int FileSystem::create(std::string file_name) {
+	if ((journal_ops.load(std::memory_order_relaxed) >= JOURNAL_GROUP_OPS) || (journal_bytes.load(std::memory_order_relaxed) >= JOURNAL_GROUP_BYTES))
+		commit();
 
-	bool was_created = false;
+	std::shared_lock<std::shared_mutex> journal_guard(journal_lock);
+	if (ldisk.is_journaling()) {
 
-	if ( (file_name.length() <= 4) && (find_directory_entry(file_name) == -1) ) {
+		journal_ops.fetch_add(1, std::memory_order_relaxed);
+		journal_bytes.fetch_add((std::int64_t)std::min<std::size_t>(bytes, JOURNAL_GROUP_BYTES), std::memory_order_relaxed);
+	}
 
-		int file_descriptor = ldisk.init_descriptor(ldisk.find_free_block());  //create descriptor
+	int limit = checkpoint_blocks.load(std::memory_order_relaxed);
+	if ((limit > 0) && (ldisk.get_dirty_blocks() >= limit) && !checkpoint_due.exchange(true)) {
 
-		if (file_descriptor != -1) //if created create directory entry
-			create_directory_entry(file_name, file_descriptor);
-		else
-			return -1;
+		std::lock_guard<std::mutex> guard(checkpointer_lock);  //so the wake can't fall between its check and its wait
+		checkpointer_wake.notify_one();
 	}
-	else
-		return -1;
 
-	return 0;
+	return journal_guard;
 }
 
+//the seal waits for running calls, the write and sync don't hold anything up, commits that overlap share one
+template<class Geometry>
+int FileSystem<Geometry>::commit() {
 
-int FileSystem::destroy(std::string file_name) {
+	std::shared_ptr<Journal> journal;
+	std::uint64_t sequence;
 
-	FILE_TABLE * directory = &open_file_table[0];
-	int dir_location = find_directory_entry(file_name);
-	bool clear_bytes = true;
+	{
+		std::unique_lock<std::shared_mutex> journal_guard(journal_lock);
+		if (!ldisk.is_journaling())
+			return -1;
 
-	int original_location = dir_location;
+		buffer_cache.flush();  //written data is only in the cache until now
+		sequence = ldisk.seal_journal();
+		journal = ldisk.get_journal();
+		journal_ops = 0;
+		journal_bytes = 0;
+	}
 
-	if (dir_location != -1) {
+	return journal->wait_durable(sequence) ? 0 : -1;
+}
 
-		//close the file first
-		int desc_index = get_desc_index(file_name);
-		for (int oft_index = 1; oft_index < 4; oft_index++) {
-			if (open_file_table[oft_index].index == desc_index) {
-				close(oft_index);
-				break;
-			}
-		}
+//written data is flushed first, like a commit the copy waits for running calls
+template<class Geometry>
+Ldisk<Geometry> FileSystem<Geometry>::snapshot() {
+
+	std::unique_lock<std::shared_mutex> journal_guard(journal_lock);
+	buffer_cache.flush();
+	return ldisk;
+}
 
-		while (clear_bytes) {
+//the snapshot waits for running calls like a commit's seal, writing it out doesn't hold them up
+template<class Geometry>
+int FileSystem<Geometry>::checkpoint() {
 
-			if (isInteger(std::string(1, directory->r_w[dir_location]))) {
+	std::lock_guard<std::mutex> checkpoint_guard(checkpoint_lock);
+	std::shared_ptr<Journal> journal;
+	std::uint64_t sequence = 0;
 
-				remove_descriptor(directory->r_w[dir_location] - '0');   //convert arg to int and free descriptor
-				clear_bytes = false;
-			}
-			directory->r_w[dir_location] = 0;
-			dir_location++;
+	{
+		std::unique_lock<std::shared_mutex> journal_guard(journal_lock);
+		buffer_cache.flush();  //written data is only in the cache until now
+
+		if (ldisk.is_journaling()) {
+
+			sequence = ldisk.seal_journal();
+			journal = ldisk.get_journal();
+			journal_ops = 0;
+			journal_bytes = 0;
 		}
 
-		defrag_block(directory->r_w);
-		ldisk.write_block(directory->buffer_block, directory->r_w);  //update directory on disk
+		if (!ldisk.begin_checkpoint())
+			return -1;
 	}
-	else
+
+	//a crash part way through the image is repaired by replaying the journal, so the snapshot has to be in it first
+	if (journal && !journal->wait_durable(sequence)) {
+
+		ldisk.cancel_checkpoint();
 		return -1;
+	}
+
+	if (!ldisk.write_checkpoint())
+		return -1;
+
+	//the image holds every transaction up to the snapshot, only the ones sealed since are still needed
+	if (journal)
+		ldisk.trim_journal(sequence);
+	return 0;
 }
 
-void FileSystem::defrag_block(char * block) {
+template<class Geometry>
+void FileSystem<Geometry>::start_checkpointer(int seconds, int blocks) {
+
+	stop_checkpointer();
+	checkpoint_seconds = seconds;
+	checkpointer_stop = false;
+	checkpoint_due = false;
+	checkpoint_blocks = blocks;
+	checkpointer = std::thread(&FileSystem::run_checkpointer, this);
+}
 
-	char new_block[64];
-	//initialize
-	for (int i = 0; i < 64; i++)
-		new_block[i] = 0;
+template<class Geometry>
+void FileSystem<Geometry>::stop_checkpointer() {
 
-	//defrag
-	for (int i = 0; i < 64; i++)
-		if (block[i] != NULL)
-			new_block[i] = block[i];
+	checkpoint_blocks = 0;
+	if (!checkpointer.joinable())
+		return;
 
-	//copy to original block
-	for (int i = 0; i < 64; i++)
-		block[i] = new_block[i];
+	{
+		std::lock_guard<std::mutex> guard(checkpointer_lock);
+		checkpointer_stop = true;
+	}
+	checkpointer_wake.notify_one();
+	checkpointer.join();
 }
 
-void FileSystem::remove_descriptor(int desc_index) {
+//a checkpoint with nothing dirty is skipped, one that can't be taken (no image yet) is tried again next time
+template<class Geometry>
+void FileSystem<Geometry>::run_checkpointer() {
 
-	int block_counter = 0;
-	std::vector<int> file_descriptor = ldisk.get_descriptor(desc_index);
+	std::unique_lock<std::mutex> guard(checkpointer_lock);
+	auto woken = [this] { return checkpointer_stop || checkpoint_due.load(); };
 
-	ldisk.destroy_descriptor(desc_index);
-	for (auto desc_int : file_descriptor) { //release reserved blocks
+	while (!checkpointer_stop) {
 
-		if (block_counter > 0)             //ignore file size
-			ldisk.release_block(desc_int);
-		block_counter++;
+		if (checkpoint_seconds > 0)
+			checkpointer_wake.wait_for(guard, std::chrono::seconds(checkpoint_seconds), woken);
+		else
+			checkpointer_wake.wait(guard, woken);
+
+		if (checkpointer_stop)
+			break;
+
+		checkpoint_due = false;
+		guard.unlock();
+		if (ldisk.get_dirty_blocks() > 0)
+			checkpoint();
+		guard.lock();
 	}
 }
 
-int FileSystem::get_desc_index(std::string file_name) {
+template<class Geometry>
+int FileSystem<Geometry>::lseek(int index, int pos) {
 
-	int desc_index = -1;
-	int dir_location = find_directory_entry(file_name);
-	std::stringstream ss;
+	StatScope scope(&stats, STAT_LSEEK);
+	TraceScope trace_scope(&trace, TRACE_LSEEK);
+	trace_scope.set_io(index, 0, pos);
+	FILE_TABLE<Geometry> * curr_file = nullptr;
+	DESCRIPTOR<Geometry> file_desc;
 
-	if (dir_location != -1) {
+	std::shared_lock<std::shared_mutex> table_guard(oft_lock);
+	curr_file = get_oft_entry(index);
 
-		if (isInteger(std::string(std::string(1, open_file_table[0].r_w[dir_location + file_name.length() + 1])))) //check if double digit descriptor
-			ss << open_file_table[0].r_w[dir_location + file_name.length() + 1];
+	if (curr_file != nullptr) {
 
-		ss << open_file_table[0].r_w[dir_location + file_name.length()];
-		ss >> desc_index;
-	}
+		std::unique_lock<std::shared_mutex> file_guard(curr_file->lock);
+		file_desc = ldisk.get_descriptor(curr_file->index);
+
+		if ((pos < 0) || (pos > file_desc.size))  //can't seek beyond EOF
+			return -1;
+
+		//a position on a block boundary stays at the end of the block before it
+		int file_block = (pos / BLOCK_SIZE);
+		int buffer_index = pos % BLOCK_SIZE;
+		if ((buffer_index == 0) && (file_block > 0)) {
 
-	return desc_index;
+			file_block--;
+			buffer_index = BLOCK_SIZE;
+		}
+
+		if (!load_block(curr_file, file_block))  //read new block in if need be
+			return -1;
+		curr_file->buffer_index = buffer_index;
+
+		return trace_scope.result(pos);
+	}
+	else
+		return -1;
 }
 
-void FileSystem::create_directory_entry(std::string file_name, int descriptor_index) {
 
-	FILE_TABLE * directory = &open_file_table[0];
-	std::vector<int> dir_descriptor = ldisk.get_descriptor(directory->index);
+template<class Geometry>
+int FileSystem<Geometry>::create(std::string file_name) {
 
-	//create the entry
-	std::stringstream ss;
-	ss << file_name;
-	ss << descriptor_index;
+	StatScope scope(&stats, STAT_CREATE);
+	TraceScope trace_scope(&trace, TRACE_CREATE);
+	trace_scope.set_name(file_name);
+	auto journal_guard = begin_change(0);
+	std::unique_lock<std::shared_mutex> directory_guard(directory_lock);
+
+	if ( !file_name.empty() && ((int)file_name.length() <= MAX_NAME_LENGTH) && (get_desc_index(file_name) == -1) ) {
 
-	//find open entry (start with current block)
-	for (int dir_block = 1; dir_block < 4; dir_block++) {  //each block
+		int first_block = ldisk.find_free_block();
+		if (first_block == -1)  //disk full
+			return -1;
 
-		ldisk.read_block(dir_descriptor[dir_block], directory->r_w);
-		directory->buffer_block = dir_descriptor[dir_block];
-		for (int j = 0; j < 64; j++) {  //each index in block
+		int file_descriptor = ldisk.init_descriptor(first_block);  //create descriptor
 
-			if (directory->r_w[j] == NULL) { //check if open entry
+		if (file_descriptor == -1) {
 
-				insert_into_buffer(ss.str(), directory->r_w, j);
-				ldisk.write_block(dir_descriptor[dir_block], directory->r_w);
-				return;
-			}
+			ldisk.release_block(first_block);
+			return -1;
+		}
+
+		if (create_directory_entry(file_name, file_descriptor) == -1) {  //directory full
+
+			remove_descriptor(file_descriptor);
+			return -1;
 		}
 	}
+	else
+		return -1;
+
+	return trace_scope.result(0);
 }
 
-int FileSystem::find_directory_entry(std::string file_name) {
 
-	std::string search_string = "";
+template<class Geometry>
+int FileSystem<Geometry>::destroy(std::string file_name) {
 
-	FILE_TABLE * directory = &open_file_table[0];
-	std::vector<int> dir_descriptor = ldisk.get_descriptor(directory->index);
+	StatScope scope(&stats, STAT_DESTROY);
+	TraceScope trace_scope(&trace, TRACE_DESTROY);
+	trace_scope.set_name(file_name);
+	auto journal_guard = begin_change(0);
+	std::unique_lock<std::shared_mutex> table_guard(oft_lock);
+	std::unique_lock<std::shared_mutex> directory_guard(directory_lock);
+	auto entry = directory_index.find(file_name);
 
-	//find open entry (start with current block)
-	for (int dir_block = 1; dir_block < 4; dir_block++) {  //each block
+	if (entry != directory_index.end()) {
 
-		ldisk.read_block(dir_descriptor[dir_block], directory->r_w);
-		directory->buffer_block = dir_descriptor[dir_block];
-		for (int j = 0; j < 64; j++) {  //each index in block
+		DIR_LOCATION location = entry->second;
 
-			if (directory->r_w[j] != NULL) {  //ignore spaces
+		//close the file first
+		if (descriptor_handles[location.descriptor] != -1)
+			close_handle(descriptor_handles[location.descriptor]);
 
-				if (isInteger(std::string(1, directory->r_w[j]))) {  //check if descriptor
+		//free the record
+		DIR_ENTRY free_entry = {};
+		buffer_cache.write(location.block, location.offset, (const char *)&free_entry, DIR_ENTRY_SIZE);
 
-					if (search_string == file_name)
-						return j - search_string.length();  //start of this files entry
-					else
-						search_string = "";  //reset for next file_name
-				}
-				else
-					search_string += directory->r_w[j];   //build current file_name
-			}
+		remove_descriptor(location.descriptor);
+		free_directory_slots.push_back(location);
+		directory_index.erase(entry);
+		return trace_scope.result(0);
+	}
+	else
+		return -1;
+}
+
+//the table is held exclusive so no write is copying blocks of the source while they gain their shares
+template<class Geometry>
+int FileSystem<Geometry>::clone(std::string source_name, std::string file_name) {
+
+	StatScope scope(&stats, STAT_CLONE);
+	TraceScope trace_scope(&trace, TRACE_CLONE);
+	trace_scope.set_names(source_name, file_name);
+	auto journal_guard = begin_change(0);
+	std::unique_lock<std::shared_mutex> table_guard(oft_lock);
+	std::unique_lock<std::shared_mutex> directory_guard(directory_lock);
+	int source = get_desc_index(source_name);
+
+	if ((source != -1) && !file_name.empty() && ((int)file_name.length() <= MAX_NAME_LENGTH) && (get_desc_index(file_name) == -1)) {
+
+		int file_descriptor = ldisk.clone_descriptor(source);
+		if (file_descriptor == -1)  //no descriptor or disk full
+			return -1;
+
+		if (create_directory_entry(file_name, file_descriptor) == -1) {  //directory full
+
+			remove_descriptor(file_descriptor);
+			return -1;
 		}
 	}
+	else
+		return -1;
+
+	return trace_scope.result(0);
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::remove_descriptor(int desc_index) {
+
+	std::vector<EXTENT> extents;
+	ldisk.get_extents(desc_index, extents);
+
+	ldisk.destroy_descriptor(desc_index);
+	for (auto extent : extents) //release reserved blocks (ones a clone still holds stay)
+		ldisk.drop_blocks(extent.start, extent.length, [this](int start, int count) { buffer_cache.invalidate(start, count); });
+}
+
+template<class Geometry>
+int FileSystem<Geometry>::get_desc_index(std::string file_name) {
+
+	auto entry = directory_index.find(file_name);
+
+	if (entry != directory_index.end())
+		return entry->second.descriptor;
+
 	return -1;
 }
 
-void FileSystem::insert_into_buffer(std::string data, char * buffer, int position) {
+template<class Geometry>
+int FileSystem<Geometry>::create_directory_entry(std::string file_name, int descriptor_index) {
+
+	if (free_directory_slots.empty() && (grow_directory() == -1))  //directory full and disk full
+		return -1;
 
-	for (int i = 0; i < data.length(); i++, position++)
-		buffer[position] = data[i];
+	DIR_LOCATION location = free_directory_slots.back();
+	free_directory_slots.pop_back();
+	location.descriptor = descriptor_index;
+
+	//create the entry
+	DIR_ENTRY entry = {};
+	entry.name_length = (std::uint8_t)file_name.length();
+	std::memcpy(entry.name, file_name.data(), file_name.length());
+	entry.descriptor = descriptor_index;
+
+	buffer_cache.write(location.block, location.offset, (const char *)&entry, DIR_ENTRY_SIZE);
+
+	directory_index[file_name] = location;
+	return 0;
 }
 
-bool FileSystem::is_oft_entry(int index) { 
-	
-	if ((index >= 0) && (index <= 3)) 
-		return open_file_table[index].index != -1;
-	else
-		return false;
+
+//generations only guard handles held in code, a script reusing a slot's number keeps working
+template<class Geometry>
+int FileSystem<Geometry>::shell_handle(std::string_view token) {
+
+	int slot;
+
+	if (!parse_int(token, slot) || (slot <= 0) || (slot > HANDLE_SLOT_MASK))
+		return -1;
+
+	std::shared_lock<std::shared_mutex> table_guard(oft_lock);
+	if ((slot >= (int)open_file_table.size()) || (open_file_table[slot].index == -1))
+		return -1;
+	return make_handle(slot);
+}
+
+//slot 0 (the directory) is never handed out, so it is not a valid handle
+template<class Geometry>
+FILE_TABLE<Geometry> * FileSystem<Geometry>::get_oft_entry(int handle) {
+
+	int slot = handle & HANDLE_SLOT_MASK;
+
+	if ((handle <= 0) || (slot == 0) || (slot >= (int)open_file_table.size()))
+		return nullptr;
+
+	FILE_TABLE<Geometry> * entry = &open_file_table[slot];
+	if ((entry->index == -1) || (make_handle(slot) != handle))
+		return nullptr;
+
+	return entry;
 }
 
-int FileSystem::open(std::string file_name) {
+template<class Geometry>
+int FileSystem<Geometry>::open(std::string file_name) {
 
-	FILE_TABLE * new_entry = nullptr;
-	int oft_index = find_oft_entry();
+	StatScope scope(&stats, STAT_OPEN);
+	TraceScope trace_scope(&trace, TRACE_OPEN);
+	trace_scope.set_name(file_name);
+	std::unique_lock<std::shared_mutex> table_guard(oft_lock);
+	std::shared_lock<std::shared_mutex> directory_guard(directory_lock);
+	FILE_TABLE<Geometry> * new_entry = nullptr;
 	int desc_index = get_desc_index(file_name);
-	std::vector<int> file_desc = ldisk.get_descriptor(desc_index);
+	std::vector<EXTENT> extents;
 
-	if ((oft_index != -1) && (desc_index != -1)) {
+	if ((desc_index != -1) && (descriptor_handles[desc_index] == -1)) {  //check if already open
 
-		//check if already open
-		for (int i = 1; i < 4; i++) {
-			if (open_file_table[i].index == desc_index)
-				return -1;
-		}
+		int oft_index = find_oft_entry();
+		if (oft_index == -1)
+			return -1;
 
 		//init the oft with the new file, read first block into memory
 		new_entry = &open_file_table[oft_index];
 		new_entry->index = desc_index;
-		new_entry->buffer_block = file_desc[1];  //set to first block
-		ldisk.read_block(new_entry->buffer_block, new_entry->r_w);  //read first block into memory
+		ldisk.get_extents(desc_index, extents);
+		new_entry->block_map.assign(extents);
+		new_entry->buffer_block = 0;
+		load_block(new_entry, 0);  //read first block into memory
 		new_entry->buffer_index = 0;
 
-		return oft_index;
+		descriptor_handles[desc_index] = make_handle(oft_index);
+		return trace_scope.result(descriptor_handles[desc_index]);
 	}
 	else
 		return -1;
 
 }
 
-int FileSystem::close(int index) {
+template<class Geometry>
+int FileSystem<Geometry>::close(int index) {
 
-	FILE_TABLE * close_file = nullptr;
+	StatScope scope(&stats, STAT_CLOSE);
+	TraceScope trace_scope(&trace, TRACE_CLOSE);
+	trace_scope.set_io(index, 0);
+	auto journal_guard = begin_change(0);
+	std::unique_lock<std::shared_mutex> table_guard(oft_lock);
+	return trace_scope.result(close_handle(index));
+}
+
+template<class Geometry>
+int FileSystem<Geometry>::close_handle(int index) {
+
+	FILE_TABLE<Geometry> * close_file = get_oft_entry(index);
+
+	if (close_file != nullptr) {
 
-	if (is_oft_entry(index)) {
+		wait_for_reads(close_file);
 
-		close_file = &open_file_table[index];
-		
 		//write out block to be safe
-		ldisk.write_block(close_file->buffer_block, close_file->r_w);
+		buffer_cache.write_block(close_file->buffer_block, close_file->r_w);
+		buffer_cache.flush();
 
 		//reset
+		descriptor_handles[close_file->index] = -1;
+		free_oft_entries.push_back(index & HANDLE_SLOT_MASK);
+		close_file->generation++;
 		close_file->index = -1;
 		close_file->buffer_index = 0;
 		close_file->buffer_block = 0;
+		close_file->file_block = 0;
+		close_file->block_map.clear();
 		return 0;
 	}
 	else
 		return -1;
 }
 
-void FileSystem::close_all() {
+template<class Geometry>
+void FileSystem<Geometry>::close_all() {
 
-	for (int i = 0; i < 4; i++) {
+	for (int i = 1; i < (int)open_file_table.size(); i++) {
 
-		if (is_oft_entry(i))
-			close(i);
+		if (open_file_table[i].index != -1)
+			close_handle(make_handle(i));
 	}
+
+	buffer_cache.flush();
 }
 
-int FileSystem::find_oft_entry() {
+template<class Geometry>
+int FileSystem<Geometry>::find_oft_entry() {
 
-	for (int i = 0; i < OFT_SIZE; i++) {
+	if (!free_oft_entries.empty()) {
 
-		if (open_file_table[i].index == -1)
-			return i;
+		int slot = free_oft_entries.back();
+		free_oft_entries.pop_back();
+		return slot;
 	}
-	return -1;
+
+	if ((int)open_file_table.size() > HANDLE_SLOT_MASK)  //no slot numbers left
+		return -1;
+
+	open_file_table.emplace_back();
+	open_file_table.back().index = -1;
+	open_file_table.back().buffer_block = 0;
+	open_file_table.back().generation = 0;
+	return (int)open_file_table.size() - 1;
 }
 
-int FileSystem::write(int index, std::string data) {
-	
-	FILE_TABLE * curr_file = nullptr;
-	std::vector<int> file_desc;
+//whole blocks go between the caller and the buffer cache directly, r_w only holds partial blocks
+template<class Geometry>
+int FileSystem<Geometry>::write(int index, std::span<const std::byte> src) {
+
+	StatScope scope(&stats, STAT_WRITE);
+	TraceScope trace_scope(&trace, TRACE_WRITE);
+	trace_scope.set_io(index, src.size(), 0, src.empty() ? 0 : (std::uint8_t)src[0]);
+	auto journal_guard = begin_change(src.size());
+	FILE_TABLE<Geometry> * curr_file = nullptr;
+	DESCRIPTOR<Geometry> file_desc;
+	const char * data = (const char *)src.data();
 	int bytes_written = 0;
-	int block_index = 0;
 
-	if (is_oft_entry(index)) {
+	std::shared_lock<std::shared_mutex> table_guard(oft_lock);
+	curr_file = get_oft_entry(index);
 
-		curr_file = &open_file_table[index];
+	if (curr_file != nullptr) {
+
+		std::unique_lock<std::shared_mutex> file_guard(curr_file->lock);
+		wait_for_reads(curr_file);
 		file_desc = ldisk.get_descriptor(curr_file->index);
 
-		//get index of block in file descriptor
-		for (int i = 1; i < 4; i++)
-			if (file_desc[i] == curr_file->buffer_block)
-				block_index = i;
+		//file size has to fit in the descriptor
+		int position = (curr_file->file_block * BLOCK_SIZE) + curr_file->buffer_index;
+		int count = (int)std::min<std::size_t>(src.size(), (std::size_t)(std::numeric_limits<int>::max() - position));
 
-		for (int i = 0; i < data.length(); i++) {
+		if (!unshare_blocks(curr_file, position, count))  //disk full
+			return trace_scope.result(scope.result(0));
 
-			for (int j = curr_file->buffer_index; (j < 64) && (i < data.length()); j++, i++, curr_file->buffer_index++, bytes_written++) { //write bytes
-				curr_file->r_w[j] = data[i];
-			}
+		while (bytes_written < count) {
+
+			if (curr_file->buffer_index == BLOCK_SIZE) {  //current block is full, go to the next one
+
+				int next_block = curr_file->file_block + 1;
+				bool is_new = next_block >= curr_file->block_map.blocks();
+
+				if (is_new && (grow_file(curr_file, count - bytes_written) == 0))  //disk full
+					break;
 
-			ldisk.write_block(curr_file->buffer_block, curr_file->r_w);   //write out data
-			block_index++;
+				if (count - bytes_written >= BLOCK_SIZE) {  //whole blocks go out in batches, r_w is caught up at the end
 
-			if ((i < data.length()) && (block_index < 4)) {
+					BLOCK_IO ios[IO_BATCH];
+					int batch = 0;
 
-				if (file_desc[block_index] == 0) {  //check if there isnt another block to read
+					do {
 
-					int new_block = ldisk.find_free_block();
-					ldisk.update_descriptor_blocks(curr_file->index, new_block);  //update descriptor on disk
-					file_desc[block_index] = new_block;
+						ios[batch++] = { curr_file->block_map.lookup(next_block), (char *)data + bytes_written };
+						curr_file->file_block = next_block++;
+						bytes_written += BLOCK_SIZE;
+					} while ((batch < IO_BATCH) && (count - bytes_written >= BLOCK_SIZE) &&
+						((next_block < curr_file->block_map.blocks()) || (grow_file(curr_file, count - bytes_written) > 0)));
+
+					buffer_cache.write_blocks(ios, batch);
+					continue;
 				}
 
-				ldisk.read_block(file_desc[block_index], curr_file->r_w);  //read in block
-				curr_file->buffer_block = file_desc[block_index];
-				curr_file->buffer_index = 0;                               //start from beginning of next block
-				i--;     //go back and write char you missed when loading new block
+				if (is_new) {  //fresh block, nothing to read
+
+					curr_file->buffer_block = curr_file->block_map.lookup(next_block);
+					curr_file->file_block = next_block;
+					std::memset(curr_file->r_w, 0, BLOCK_SIZE);
+				}
+				else
+					load_block(curr_file, next_block);
+				curr_file->buffer_index = 0;  //start from beginning of next block
 			}
-			else
-				break;   //over 3 blocks, just exit
+
+			//write bytes
+			int chunk = std::min(BLOCK_SIZE - curr_file->buffer_index, count - bytes_written);
+			std::memcpy(curr_file->r_w + curr_file->buffer_index, data + bytes_written, chunk);
+			curr_file->buffer_index += chunk;
+			bytes_written += chunk;
+
+			if ((curr_file->buffer_index == BLOCK_SIZE) || (bytes_written == count))
+				buffer_cache.write_block(curr_file->buffer_block, curr_file->r_w);   //write out data
 		}
 
+		load_block(curr_file, curr_file->file_block);
+
 		//update size in cache
-		if (file_desc[0] == 1)
-			ldisk.update_descriptor_size(curr_file->index, bytes_written); 
-		else
-			ldisk.update_descriptor_size(curr_file->index, file_desc[0] + bytes_written);
+		position = (curr_file->file_block * BLOCK_SIZE) + curr_file->buffer_index;
+		if (position > file_desc.size)
+			ldisk.update_descriptor_size(curr_file->index, position);
 
-		return bytes_written;
+		return trace_scope.result(scope.result(bytes_written));
 	}
 	else
 		return -1;
 }
 
 
-int FileSystem::read(int index, std::string &mem_area, int count) {
+template<class Geometry>
+int FileSystem<Geometry>::read(int index, std::span<std::byte> dst) {
 
-	FILE_TABLE * curr_file = nullptr;
-	std::vector<int> file_desc;
-	int block_index = 0;
+	StatScope scope(&stats, STAT_READ);
+	TraceScope trace_scope(&trace, TRACE_READ);
+	trace_scope.set_io(index, dst.size());
+	FILE_TABLE<Geometry> * curr_file = nullptr;
+	DESCRIPTOR<Geometry> file_desc;
+	char * data = (char *)dst.data();
 	int bytes_read = 0;
 
-	if (is_oft_entry(index)) {
+	std::shared_lock<std::shared_mutex> table_guard(oft_lock);
+	curr_file = get_oft_entry(index);
 
-		curr_file = &open_file_table[index];
+	if (curr_file != nullptr) {
+
+		std::unique_lock<std::shared_mutex> file_guard(curr_file->lock);
 		file_desc = ldisk.get_descriptor(curr_file->index);
 
-		//get index of block in file descriptor
-		for (int i = 1; i < 4; i++)
-			if (file_desc[i] == curr_file->buffer_block)
-				block_index = i;
+		//cant read what isnt there
+		int position = (curr_file->file_block * BLOCK_SIZE) + curr_file->buffer_index;
+		int count = (int)std::min<std::size_t>(dst.size(), (std::size_t)(file_desc.size - position));
 
-		for (int i = 0; i < count; i++) {
+		while (bytes_read < count) {
 
-			int j = 0;
-			for (j = curr_file->buffer_index; (j < 64) && (i < count); j++, i++, curr_file->buffer_index++, bytes_read++) { //read bytes
-				if ( curr_file->r_w[j] != 0 )
-					mem_area += curr_file->r_w[j];
-			}
+			if (curr_file->buffer_index == BLOCK_SIZE) {  //go to next block
 
+				int next_block = curr_file->file_block + 1;
+				int block_num = curr_file->block_map.lookup(next_block);
 
-			if (j >= 64) {
-				block_index++;   // go to next block
-			}
-			
-			if ((i < count) && (block_index < 4)) {
-
-				if (file_desc[block_index] == 0) { //cant read what isnt there
+				if (block_num == -1)
 					break;
+
+				if (count - bytes_read >= BLOCK_SIZE) {  //whole blocks come in batches, r_w is caught up at the end
+
+					BLOCK_IO ios[IO_BATCH];
+					int batch = 0;
+
+					do {
+
+						ios[batch++] = { block_num, data + bytes_read };
+						curr_file->file_block = next_block++;
+						bytes_read += BLOCK_SIZE;
+					} while ((batch < IO_BATCH) && (count - bytes_read >= BLOCK_SIZE) && ((block_num = curr_file->block_map.lookup(next_block)) != -1));
+
+					buffer_cache.read_blocks(ios, batch);
+					continue;
 				}
-				else {
-					ldisk.read_block(file_desc[block_index], curr_file->r_w);
-					curr_file->buffer_block = file_desc[block_index];
-					curr_file->buffer_index = 0;
-				}
-				i--; //go back and read char you missed when you needed to load next block
-			}
-			else {
-				break;
+
+				load_block(curr_file, next_block);
+				curr_file->buffer_index = 0;
 			}
+
+			//read bytes
+			int chunk = std::min(BLOCK_SIZE - curr_file->buffer_index, count - bytes_read);
+			std::memcpy(data + bytes_read, curr_file->r_w + curr_file->buffer_index, chunk);
+			curr_file->buffer_index += chunk;
+			bytes_read += chunk;
 		}
 
-		return bytes_read;
+		load_block(curr_file, curr_file->file_block);
+
+		return trace_scope.result(scope.result(bytes_read));
 	}
 	else
 		return -1;
 }
 
-void FileSystem::give_command(std::string command) {
+//one pass over the blocks of [offset, offset + total), a block is found through the block map, never through r_w
+template<class Geometry>
+int FileSystem<Geometry>::readv(int index, std::span<const std::span<std::byte>> iov, int offset) {
+
+	StatScope scope(&stats, STAT_READV);
+	TraceScope trace_scope(&trace, TRACE_READV);
+	if (trace_on(&trace)) {
+
+		std::size_t total = 0;
+		for (auto segment : iov)
+			total += segment.size();
+		trace_scope.set_io(index, total, offset);
+	}
+	std::shared_lock<std::shared_mutex> table_guard(oft_lock);
+	FILE_TABLE<Geometry> * curr_file = get_oft_entry(index);
+	int bytes_read = 0;
+
+	if ((curr_file != nullptr) && (offset >= 0)) {
+
+		std::shared_lock<std::shared_mutex> file_guard(curr_file->lock);
+		std::size_t hint = 0;  //block map cursor is shared, keep our own
+		int file_size = ldisk.get_descriptor(curr_file->index).size;
+		int remaining = (offset < file_size) ? file_size - offset : 0;  //cant read what isnt there
+		BLOCK_IO ios[IO_BATCH];  //whole blocks waiting to be read
+		int batch = 0;
+
+		for (auto segment : iov) {
+
+			char * data = (char *)segment.data();
+			int count = (int)std::min<std::size_t>(segment.size(), (std::size_t)(remaining - bytes_read));
+
+			for (int done = 0; done < count; ) {
 
-	std::stringstream ss(command);
-	std::string token;
-	std::vector<std::string> command_tokens;
+				int position = offset + bytes_read + done;
+				int block_offset = position % BLOCK_SIZE;
+				int chunk = std::min(BLOCK_SIZE - block_offset, count - done);
+				int block_num = curr_file->block_map.lookup(position / BLOCK_SIZE, hint);
 
-	//tokenize the command 
-	if (command != "") {
+				if (chunk == BLOCK_SIZE) {
 
-		int counter = 0;
-		while (std::getline(ss, token, ' '))
-			command_tokens.push_back(token);
+					ios[batch++] = { block_num, data + done };
+					if (batch == IO_BATCH) {
+
+						buffer_cache.read_blocks(ios, batch);
+						batch = 0;
+					}
+				}
+				else
+					buffer_cache.read(block_num, block_offset, data + done, chunk);
+				done += chunk;
+			}
+
+			bytes_read += count;
+			if (bytes_read == remaining)
+				break;
+		}
+
+		if (batch > 0)
+			buffer_cache.read_blocks(ios, batch);
+		return trace_scope.result(scope.result(bytes_read));
 	}
 	else
-		command_tokens.push_back("NO INPUT");
+		return trace_scope.result(scope.result(-1));
+}
 
-	//make sure they called init
-	if ((command_tokens[0] != "in") && !is_initialized) {
+template<class Geometry>
+int FileSystem<Geometry>::writev(int index, std::span<const std::span<const std::byte>> iov, int offset) {
 
-		std::cout << "error" << std::endl;
-		return;
+	StatScope scope(&stats, STAT_WRITEV);
+	TraceScope trace_scope(&trace, TRACE_WRITEV);
+	std::size_t total = 0;
+	std::uint8_t fill = 0;
+
+	for (auto segment : iov) {
+
+		if ((total == 0) && !segment.empty())
+			fill = (std::uint8_t)segment[0];
+		total += segment.size();
 	}
+	trace_scope.set_io(index, total, offset, fill);
 
-	//run command
-	if (command_tokens[0] == "cr") {
+	auto journal_guard = begin_change(total);
+	std::shared_lock<std::shared_mutex> table_guard(oft_lock);
+	FILE_TABLE<Geometry> * curr_file = get_oft_entry(index);
+	std::unique_lock<std::shared_mutex> file_guard;
+	int bytes_written = 0;
+	bool buffer_changed = false;
 
-		if (create(command_tokens[1]) != -1)
-			std::cout << command_tokens[1] << " created" << std::endl;
-		else
-			std::cout << "error" << std::endl;
+	if (curr_file != nullptr) {
 
+		file_guard = std::unique_lock<std::shared_mutex>(curr_file->lock);
+		wait_for_reads(curr_file);
 	}
-	else if (command_tokens[0] == "de") {
 
-		if (destroy(command_tokens[1]) != -1)
-			std::cout << command_tokens[1] << " destroyed " << std::endl;
-		else
-			std::cout << "error" << std::endl;
-	}
-	else if (command_tokens[0] == "op") {
+	if ((curr_file != nullptr) && (offset >= 0) && (offset <= ldisk.get_descriptor(curr_file->index).size)) {  //no holes
 
-		int oft_index = open(command_tokens[1]);
-		if (oft_index != -1)
-			std::cout << command_tokens[1] << " opened " << oft_index << std::endl;
-		else
-			std::cout << "error" << std::endl;
-	}
-	else if (command_tokens[0] == "cl") {
+		//file size has to fit in the descriptor
+		int count = (int)std::min<std::size_t>(total, (std::size_t)(std::numeric_limits<int>::max() - offset));
+		BLOCK_IO ios[IO_BATCH];  //whole blocks waiting to be written
+		int batch = 0;
+
+		if (!unshare_blocks(curr_file, offset, count))  //disk full
+			return trace_scope.result(scope.result(0));
+
+		//get every block up front, short if the disk fills
+		int old_blocks = curr_file->block_map.blocks();
+		int needed_blocks = (int)(((long long)offset + count + BLOCK_SIZE - 1) / BLOCK_SIZE);
+		while ((curr_file->block_map.blocks() < needed_blocks) && (grow_file(curr_file, (needed_blocks - curr_file->block_map.blocks()) * BLOCK_SIZE) > 0));
+		count = (int)std::min<long long>(count, ((long long)curr_file->block_map.blocks() * BLOCK_SIZE) - offset);
+
+		for (auto segment : iov) {
+
+			const char * data = (const char *)segment.data();
+			int segment_count = (int)std::min<std::size_t>(segment.size(), (std::size_t)(count - bytes_written));
 
-		if ((isInteger(command_tokens[1])) && close(std::stoi(command_tokens[1])) != -1) {
+			for (int done = 0; done < segment_count; ) {
 
-			std::cout << command_tokens[1] << " closed" << std::endl;
+				int position = offset + bytes_written + done;
+				int file_block = position / BLOCK_SIZE;
+				int block_offset = position % BLOCK_SIZE;
+				int chunk = std::min(BLOCK_SIZE - block_offset, segment_count - done);
+				int block_num = curr_file->block_map.lookup(file_block);
+
+				if (chunk == BLOCK_SIZE) {
+
+					ios[batch++] = { block_num, (char *)data + done };
+					if (batch == IO_BATCH) {
+
+						buffer_cache.write_blocks(ios, batch);
+						batch = 0;
+					}
+				}
+				else {
+
+					if ((file_block >= old_blocks) && (block_offset == 0))  //first write to a fresh block
+						buffer_cache.zero_block(block_num);
+					buffer_cache.write(block_num, block_offset, data + done, chunk);
+				}
+
+				buffer_changed |= (block_num == curr_file->buffer_block);
+				done += chunk;
+			}
+
+			bytes_written += segment_count;
+			if (bytes_written == count)
+				break;
 		}
-		else
-			std::cout << "error" << std::endl;
 
+		if (batch > 0)
+			buffer_cache.write_blocks(ios, batch);
+
+		//r_w is a copy of its block, keep it current
+		if (buffer_changed)
+			buffer_cache.read_block(curr_file->buffer_block, curr_file->r_w);
+
+		if (offset + bytes_written > ldisk.get_descriptor(curr_file->index).size)
+			ldisk.update_descriptor_size(curr_file->index, offset + bytes_written);
+
+		return trace_scope.result(scope.result(bytes_written));
 	}
-	else if (command_tokens[0] == "wr") {
+	else
+		return trace_scope.result(scope.result(-1));
+}
+
+//the handle and size are checked like readv, the locks are let go before the block reads are waited for
+template<class Geometry>
+void FileSystem<Geometry>::pread_start(int index, std::span<std::byte> dst, int offset, std::function<void(int)> done) {
+
+	//shared by the block callbacks, the last one to finish copies the partial blocks and calls done
+	struct PENDING_READ {
+
+		FILE_TABLE<Geometry> * file;
+		std::function<void(int)> done;
+		int bytes;
+		char partial[2][BLOCK_SIZE];   //only the first and last block of a range can be partial
+		char * partial_dst[2];
+		int partial_offset[2];
+		int partial_count[2];
+		int partials;
+		std::atomic<int> pending;
+		std::atomic<bool> failed;
+		std::optional<StatScope> scope;   //recorded like readv, when the last block is in
+		std::optional<TraceScope> trace_scope;
+	};
+
+	auto finish = [](const std::shared_ptr<PENDING_READ> & read) {
+
+		if (read->pending.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			return;
+
+		for (int i = 0; i < read->partials; i++)
+			std::memcpy(read->partial_dst[i], read->partial[i] + read->partial_offset[i], read->partial_count[i]);
+
+		if (read->file->reads.fetch_sub(1, std::memory_order_release) == 1)
+			read->file->reads.notify_all();
+
+		int result = read->trace_scope->result(read->scope->result(read->failed ? -1 : read->bytes));
+		read->trace_scope.reset();
+		read->scope.reset();
+		read->done(result);
+	};
+
+	auto read = std::make_shared<PENDING_READ>();
+	read->scope.emplace(&stats, STAT_READV);
+	read->trace_scope.emplace(&trace, TRACE_READV);
+	read->trace_scope->set_io(index, dst.size(), offset);
+
+	std::shared_lock<std::shared_mutex> table_guard(oft_lock);
+	FILE_TABLE<Geometry> * curr_file = get_oft_entry(index);
+
+	if ((curr_file == nullptr) || (offset < 0)) {
+
+		table_guard.unlock();
+		read->trace_scope->result(read->scope->result(-1));
+		read.reset();
+		done(-1);
+		return;
+	}
+
+	std::shared_lock<std::shared_mutex> file_guard(curr_file->lock);
+	int file_size = ldisk.get_descriptor(curr_file->index).size;
+	char * data = (char *)dst.data();
+	std::vector<BLOCK_IO> misses;
+	std::size_t hint = 0;
 
-		std::string data = "";
-		int oft_index = -1;
+	read->file = curr_file;
+	read->done = std::move(done);
+	read->bytes = (offset < file_size) ? (int)std::min<std::size_t>(dst.size(), (std::size_t)(file_size - offset)) : 0;  //cant read what isnt there
+	read->partials = 0;
+	read->failed = false;
 
-		if ( isInteger(command_tokens[1]) )
-			oft_index = std::stoi(command_tokens[1]);
+	for (int bytes_read = 0; bytes_read < read->bytes; ) {
 
-		if (is_oft_entry(oft_index)) {
+		int position = offset + bytes_read;
+		int block_offset = position % BLOCK_SIZE;
+		int chunk = std::min(BLOCK_SIZE - block_offset, read->bytes - bytes_read);
+		int block_num = curr_file->block_map.lookup(position / BLOCK_SIZE, hint);
 
-			data.append(std::stoi(command_tokens[3]), command_tokens[2][0]);      //create data string
-			std::cout << write(oft_index, data) << " bytes written" << std::endl; //write to file
+		if (!buffer_cache.read_cached(block_num, block_offset, data + bytes_read, chunk)) {
+
+			if (chunk == BLOCK_SIZE)
+				misses.push_back({ block_num, data + bytes_read });
+			else {
+
+				int i = read->partials++;
+				read->partial_dst[i] = data + bytes_read;
+				read->partial_offset[i] = block_offset;
+				read->partial_count[i] = chunk;
+				misses.push_back({ block_num, read->partial[i] });
+			}
 		}
-		else
-			std::cout << "error" << std::endl;
+		bytes_read += chunk;
 	}
-	else if (command_tokens[0] == "rd") {
 
-		int oft_index = std::stoi(command_tokens[1]);
-		int read_count = std::stoi(command_tokens[2]);
-		std::string out_data;
+	//one extra count so a read finishing during the loop can't complete the call early
+	read->pending = (int)misses.size() + 1;
+	curr_file->reads.fetch_add(1, std::memory_order_relaxed);
 
-		if (is_oft_entry(oft_index)) {
+	for (auto miss : misses) {
 
-			read(oft_index, out_data, read_count);
-			std::cout << out_data << std::endl;
-		}
-		else
-			std::cout << "error" << std::endl;
+		ldisk.read_block_async(miss.block, miss.buffer, [read, finish](int bytes) {
+
+			if (bytes != BLOCK_SIZE)
+				read->failed = true;
+			finish(read);
+		});
+	}
+
+	file_guard.unlock();
+	table_guard.unlock();
+	finish(read);
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::wait_for_reads(FILE_TABLE<Geometry> * file) {
+
+	for (int reads = file->reads.load(std::memory_order_acquire); reads != 0; reads = file->reads.load(std::memory_order_acquire))
+		file->reads.wait(reads, std::memory_order_acquire);
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::wait_for_all_reads() {
+
+	for (auto & file : open_file_table)
+		wait_for_reads(&file);
+}
+
+//splits on single spaces like the old getline loop did (empty tokens kept, a trailing one dropped), nothing is copied
+template<class Geometry>
+int FileSystem<Geometry>::tokenize(std::string_view command, std::string_view * tokens) {
+
+	int count = 0;
+
+	while (!command.empty() && (count < MAX_TOKENS)) {
+
+		std::size_t space = command.find(' ');
+		tokens[count++] = command.substr(0, space);
+		command = (space == std::string_view::npos) ? std::string_view() : command.substr(space + 1);
 	}
-	else if (command_tokens[0] == "sk") {
 
-		int oft_index = std::stoi(command_tokens[1]);
-		if (is_oft_entry(oft_index)) {
-			
-			int seek_result = lseek(oft_index, std::stoi(command_tokens[2]));
-			if (seek_result != -1)
-				std::cout << "position is " << std::stoi(command_tokens[2]) << std::endl;  //just re-printing what they put in
+	return count;
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::give_command(std::string_view command) {
+
+	static const COMMAND commands[] = {
+
+		{ "cr", &FileSystem::command_create, true },
+		{ "de", &FileSystem::command_destroy, true },
+		{ "cp", &FileSystem::command_clone, true },
+		{ "op", &FileSystem::command_open, true },
+		{ "cl", &FileSystem::command_close, true },
+		{ "wr", &FileSystem::command_write, true },
+		{ "rd", &FileSystem::command_read, true },
+		{ "sk", &FileSystem::command_seek, true },
+		{ "dr", &FileSystem::command_directory, true },
+		{ "in", &FileSystem::command_init, false },
+		{ "dev", &FileSystem::command_device, false },
+		{ "sv", &FileSystem::command_save, true },
+		{ "ex", &FileSystem::command_export, true },
+		{ "dump", &FileSystem::command_dump, true },
+		{ "desc", &FileSystem::command_descriptors, true },
+		{ "oft", &FileSystem::command_oft, true },
+		{ "stats", &FileSystem::command_stats, false },
+		{ "trace", &FileSystem::command_trace, false },
+		{ "journal", &FileSystem::command_journal, true },
+		{ "commit", &FileSystem::command_commit, true },
+		{ "checkpoint", &FileSystem::command_checkpoint, true },
+	};
+
+	std::string_view tokens[MAX_TOKENS];
+	int count = tokenize(command, tokens);
+
+	for (const auto & entry : commands) {
+
+		if ((count > 0) && (tokens[0] == entry.name)) {
+
+			//make sure they called init
+			if (entry.needs_init && !is_initialized)
+				std::cout << "error" << '\n';
 			else
-				std::cout << "error" << std::endl;
+				(this->*entry.run)(tokens, count);
+			return;
 		}
-		else
-			std::cout << "error" << std::endl;
 	}
-	else if (command_tokens[0] == "dr") {
 
-		print_directory();
+	std::cout << "error" << '\n';
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::command_create(const std::string_view * tokens, int count) {
+
+	if ((count > 1) && (create(std::string(tokens[1])) != -1))
+		std::cout << tokens[1] << " created" << '\n';
+	else
+		std::cout << "error" << '\n';
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::command_destroy(const std::string_view * tokens, int count) {
+
+	if ((count > 1) && (destroy(std::string(tokens[1])) != -1))
+		std::cout << tokens[1] << " destroyed " << '\n';
+	else
+		std::cout << "error" << '\n';
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::command_clone(const std::string_view * tokens, int count) {
+
+	if ((count > 2) && (clone(std::string(tokens[1]), std::string(tokens[2])) != -1))
+		std::cout << tokens[2] << " cloned" << '\n';
+	else
+		std::cout << "error" << '\n';
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::command_open(const std::string_view * tokens, int count) {
+
+	int oft_index = (count > 1) ? open(std::string(tokens[1])) : -1;
+
+	if (oft_index != -1)
+		std::cout << tokens[1] << " opened " << (oft_index & HANDLE_SLOT_MASK) << '\n';
+	else
+		std::cout << "error" << '\n';
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::command_close(const std::string_view * tokens, int count) {
+
+	int oft_index;
+
+	if ((count > 1) && ((oft_index = shell_handle(tokens[1])) != -1) && (close(oft_index) != -1))
+		std::cout << tokens[1] << " closed" << '\n';
+	else
+		std::cout << "error" << '\n';
+}
+
+//the fill byte is written from one block sized chunk over and over, the payload is never built
+template<class Geometry>
+void FileSystem<Geometry>::command_write(const std::string_view * tokens, int count) {
+
+	int oft_index, fill_count;
+
+	if ((count > 3) && !tokens[2].empty() && parse_int(tokens[3], fill_count) && ((oft_index = shell_handle(tokens[1])) != -1)) {
+
+		char fill[FILL_CHUNK];
+		int bytes_written = 0;
+		std::memset(fill, tokens[2][0], sizeof(fill));
+
+		while (bytes_written < fill_count) {
+
+			int chunk = (fill_count - bytes_written < FILL_CHUNK) ? fill_count - bytes_written : FILL_CHUNK;
+			int written = write(oft_index, std::as_bytes(std::span(fill, chunk)));
+
+			if (written > 0)
+				bytes_written += written;
+			if (written != chunk)  //disk full
+				break;
+		}
+
+		std::cout << bytes_written << " bytes written" << '\n';
+	}
+	else
+		std::cout << "error" << '\n';
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::command_read(const std::string_view * tokens, int count) {
+
+	int oft_index, read_count;
+
+	if ((count > 2) && parse_int(tokens[2], read_count) && ((oft_index = shell_handle(tokens[1])) != -1)) {
+
+		read_buffer.resize((read_count > 0) ? read_count : 0);  //kept between commands
+		int bytes_read = read(oft_index, std::as_writable_bytes(std::span(read_buffer)));
+
+		std::cout.write(read_buffer.data(), (bytes_read > 0) ? bytes_read : 0);
+		std::cout << '\n';
 	}
-	else if (command_tokens[0] == "in") {
+	else
+		std::cout << "error" << '\n';
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::command_seek(const std::string_view * tokens, int count) {
+
+	int oft_index, pos;
+
+	if ((count > 2) && parse_int(tokens[2], pos) && ((oft_index = shell_handle(tokens[1])) != -1) && (lseek(oft_index, pos) != -1))
+		std::cout << "position is " << pos << '\n';  //just re-printing what they put in
+	else
+		std::cout << "error" << '\n';
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::command_directory(const std::string_view *, int) {
+
+	print_directory();
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::command_init(const std::string_view * tokens, int count) {
+
+	TraceScope trace_scope(&trace, TRACE_INIT);
+	trace_scope.set_io(0, (count > 1) ? 1 : 0);
+	std::lock_guard<std::mutex> checkpoint_guard(checkpoint_lock);  //the disk isn't replaced under a checkpoint
+	std::unique_lock<std::shared_mutex> journal_guard(journal_lock);
+	std::unique_lock<std::shared_mutex> table_guard(oft_lock);  //whole disk, nothing else may run
+	std::unique_lock<std::shared_mutex> directory_guard(directory_lock);
+	is_initialized = true;
+	wait_for_all_reads();
+	buffer_cache.clear();  //cached blocks belong to the old disk
+
+	if (count > 1)
+		ldisk.init_disk(std::string(tokens[1]));
+	else
+		ldisk.init_disk();
+
+	init_fs();
+	trace_scope.result(0);
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::command_device(const std::string_view * tokens, int count) {
+
+	std::lock_guard<std::mutex> checkpoint_guard(checkpoint_lock);
+	std::unique_lock<std::shared_mutex> journal_guard(journal_lock);
+	std::unique_lock<std::shared_mutex> table_guard(oft_lock);
+	std::unique_lock<std::shared_mutex> directory_guard(directory_lock);
+	wait_for_all_reads();
+
+	//the old disk is only dropped once the file turns out to be usable
+	if ((count > 1) && ldisk.open_device(std::string(tokens[1]))) {
 
 		is_initialized = true;
+		buffer_cache.clear();
+		init_fs();
+	}
+	else
+		std::cout << "error" << '\n';
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::command_save(const std::string_view * tokens, int count) {
+
+	std::lock_guard<std::mutex> checkpoint_guard(checkpoint_lock);
+	std::unique_lock<std::shared_mutex> journal_guard(journal_lock);  //saving over the journal's image empties it
+	std::unique_lock<std::shared_mutex> table_guard(oft_lock);
+	std::unique_lock<std::shared_mutex> directory_guard(directory_lock);
+	close_all();
+
+	if ((count > 2) && (tokens[2] == "delta")) {  //only the blocks changed since the disk's image
 
-		if (command_tokens.size() > 1)
-			ldisk.init_disk(command_tokens[1]);
+		if (ldisk.save_delta(std::string(tokens[1])))
+			std::cout << "delta saved" << '\n';
 		else
-			ldisk.init_disk();
+			std::cout << "error" << '\n';
+	}
+	else if (count > 1) {
 
-		init_fs();
+		ldisk.save_disk(std::string(tokens[1]));
+		std::cout << "disk saved" << '\n';
 	}
-	else if (command_tokens[0] == "sv") {
+	else if (ldisk.sync_disk())  //a device disk is saved in place
+		std::cout << "disk saved" << '\n';
+	else
+		std::cout << "error" << '\n';
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::command_export(const std::string_view * tokens, int count) {
+
+	std::unique_lock<std::shared_mutex> table_guard(oft_lock);
+	std::unique_lock<std::shared_mutex> directory_guard(directory_lock);
+
+	if (count > 1) {
 
 		close_all();
-		ldisk.save_disk(command_tokens[1]);
-		std::cout << "disk saved" << std::endl;
+		ldisk.export_disk(std::string(tokens[1]));
+		std::cout << "disk exported" << '\n';
 	}
-	else if (command_tokens[0] == "dump") {
+	else
+		std::cout << "error" << '\n';
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::command_dump(const std::string_view *, int) {
 
-		ldisk.dump_disk();
+	std::unique_lock<std::shared_mutex> table_guard(oft_lock);
+	std::unique_lock<std::shared_mutex> directory_guard(directory_lock);
+	buffer_cache.flush();
+	ldisk.dump_disk();
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::command_descriptors(const std::string_view *, int) {
+
+	std::unique_lock<std::shared_mutex> table_guard(oft_lock);
+	std::unique_lock<std::shared_mutex> directory_guard(directory_lock);
+	std::vector<EXTENT> extents;
+
+	std::cout << "FILE DESCRIPTORS " << '\n';
+	for (int i = 0; i < Geometry::NUM_DESCRIPTORS; i++) {  //print all descriptors
+
+		std::cout << "DESC " << i << ": ";
+		ldisk.get_extents(i, extents);
+		std::cout << ldisk.get_descriptor(i).size << " ";
+		for (auto extent : extents)
+			std::cout << extent.start << "+" << extent.length << " ";
+		std::cout << '\n';
 	}
-	else if (command_tokens[0] == "desc") {
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::command_oft(const std::string_view *, int) {
+
+	std::unique_lock<std::shared_mutex> table_guard(oft_lock);
+	std::cout << "OPEN FILE TABLE" << '\n';
+	for (int i = 0; i < (int)open_file_table.size(); i++) {
 
-		std::cout << "FILE DESCRIPTORS " << std::endl;
-		for (int i = 0; i < 24; i++) {  //print all descriptors
+		if (open_file_table[i].index != -1) {
 
-			std::cout << "DESC " << i << ": ";
-			std::vector<int> file_desc = ldisk.get_descriptor(i);
-			for (auto desc_int : file_desc)
-				std::cout << desc_int << " ";
-			std::cout << std::endl;
+			std::cout << "DESC INDEX: " << open_file_table[i].index << '\n';
+			std::cout << "BUFFER INDEX: " << open_file_table[i].buffer_index << '\n';
 		}
 	}
-	else if (command_tokens[0] == "oft") {
+}
 
-		std::cout << "OPEN FILE TABLE" << std::endl;
-		for (int i = 0; i < 4; i++) {
+//stats prints them, stats reset clears them, stats on/off turns counting on or off
+template<class Geometry>
+void FileSystem<Geometry>::command_stats(const std::string_view * tokens, int count) {
 
-			if (is_oft_entry(i)) {
+	if (count == 1)
+		stats.print(std::cout);
+	else if (tokens[1] == "reset") {
 
-				std::cout << "DESC INDEX: " << open_file_table[i].index << std::endl;
-				std::cout << "BUFFER INDEX: " << open_file_table[i].buffer_index << std::endl;
-			}
+		stats.reset();
+		std::cout << "stats reset" << '\n';
+	}
+	else if ((tokens[1] == "on") || (tokens[1] == "off")) {
+
+		stats.set_enabled(tokens[1] == "on");
+		std::cout << "stats " << tokens[1] << '\n';
+	}
+	else
+		std::cout << "error" << '\n';
+}
+
+//trace <file> starts recording calls into file (a running trace is finished first), trace off stops
+template<class Geometry>
+void FileSystem<Geometry>::command_trace(const std::string_view * tokens, int count) {
+
+	if ((count > 1) && (tokens[1] == "off")) {
+
+		std::uint64_t records = trace.stop();
+		std::cout << "trace stopped " << records << " records" << '\n';
+	}
+	else if ((count > 1) && trace.start(std::string(tokens[1]), BLOCK_SIZE, Geometry::NUM_BLOCKS))
+		std::cout << "trace started" << '\n';
+	else
+		std::cout << "error" << '\n';
+}
+
+//journal <image> saves the disk to image and logs every change after it to image.journal (journal alone on a device),
+//journal off commits what is open and stops
+template<class Geometry>
+void FileSystem<Geometry>::command_journal(const std::string_view * tokens, int count) {
+
+	std::lock_guard<std::mutex> checkpoint_guard(checkpoint_lock);
+	std::unique_lock<std::shared_mutex> journal_guard(journal_lock);
+	std::unique_lock<std::shared_mutex> table_guard(oft_lock);
+	std::unique_lock<std::shared_mutex> directory_guard(directory_lock);
+	buffer_cache.flush();
+	journal_ops = 0;
+	journal_bytes = 0;
+
+	if ((count > 1) && (tokens[1] == "off")) {
+
+		std::shared_ptr<Journal> journal = ldisk.get_journal();
+		if ((journal != nullptr) && journal->wait_durable(ldisk.seal_journal())) {
+
+			ldisk.stop_journal();
+			std::cout << "journal stopped" << '\n';
 		}
+		else
+			std::cout << "error" << '\n';
+	}
+	else if (((count > 1) || ldisk.on_device()) && ldisk.start_journal((count > 1) ? std::string(tokens[1]) : std::string()))
+		std::cout << "journal started" << '\n';
+	else
+		std::cout << "error" << '\n';
+}
+
+template<class Geometry>
+void FileSystem<Geometry>::command_commit(const std::string_view *, int) {
+
+	if (commit() != -1)
+		std::cout << "committed" << '\n';
+	else
+		std::cout << "error" << '\n';
+}
+
+//checkpoint alone takes one now, checkpoint <seconds> [<dirty blocks>] starts the checkpointer (0 turns a trigger off), checkpoint off stops it
+template<class Geometry>
+void FileSystem<Geometry>::command_checkpoint(const std::string_view * tokens, int count) {
+
+	int seconds = 0;
+	int blocks = 0;
+
+	if (count == 1) {
+
+		if (checkpoint() != -1)
+			std::cout << "checkpoint done" << '\n';
+		else
+			std::cout << "error" << '\n';
+	}
+	else if (tokens[1] == "off") {
+
+		stop_checkpointer();
+		std::cout << "checkpoints stopped" << '\n';
+	}
+	else if (parse_int(tokens[1], seconds) && ((count < 3) || parse_int(tokens[2], blocks)) && (seconds >= 0) && (blocks >= 0) && ((seconds > 0) || (blocks > 0))) {
+
+		start_checkpointer(seconds, blocks);
+		std::cout << "checkpoints started" << '\n';
 	}
 	else
-		std::cout << "error" << std::endl;
+		std::cout << "error" << '\n';
 }
@@ -0,0 +1,283 @@
+#include "base.h"
+#include "ldisk.h"
+#include "file_system.h"
+#include <chrono>
+#include <random>
+
+//Microbenchmarks for Ldisk and FileSystem, results are printed as JSON
+
+/*
+BENCH INFO -
+
+every benchmark runs on each geometry at each fill level (percent of file blocks in use before timing starts)
+a benchmark repeats its body in doubling batches until a batch takes min_time, ns_per_op comes from that batch
+
+usage - fs_bench [--min-time seconds] [--filter substring]
+*/
+
+struct BENCH_RESULT {
+
+	std::string name;
+	std::string geometry;
+	int fill;                      //percent
+	long long iterations;
+	double ns_per_op;
+};
+
+struct BENCH_OPTIONS {
+
+	double min_time;               //seconds per measured batch
+	std::string filter;            //only benchmarks whose name contains it
+};
+
+static const int FILL_LEVELS[] = { 0, 50, 90 };
+static const int WORK_BLOCKS = 8;  //size of the file the read/write benchmarks cycle through
+
+static std::vector<BENCH_RESULT> results;
+
+//ldisk and the shell print progress, keep it out of the JSON
+class QuietOutput {
+
+private:
+
+	std::stringbuf sink;
+	std::streambuf * console;
+
+public:
+
+	QuietOutput() { console = std::cout.rdbuf(&sink); }
+	~QuietOutput() { std::cout.rdbuf(console); }
+};
+
+template<class Body>
+void run_bench(const BENCH_OPTIONS & options, const std::string & name, const std::string & geometry, int fill, Body body) {
+
+	if (name.find(options.filter) == std::string::npos)
+		return;
+
+	long long iterations = 1;
+
+	while (true) {
+
+		auto start = std::chrono::steady_clock::now();
+		for (long long i = 0; i < iterations; i++)
+			body(i);
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if ((elapsed >= options.min_time) || (iterations >= (1LL << 40))) {
+
+			results.push_back({ name, geometry, fill, iterations, (elapsed * 1e9) / iterations });
+			return;
+		}
+		iterations *= 2;
+	}
+}
+
+template<class Geometry>
+std::string geometry_name() {
+
+	return std::to_string(Geometry::BLOCK_SIZE) + "x" + std::to_string(Geometry::NUM_BLOCKS);
+}
+
+//allocates blocks until fill percent of the file blocks are used
+template<class Geometry>
+void fill_ldisk(Ldisk<Geometry> & disk, int fill) {
+
+	int file_blocks = Geometry::NUM_BLOCKS - Geometry::FILE_BLOCK_START;
+	int target = (file_blocks * fill) / 100;
+
+	while ((file_blocks - disk.get_free_blocks() < target) && (disk.find_free_block() != -1));
+}
+
+//a few large files take up fill percent of the file blocks
+template<class Geometry>
+void fill_file_system(FileSystem<Geometry> & file_system, int fill) {
+
+	static const int FILL_FILES = 8;
+	int file_blocks = Geometry::NUM_BLOCKS - Geometry::FILE_BLOCK_START;
+	int bytes_per_file = (int)(((long long)file_blocks * fill / 100 / FILL_FILES) * Geometry::BLOCK_SIZE);
+	std::vector<std::byte> data(bytes_per_file > 0 ? bytes_per_file : 0, std::byte{ 'f' });
+
+	for (int i = 0; (i < FILL_FILES) && (bytes_per_file > 0); i++) {
+
+		std::string name = "f" + std::to_string(i);
+		file_system.create(name);
+		int handle = file_system.open(name);
+		file_system.write(handle, data);
+		file_system.close(handle);
+	}
+}
+
+template<class Geometry>
+void bench_ldisk(const BENCH_OPTIONS & options, int fill) {
+
+	std::string geometry = geometry_name<Geometry>();
+	std::mt19937 rng(1);
+	std::vector<char> buffer(Geometry::BLOCK_SIZE, 'x');
+	Ldisk<Geometry> disk;
+
+	{
+		QuietOutput quiet;
+		disk.init_disk();
+		fill_ldisk(disk, fill);
+	}
+
+	int file_blocks = Geometry::NUM_BLOCKS - Geometry::FILE_BLOCK_START;
+	std::vector<int> blocks(1024);
+	for (auto & block : blocks)
+		block = Geometry::FILE_BLOCK_START + (int)(rng() % file_blocks);
+
+	run_bench(options, "ldisk_read_block", geometry, fill, [&](long long i) { disk.read_block(blocks[i & 1023], buffer.data()); });
+	run_bench(options, "ldisk_write_block", geometry, fill, [&](long long i) { disk.write_block(blocks[i & 1023], buffer.data()); });
+
+	run_bench(options, "ldisk_clone", geometry, fill, [&](long long) { Ldisk<Geometry> copy(disk); });
+	run_bench(options, "ldisk_clone_write", geometry, fill, [&](long long i) {  //copy plus the first write to a shared page
+
+		Ldisk<Geometry> copy(disk);
+		copy.write_block(blocks[i & 1023], buffer.data());
+	});
+
+	run_bench(options, "ldisk_find_free_block", geometry, fill, [&](long long) {
+
+		int block = disk.find_free_block();
+		if (block != -1)
+			disk.release_block(block);
+	});
+
+	std::vector<int> descriptors(1024);
+	for (auto & desc_index : descriptors)
+		desc_index = (int)(rng() % Geometry::NUM_DESCRIPTORS);
+
+	run_bench(options, "ldisk_get_descriptor", geometry, fill, [&](long long i) {
+
+		volatile int size = disk.get_descriptor(descriptors[i & 1023]).size;
+		(void)size;
+	});
+}
+
+template<class Geometry>
+void bench_file_system(const BENCH_OPTIONS & options, int fill) {
+
+	std::string geometry = geometry_name<Geometry>();
+	std::mt19937 rng(1);
+	std::vector<std::byte> buffer(Geometry::BLOCK_SIZE, std::byte{ 'x' });
+	std::unique_ptr<FileSystem<Geometry>> file_system;
+
+	{
+		QuietOutput quiet;
+		Ldisk<Geometry> disk;
+		file_system = std::make_unique<FileSystem<Geometry>>(disk);
+		file_system->give_command("in");
+		fill_file_system(*file_system, fill);
+	}
+
+	FileSystem<Geometry> & fs = *file_system;
+
+	//name index only, the name isn't there so open stops after the lookup
+	run_bench(options, "fs_directory_lookup", geometry, fill, [&](long long) { fs.open("none"); });
+
+	fs.create("look");
+
+	run_bench(options, "fs_create_destroy", geometry, fill, [&](long long) {
+
+		fs.create("tmp");
+		fs.destroy("tmp");
+	});
+
+	run_bench(options, "fs_open_close", geometry, fill, [&](long long) { fs.close(fs.open("look")); });
+
+	//read/write cycle through a small file, seeking back to the start at its end
+	fs.create("work");
+	int handle = fs.open("work");
+	for (int i = 0; i < WORK_BLOCKS; i++)
+		fs.write(handle, buffer);
+	int work_size = fs.lseek(handle, 0) == 0 ? WORK_BLOCKS : 0;
+
+	run_bench(options, "fs_write_block", geometry, fill, [&](long long i) {
+
+		if ((i % WORK_BLOCKS) == 0)
+			fs.lseek(handle, 0);
+		fs.write(handle, buffer);
+	});
+
+	run_bench(options, "fs_read_block", geometry, fill, [&](long long i) {
+
+		if ((i % WORK_BLOCKS) == 0)
+			fs.lseek(handle, 0);
+		fs.read(handle, buffer);
+	});
+
+	std::vector<int> positions(1024);
+	for (auto & pos : positions)
+		pos = (int)(rng() % (work_size * Geometry::BLOCK_SIZE + 1));
+
+	run_bench(options, "fs_lseek", geometry, fill, [&](long long i) { fs.lseek(handle, positions[i & 1023]); });
+
+	run_bench(options, "fs_clone_destroy", geometry, fill, [&](long long) {
+
+		fs.clone("work", "copy");
+		fs.destroy("copy");
+	});
+
+	run_bench(options, "fs_clone_write", geometry, fill, [&](long long) {  //clone plus a write copying one shared block
+
+		fs.clone("work", "copy");
+		fs.lseek(handle, 0);
+		fs.write(handle, buffer);
+		fs.destroy("copy");
+	});
+
+	fs.close(handle);
+}
+
+template<class Geometry>
+void bench_geometry(const BENCH_OPTIONS & options) {
+
+	for (auto fill : FILL_LEVELS) {
+
+		bench_ldisk<Geometry>(options, fill);
+		bench_file_system<Geometry>(options, fill);
+	}
+}
+
+void print_results() {
+
+	std::cout << "{\n  \"benchmarks\": [\n";
+	for (std::size_t i = 0; i < results.size(); i++) {
+
+		const BENCH_RESULT & result = results[i];
+		std::cout << "    { \"name\": \"" << result.name << "\", \"geometry\": \"" << result.geometry << "\", \"fill\": " << result.fill
+			<< ", \"iterations\": " << result.iterations << ", \"ns_per_op\": " << result.ns_per_op << " }"
+			<< ((i + 1 < results.size()) ? "," : "") << '\n';
+	}
+	std::cout << "  ]\n}" << std::endl;
+}
+
+int main(int argc, char * argv[]) {
+
+	BENCH_OPTIONS options = { 0.05, "" };
+
+	//every option takes a value, one without it (or anything else, --help included) gets the usage
+	for (int i = 1; i < argc; i++) {
+
+		std::string option = argv[i];
+		bool has_value = (i + 1 < argc);
+
+		if ((option == "--min-time") && has_value)
+			options.min_time = std::atof(argv[++i]);
+		else if ((option == "--filter") && has_value)
+			options.filter = argv[++i];
+		else {
+
+			std::cerr << "usage: fs_bench [--min-time seconds] [--filter substring]" << std::endl;
+			return 1;
+		}
+	}
+
+	bench_geometry<DefaultGeometry>(options);
+	bench_geometry<DiskGeometry<512, 4096>>(options);
+	bench_geometry<DiskGeometry<4096, 16384>>(options);
+
+	print_results();
+	return 0;
+}
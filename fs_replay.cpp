@@ -0,0 +1,280 @@
+#include "base.h"
+#include "ldisk.h"
+#include "file_system.h"
+#include "trace.h"
+#include <chrono>
+
+//Replays a trace recorded with the trace command and reports throughput and latencies, results are printed as JSON
+
+/*
+REPLAY INFO -
+
+the trace runs on one thread in the order it was recorded, against a fresh disk or a copy of --image
+the image is read once, its journal replayed onto the copy without being reopened, neither file is changed
+by default calls go back to back, --paced waits until each call's recorded start time
+every result is checked against the recorded one, differences are counted (and the first few printed on stderr),
+a trace recorded from several threads can differ where calls raced
+
+latencies are exact percentiles of the replayed calls, the recorded ones are given beside them
+
+usage - fs_replay trace [--image file] [--paced] [--cache blocks]
+*/
+
+struct REPLAY_OPTIONS {
+
+	std::string trace;
+	std::string image;             //disk to start from and to restore at a recorded in, fresh if empty
+	bool paced;                    //keep the recorded start times
+	int cache_blocks;              //buffer cache frames
+};
+
+struct OP_RESULTS {
+
+	std::vector<std::uint64_t> replayed;   //ns per call
+	std::vector<std::uint64_t> recorded;
+	std::uint64_t bytes;
+};
+
+static const int REPORTED_MISMATCHES = 10;
+
+//ldisk and the shell print progress, keep it out of the JSON
+class QuietOutput {
+
+private:
+
+	std::stringbuf sink;
+	std::streambuf * console;
+
+public:
+
+	QuietOutput() { console = std::cout.rdbuf(&sink); }
+	~QuietOutput() { std::cout.rdbuf(console); }
+};
+
+bool load_trace(const std::string & file_name, TRACE_HEADER & header, std::vector<TRACE_RECORD> & records) {
+
+	std::ifstream inFile(file_name, std::ios::binary);
+
+	if (!inFile.read((char *)&header, sizeof(header)))
+		return false;
+
+	if ((std::memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) || (header.version != TRACE_VERSION) || (header.record_size != sizeof(TRACE_RECORD)))
+		return false;
+
+	//a record cut short by a crash is dropped
+	TRACE_RECORD record;
+	records.clear();
+	while (inFile.read((char *)&record, sizeof(record))) {
+
+		if ((record.op == 0) || (record.op >= TRACE_OP_END))
+			return false;
+		records.push_back(record);
+	}
+
+	return true;
+}
+
+//a name cut in the trace is padded back to its length, it was too long to create either way
+std::string record_name(const char * stored, int stored_size, int length) {
+
+	std::string name(stored, std::min(length, stored_size));
+	name.resize(length, '?');
+	return name;
+}
+
+inline std::string record_name(const TRACE_RECORD & record) { return record_name(record.args.name, TRACE_NAME_SIZE, record.name_length); }
+
+std::uint64_t percentile(const std::vector<std::uint64_t> & sorted, double fraction) {
+
+	if (sorted.empty())
+		return 0;
+
+	std::size_t i = (std::size_t)(fraction * (sorted.size() - 1) + 0.5);
+	return sorted[i];
+}
+
+//a copy of the loaded image shares its blocks, so restoring doesn't read the file again
+template<class Geometry>
+std::unique_ptr<FileSystem<Geometry>> restore_disk(const Ldisk<Geometry> & image, const REPLAY_OPTIONS & options, bool from_image) {
+
+	QuietOutput quiet;
+
+	if (from_image && !options.image.empty())
+		return std::make_unique<FileSystem<Geometry>>(image, options.cache_blocks);
+
+	auto file_system = std::make_unique<FileSystem<Geometry>>(Ldisk<Geometry>(), options.cache_blocks);
+	file_system->give_command("in");
+	return file_system;
+}
+
+template<class Geometry>
+void replay(const REPLAY_OPTIONS & options, const std::vector<TRACE_RECORD> & records) {
+
+	Ldisk<Geometry> image;
+	std::unordered_map<int, int> handles;         //recorded handle -> replayed handle
+	std::vector<std::byte> buffer;
+	OP_RESULTS results[TRACE_OP_END] = {};
+	long long mismatches = 0;
+
+	if (!options.image.empty()) {
+
+		QuietOutput quiet;
+		image.copy_disk(options.image);
+	}
+
+	std::unique_ptr<FileSystem<Geometry>> file_system = restore_disk(image, options, true);
+
+	auto begin = std::chrono::steady_clock::now();
+
+	for (std::size_t i = 0; i < records.size(); i++) {
+
+		const TRACE_RECORD & record = records[i];
+		auto handle = handles.find(record.args.io.handle);
+		int index = (handle != handles.end()) ? handle->second : -1;  //a handle never opened in the trace stays invalid
+		int length = (record.args.io.length > 0) ? record.args.io.length : 0;
+		int result = -1;
+
+		//buffers are set up before the clock starts
+		if ((record.op == TRACE_READ) || (record.op == TRACE_WRITE) || (record.op == TRACE_READV) || (record.op == TRACE_WRITEV)) {
+
+			if ((int)buffer.size() < length)
+				buffer.resize(length);
+			if ((record.op == TRACE_WRITE) || (record.op == TRACE_WRITEV))
+				std::memset(buffer.data(), record.fill, length);
+		}
+
+		std::string name = ((record.op == TRACE_CREATE) || (record.op == TRACE_DESTROY) || (record.op == TRACE_OPEN)) ? record_name(record) : std::string();
+		std::string target;
+		if (record.op == TRACE_CLONE) {
+
+			name = record_name(record.args.name, TRACE_NAME_SIZE / 2, record.name_length);
+			target = record_name(record.args.name + (TRACE_NAME_SIZE / 2), TRACE_NAME_SIZE / 2, record.target_length);
+		}
+		std::span<std::byte> data(buffer.data(), length);
+
+		if (options.paced)
+			std::this_thread::sleep_until(begin + std::chrono::nanoseconds(record.start_ns));
+
+		auto start = std::chrono::steady_clock::now();
+
+		switch (record.op) {
+
+		case TRACE_CREATE: result = file_system->create(name); break;
+		case TRACE_DESTROY: result = file_system->destroy(name); break;
+		case TRACE_OPEN: result = file_system->open(name); break;
+		case TRACE_CLOSE: result = file_system->close(index); break;
+		case TRACE_READ: result = file_system->read(index, data); break;
+		case TRACE_WRITE: result = file_system->write(index, data); break;
+		case TRACE_READV: result = file_system->pread(index, data, record.args.io.offset); break;
+		case TRACE_WRITEV: result = file_system->pwrite(index, data, record.args.io.offset); break;
+		case TRACE_LSEEK: result = file_system->lseek(index, record.args.io.offset); break;
+		case TRACE_CLONE: result = file_system->clone(name, target); break;
+		case TRACE_DIRECTORY: result = (int)file_system->directory().size(); break;
+		case TRACE_INIT:
+			file_system = restore_disk(image, options, record.args.io.length == 1);
+			handles.clear();
+			result = 0;
+			break;
+		}
+
+		std::uint64_t ns = (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+		//handles only have to agree on whether the open worked
+		bool same = (record.op == TRACE_OPEN) ? ((result == -1) == (record.result == -1)) : (result == record.result);
+		if ((record.op == TRACE_OPEN) && (record.result != -1))
+			handles[record.result] = result;
+
+		if (!same && (mismatches++ < REPORTED_MISMATCHES))
+			std::cerr << "record " << i << " " << TRACE_OP_NAMES[record.op] << ": recorded " << record.result << ", replayed " << result << std::endl;
+
+		OP_RESULTS & op = results[record.op];
+		op.replayed.push_back(ns);
+		op.recorded.push_back(record.latency_ns);
+		if ((record.op >= TRACE_READ) && (record.op <= TRACE_WRITEV) && (result > 0))
+			op.bytes += result;
+	}
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	std::uint64_t total_bytes = 0;
+
+	std::cout << "{\n  \"trace\": \"" << options.trace << "\", \"geometry\": \"" << Geometry::BLOCK_SIZE << "x" << Geometry::NUM_BLOCKS << "\", \"paced\": " << (options.paced ? "true" : "false") << ",\n";
+	std::cout << "  \"ops\": [\n";
+
+	bool first = true;
+	for (int op = 1; op < TRACE_OP_END; op++) {
+
+		OP_RESULTS & counters = results[op];
+		if (counters.replayed.empty())
+			continue;
+
+		std::sort(counters.replayed.begin(), counters.replayed.end());
+		std::sort(counters.recorded.begin(), counters.recorded.end());
+		total_bytes += counters.bytes;
+
+		std::cout << (first ? "" : ",\n") << "    { \"name\": \"" << TRACE_OP_NAMES[op] << "\", \"calls\": " << counters.replayed.size() << ", \"bytes\": " << counters.bytes
+			<< ", \"p50_ns\": " << percentile(counters.replayed, 0.5) << ", \"p90_ns\": " << percentile(counters.replayed, 0.9)
+			<< ", \"p99_ns\": " << percentile(counters.replayed, 0.99) << ", \"max_ns\": " << counters.replayed.back()
+			<< ", \"recorded_p50_ns\": " << percentile(counters.recorded, 0.5) << ", \"recorded_p99_ns\": " << percentile(counters.recorded, 0.99) << " }";
+		first = false;
+	}
+
+	std::cout << (first ? "" : "\n") << "  ],\n";
+	std::cout << "  \"records\": " << records.size() << ", \"mismatches\": " << mismatches << ", \"elapsed_s\": " << elapsed
+		<< ", \"ops_per_s\": " << ((elapsed > 0) ? records.size() / elapsed : 0)
+		<< ", \"mb_per_s\": " << ((elapsed > 0) ? total_bytes / elapsed / (1 << 20) : 0) << "\n}" << std::endl;
+}
+
+int main(int argc, char * argv[]) {
+
+	REPLAY_OPTIONS options = { "", "", false, 64 };
+	TRACE_HEADER header;
+	std::vector<TRACE_RECORD> records;
+
+	for (int i = 1; i < argc; i++) {
+
+		std::string option = argv[i];
+		if (option == "--paced")
+			options.paced = true;
+		else if ((option == "--image") && (i + 1 < argc))
+			options.image = argv[++i];
+		else if ((option == "--cache") && (i + 1 < argc))
+			options.cache_blocks = std::atoi(argv[++i]);
+		else if (options.trace.empty() && (option.rfind("--", 0) != 0))
+			options.trace = option;
+		else {
+
+			options.trace.clear();
+			break;
+		}
+	}
+
+	if (options.trace.empty() || (options.cache_blocks <= 0)) {
+
+		std::cerr << "usage: fs_replay trace [--image file] [--paced] [--cache blocks]" << std::endl;
+		return 1;
+	}
+
+	if (!load_trace(options.trace, header, records)) {
+
+		std::cerr << "can't read trace " << options.trace << std::endl;
+		return 1;
+	}
+
+	if (!options.image.empty() && !std::ifstream(options.image)) {
+
+		std::cerr << "can't open " << options.image << std::endl;
+		return 1;
+	}
+
+	if ((header.block_size == DefaultGeometry::BLOCK_SIZE) && (header.num_blocks == DefaultGeometry::NUM_BLOCKS))
+		replay<DefaultGeometry>(options, records);
+	else if ((header.block_size == LargeGeometry::BLOCK_SIZE) && (header.num_blocks == LargeGeometry::NUM_BLOCKS))
+		replay<LargeGeometry>(options, records);
+	else {
+
+		std::cerr << "unsupported geometry " << header.block_size << "x" << header.num_blocks << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
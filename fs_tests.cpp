@@ -0,0 +1,1013 @@
+#include "base.h"
+#include "ldisk.h"
+#include "file_system.h"
+#include "executor.h"
+#include "async_file_system.h"
+#include <latch>
+#include <source_location>
+#include <csignal>
+#include <sys/resource.h>
+
+//Tests for the parts of Ldisk and FileSystem the shell scripts can't reach, one group per ctest test
+
+/*
+TESTS INFO -
+
+each group builds its own disks in the temp directory and removes them when it is done
+a failed check prints its line on stderr and the group keeps going, the exit code is the number of failed checks (capped)
+
+usage - fs_tests [group] [fs_replay]   (every group when none is given, the replay group runs the fs_replay it is given)
+*/
+
+struct TEST_GROUP {
+
+	const char * name;
+	void (*run)();
+};
+
+static int failures = 0;
+static std::string replay_program;  //fs_replay for the replay group, skipped without it
+
+//ldisk and the shell print progress, keep it off the test output
+class QuietOutput {
+
+private:
+
+	std::stringbuf sink;
+	std::streambuf * console;
+
+public:
+
+	QuietOutput() { console = std::cout.rdbuf(&sink); }
+	~QuietOutput() { std::cout.rdbuf(console); }
+
+	inline std::string get() const { return sink.str(); }
+};
+
+void check(bool passed, const char * what, std::source_location where = std::source_location::current()) {
+
+	if (!passed) {
+
+		std::cerr << "fs_tests.cpp:" << where.line() << " failed - " << what << std::endl;
+		failures++;
+	}
+}
+
+//a file in the temp directory, removed with whatever the disk left next to it
+class TempFile {
+
+private:
+
+	std::string path;
+
+public:
+
+	TempFile(const std::string & name) : path((std::filesystem::temp_directory_path() / ("fs_tests_" + std::to_string(getpid()) + "_" + name)).string()) { remove(); }
+	~TempFile() { remove(); }
+
+	void remove() { std::error_code error; std::filesystem::remove(path, error); std::filesystem::remove(path + ".journal", error); }
+	inline const std::string & get() const { return path; }
+};
+
+//whole file, empty if it can't be read
+std::string read_file(const std::string & file_name) {
+
+	std::ifstream inFile(file_name, std::ios::binary);
+	std::stringstream contents;
+	contents << inFile.rdbuf();
+	return contents.str();
+}
+
+//byte at a file position, the block number is mixed in so a block read from the wrong place shows
+inline std::byte pattern(int position, int block_size) {
+
+	return std::byte((position * 7 + position / block_size) & 0xff);
+}
+
+//async
+
+typedef DiskGeometry<512, 4096> AsyncGeometry;
+
+struct ASYNC_COUNTS {
+
+	std::atomic<int> running;      //clients between starting a read and getting its result
+	std::atomic<int> max_running;
+	std::atomic<int> bad_reads;
+};
+
+template<class Geometry>
+Task<void> read_client(AsyncFileSystem<Geometry> & fs, int handle, int offset, int length, ASYNC_COUNTS & counts, std::latch & finished) {
+
+	std::vector<std::byte> buffer(length);
+
+	int running = counts.running.fetch_add(1) + 1;
+	for (int seen = counts.max_running.load(); (running > seen) && !counts.max_running.compare_exchange_weak(seen, running); );
+
+	int bytes = co_await fs.pread_async(handle, buffer, offset);
+	counts.running.fetch_sub(1);
+
+	bool matches = (bytes == length);
+	for (int i = 0; matches && (i < length); i++)
+		matches = (buffer[i] == pattern(offset + i, Geometry::BLOCK_SIZE));
+
+	if (!matches)
+		counts.bad_reads.fetch_add(1);
+	finished.count_down();
+}
+
+//the blocks are on a device and most miss the small cache, so clients wait on block I/O with only 2 workers
+void test_async_reads() {
+
+	static const int FILE_BLOCKS = 1024;
+	static const int CLIENTS = 2000;
+	static const int BLOCK_SIZE = AsyncGeometry::BLOCK_SIZE;
+
+	TempFile device("async.bin");
+	FileSystem<AsyncGeometry> file_system(Ldisk<AsyncGeometry>(), 16);
+	std::vector<std::byte> data(FILE_BLOCKS * BLOCK_SIZE);
+	int handle;
+
+	for (int i = 0; i < (int)data.size(); i++)
+		data[i] = pattern(i, BLOCK_SIZE);
+
+	{
+		QuietOutput quiet;
+		file_system.give_command("dev " + device.get());
+		file_system.create("data");
+		handle = file_system.open("data");
+		check(file_system.write(handle, data) == (int)data.size(), "file written");
+		file_system.give_command("sv");  //blocks go to the device, the cache keeps only a few
+		handle = file_system.open("data");
+	}
+
+	ASYNC_COUNTS counts = {};
+	std::latch finished(CLIENTS);
+	int read_length = BLOCK_SIZE + 100;  //whole blocks and partial ones
+	TempFile trace("async.trace");
+
+	file_system.get_stats().reset();
+	file_system.get_stats().set_enabled(true);
+	check(file_system.get_trace().start(trace.get(), BLOCK_SIZE, AsyncGeometry::NUM_BLOCKS), "trace started");
+
+	{
+		Executor executor(2);
+		AsyncFileSystem<AsyncGeometry> fs(file_system, executor);
+
+		for (int i = 0; i < CLIENTS; i++) {
+
+			int offset = (int)(((long long)i * 7919 * 37) % (data.size() - read_length));
+			spawn(executor, read_client(fs, handle, offset, read_length, counts, finished));
+		}
+		finished.wait();
+
+		check(sync_wait(executor, fs.pread_async(handle + 1, data, 0)) == -1, "bad handle");
+		check(sync_wait(executor, fs.pread_async(handle, data, (int)data.size())) == 0, "read at end of file");
+	}
+
+	//recorded like a synchronous pread, bad handle included
+	STATS_SNAPSHOT stats = file_system.get_stats().snapshot();
+	file_system.get_stats().set_enabled(false);
+	check(stats.ops[STAT_READV].calls == CLIENTS + 2, "async reads counted");
+	check(stats.ops[STAT_READV].bytes == (std::uint64_t)CLIENTS * read_length, "async read bytes counted");
+	check(file_system.get_trace().stop() == CLIENTS + 2, "async reads traced");
+
+	check(counts.bad_reads == 0, "async reads return the file's data");
+	check(counts.max_running > 2, "clients wait on block I/O without holding a worker");
+
+	std::vector<std::byte> block(BLOCK_SIZE, std::byte{ 'w' });
+	check(file_system.pwrite(handle, block, 0) == BLOCK_SIZE, "write after async reads");
+	file_system.close(handle);
+}
+
+//a blocking call the test lets go of
+struct GATE {
+
+	std::mutex lock;
+	std::condition_variable changed;
+	bool entered = false;
+	bool open = false;
+
+	void wait() {
+
+		std::unique_lock<std::mutex> guard(lock);
+		entered = true;
+		changed.notify_all();
+		changed.wait(guard, [this] { return open; });
+	}
+
+	void wait_entered() {
+
+		std::unique_lock<std::mutex> guard(lock);
+		changed.wait(guard, [this] { return entered; });
+	}
+
+	void release() {
+
+		std::lock_guard<std::mutex> guard(lock);
+		open = true;
+		changed.notify_all();
+	}
+};
+
+Task<void> gate_client(AsyncFileSystem<AsyncGeometry> & fs, GATE & gate, std::latch & finished) {
+
+	co_await fs.run_blocking([&gate] { gate.wait(); return 0; });
+	finished.count_down();
+}
+
+Task<void> blocked_reader(AsyncFileSystem<AsyncGeometry> & fs, int handle, std::span<std::byte> buffer, std::atomic<int> & bytes, std::latch & finished) {
+
+	bytes = co_await fs.read_async(handle, buffer);
+	finished.count_down();
+}
+
+Task<void> unrelated_client(GATE & gate, std::atomic<int> & bytes, std::atomic<bool> & ran_while_pending, std::latch & finished) {
+
+	ran_while_pending = (bytes == -2);
+	gate.release();
+	finished.count_down();
+	co_return;
+}
+
+//one worker and one blocking thread, the gate call is running before the others start and the read is stuck
+//behind it until the unrelated client opens it
+void test_async_blocking() {
+
+	static const int BLOCK_SIZE = AsyncGeometry::BLOCK_SIZE;
+
+	Ldisk<AsyncGeometry> disk;
+	FileSystem<AsyncGeometry> file_system(disk);
+	std::vector<std::byte> data(4 * BLOCK_SIZE), buffer(data.size());
+	int handle;
+
+	for (int i = 0; i < (int)data.size(); i++)
+		data[i] = pattern(i, BLOCK_SIZE);
+
+	{
+		QuietOutput quiet;
+		file_system.give_command("in");
+	}
+	file_system.create("data");
+	handle = file_system.open("data");
+	check(file_system.write(handle, data) == (int)data.size(), "file written");
+	check(file_system.lseek(handle, 0) == 0, "back to the start");
+
+	GATE gate;
+	std::latch finished(3);
+	std::atomic<int> bytes = -2;
+	std::atomic<bool> ran_while_pending = false;
+
+	{
+		Executor executor(1);
+		AsyncFileSystem<AsyncGeometry> fs(file_system, executor, 1);
+
+		spawn(executor, gate_client(fs, gate, finished));
+		gate.wait_entered();
+		spawn(executor, blocked_reader(fs, handle, buffer, bytes, finished));
+		spawn(executor, unrelated_client(gate, bytes, ran_while_pending, finished));
+
+		//if a pending call held the worker nothing would open the gate, open it here so the test ends
+		for (int i = 0; (i < 1000) && !finished.try_wait(); i++)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		check(finished.try_wait(), "pending calls don't hold the only worker");
+		gate.release();
+		finished.wait();
+	}
+
+	check(ran_while_pending, "unrelated client ran while the read was pending");
+	check((bytes == (int)data.size()) && (buffer == data), "read finished after the gate opened");
+	file_system.close(handle);
+}
+
+void test_async() {
+
+	test_async_reads();
+	test_async_blocking();
+}
+
+//device
+
+//a batch bigger than the io_uring ring, part of it waits for slots and goes in with the next completions
+void test_device_batch(bool use_uring) {
+
+	static const int REQUESTS = 300;
+	static const int LENGTH = 512;
+
+	TempFile file(use_uring ? "device_uring.bin" : "device_pool.bin");
+	std::shared_ptr<BlockDevice> device = open_block_device(file.get(), use_uring);
+	std::vector<char> written((std::size_t)REQUESTS * LENGTH), read((std::size_t)REQUESTS * LENGTH + LENGTH, 'x');
+	std::vector<BLOCK_REQUEST> requests(REQUESTS);
+
+	check(device != nullptr, "device opened");
+	if (!device)
+		return;
+
+	for (int i = 0; i < (int)written.size(); i++)
+		written[i] = (char)pattern(i, LENGTH);
+
+	//every other request first, so the batch isn't one sequential run
+	for (int i = 0; i < REQUESTS; i++) {
+
+		int at = (i < REQUESTS / 2) ? 2 * i : 2 * (i - REQUESTS / 2) + 1;
+		requests[i] = { true, (std::int64_t)at * LENGTH, written.data() + (std::size_t)at * LENGTH, LENGTH };
+	}
+	check(device->transfer(requests.data(), REQUESTS) == 0, "batch written");
+
+	for (auto & request : requests)
+		request = { false, request.offset, read.data() + request.offset, LENGTH };
+	requests.push_back({ false, (std::int64_t)written.size(), read.data() + written.size(), LENGTH });  //past the end, zeros
+	check(device->transfer(requests.data(), (int)requests.size()) == 0, "batch read");
+
+	check(std::equal(written.begin(), written.end(), read.begin()), "batch reads back what was written");
+	check(std::all_of(read.begin() + written.size(), read.end(), [](char c) { return c == 0; }), "read past the end is zeros");
+	check(device->transfer(requests.data(), 0) == 0, "empty batch");
+}
+
+void test_device() {
+
+	test_device_batch(true);
+	test_device_batch(false);
+}
+
+//journal
+
+//blocks a replay applied, block -> its first byte
+std::unordered_map<int, char> replay_blocks(const std::string & journal_file, JOURNAL_REPLAY & replayed) {
+
+	std::unordered_map<int, char> blocks;
+	replayed = Journal::replay(journal_file, 64, 64, [&](int block_num, const char * data) { blocks[block_num] = data[0]; });
+	return blocks;
+}
+
+//three transactions of one block each, the last one is torn or damaged, replay keeps the first two and append cuts the rest off
+void test_journal() {
+
+	static const int TRANSACTIONS = 3;
+
+	TempFile journal_file("journal.journal");
+	JOURNAL_REPLAY replayed;
+	std::vector<std::int64_t> ends;   //file length after each transaction
+
+	{
+		Journal journal(64);
+		check(journal.create(journal_file.get(), 64), "journal created");
+
+		for (int i = 0; i < TRANSACTIONS; i++) {
+
+			std::vector<char> block(64, (char)('a' + i));
+			journal.log_block(10 + i, block.data());
+			check(journal.wait_durable(journal.seal()), "transaction durable");
+			ends.push_back((std::int64_t)std::filesystem::file_size(journal_file.get()));
+		}
+	}
+
+	std::string whole = read_file(journal_file.get());
+	auto blocks = replay_blocks(journal_file.get(), replayed);
+	check(replayed.valid && (replayed.transactions == TRANSACTIONS) && (replayed.length == ends.back()), "every transaction replayed");
+	check((blocks.size() == TRANSACTIONS) && (blocks[12] == 'c'), "replayed blocks");
+
+	//torn, the last transaction is only partly in the file
+	std::filesystem::resize_file(journal_file.get(), ends.back() - 10);
+	blocks = replay_blocks(journal_file.get(), replayed);
+	check(replayed.valid && (replayed.transactions == TRANSACTIONS - 1) && (replayed.length == ends[TRANSACTIONS - 2]), "torn tail dropped");
+	check(!blocks.contains(12), "torn transaction not applied");
+
+	//whole but damaged, the checksum doesn't match
+	{
+		std::string damaged = whole;
+		damaged[ends.back() - 1] ^= 1;
+		std::ofstream outFile(journal_file.get(), std::ios::binary | std::ios::trunc);
+		outFile.write(damaged.data(), (std::streamsize)damaged.size());
+	}
+	blocks = replay_blocks(journal_file.get(), replayed);
+	check(replayed.valid && (replayed.transactions == TRANSACTIONS - 1) && (replayed.length == ends[TRANSACTIONS - 2]), "bad checksum dropped");
+	check(!blocks.contains(12), "bad transaction not applied");
+
+	//a journal carried on after the replay cuts the bad transaction off, so the next one follows the last good one
+	{
+		Journal journal(64);
+		check(journal.append(journal_file.get(), replayed), "journal appended to");
+		check((std::int64_t)std::filesystem::file_size(journal_file.get()) == replayed.length, "append truncates to the replayed length");
+
+		std::vector<char> block(64, 'z');
+		journal.log_block(20, block.data());
+		check(journal.wait_durable(journal.seal()), "appended transaction durable");
+	}
+
+	blocks = replay_blocks(journal_file.get(), replayed);
+	check(replayed.valid && (replayed.transactions == TRANSACTIONS) && (replayed.last_sequence == TRANSACTIONS), "appended transaction replayed");
+	check((blocks[11] == 'b') && (blocks[20] == 'z') && !blocks.contains(12), "appended blocks");
+
+	//a bad header isn't a journal at all
+	std::filesystem::resize_file(journal_file.get(), 4);
+	replay_blocks(journal_file.get(), replayed);
+	check(!replayed.valid, "short header rejected");
+}
+
+//a crash leaves the image, a journal of committed transactions and a torn tail, in replays them and carries on after the last good one
+void test_journal_crash() {
+
+	TempFile image("crash.bin");
+	TempFile crashed("crash_copy.bin");
+	std::vector<std::byte> data(100, std::byte{ 'j' });
+	std::int64_t committed;
+
+	{
+		QuietOutput quiet;
+		Ldisk<DefaultGeometry> disk;
+		FileSystem<DefaultGeometry> file_system(disk);
+
+		file_system.give_command("in");
+		file_system.give_command("journal " + image.get());
+		file_system.create("a");
+		int handle = file_system.open("a");
+		file_system.write(handle, data);
+		check(file_system.commit() == 0, "first commit");
+		file_system.create("b");
+		check(file_system.commit() == 0, "second commit");
+
+		//the files as they are now are what a crash would leave
+		std::filesystem::copy_file(image.get(), crashed.get());
+		std::filesystem::copy_file(image.get() + ".journal", crashed.get() + ".journal");
+	}
+
+	committed = (std::int64_t)std::filesystem::file_size(crashed.get() + ".journal");
+	{
+		std::ofstream outFile(crashed.get() + ".journal", std::ios::binary | std::ios::app);
+		JOURNAL_COMMIT torn = { JOURNAL_COMMIT_MAGIC, 1, 1000, 0 };
+		outFile.write((const char *)&torn, sizeof(torn));
+	}
+
+	{
+		QuietOutput quiet;
+		Ldisk<DefaultGeometry> disk;
+		FileSystem<DefaultGeometry> file_system(disk);
+		std::vector<std::byte> read_back(200);
+
+		file_system.give_command("in " + crashed.get());
+		auto files = file_system.directory();
+		check(std::find(files.begin(), files.end(), "b") != files.end(), "committed create replayed");
+
+		int handle = file_system.open("a");
+		check(file_system.read(handle, read_back) == (int)data.size(), "committed write replayed");
+		check((std::int64_t)std::filesystem::file_size(crashed.get() + ".journal") == committed, "torn tail cut off when the journal is attached");
+
+		file_system.create("c");
+		check(file_system.commit() == 0, "commit after the replay");
+	}
+
+	{
+		QuietOutput quiet;
+		Ldisk<DefaultGeometry> disk;
+		FileSystem<DefaultGeometry> file_system(disk);
+
+		file_system.give_command("in " + crashed.get());
+		auto files = file_system.directory();
+		check(std::find(files.begin(), files.end(), "c") != files.end(), "transaction after the replay replayed");
+	}
+}
+
+//save
+
+//whole file read back, empty if it can't be opened
+template<class Geometry>
+std::vector<std::byte> read_back(FileSystem<Geometry> & file_system, const std::string & file_name) {
+
+	std::vector<std::byte> data(4096);
+	int handle = file_system.open(file_name);
+	int bytes = (handle != -1) ? file_system.read(handle, data) : 0;
+
+	file_system.close(handle);
+	data.resize(bytes > 0 ? bytes : 0);
+	return data;
+}
+
+//saving a disk over its own image writes only the changed blocks, with a journal they are logged first and the journal emptied after
+void test_save_in_place() {
+
+	TempFile image("save.bin");
+	std::vector<std::byte> first(300, std::byte{ '1' });
+	std::vector<std::byte> second(100, std::byte{ '2' });
+
+	{
+		QuietOutput quiet;
+		Ldisk<DefaultGeometry> disk;
+		FileSystem<DefaultGeometry> file_system(disk);
+
+		file_system.give_command("in");
+		file_system.create("a");
+		int handle = file_system.open("a");
+		file_system.write(handle, first);
+		file_system.give_command("sv " + image.get());
+
+		file_system.give_command("in " + image.get());
+		handle = file_system.open("a");
+		file_system.pwrite(handle, second, 0);
+		file_system.create("b");
+		file_system.give_command("sv " + image.get());  //in place
+	}
+
+	std::vector<std::byte> expected = first;
+	std::copy(second.begin(), second.end(), expected.begin());
+
+	{
+		QuietOutput quiet;
+		Ldisk<DefaultGeometry> disk;
+		FileSystem<DefaultGeometry> file_system(disk);
+
+		file_system.give_command("in " + image.get());
+		check(read_back(file_system, "a") == expected, "in place save keeps the changed blocks");
+		check(file_system.open("b") != -1, "in place save keeps the new file");
+
+		file_system.give_command("journal " + image.get());
+		int handle = file_system.open("a");
+		file_system.pwrite(handle, second, 200);
+		check(file_system.commit() == 0, "journal commit before the save");
+		file_system.give_command("sv " + image.get());
+		check(std::filesystem::file_size(image.get() + ".journal") == sizeof(JOURNAL_HEADER), "save empties the image's journal");
+	}
+
+	std::copy(second.begin(), second.end(), expected.begin() + 200);
+
+	{
+		QuietOutput quiet;
+		Ldisk<DefaultGeometry> disk;
+		FileSystem<DefaultGeometry> file_system(disk);
+
+		file_system.give_command("in " + image.get());
+		check(read_back(file_system, "a") == expected, "journaled in place save");
+	}
+}
+
+//a copy of a disk loaded from an image reads the image's mapping, a save or checkpoint of the original can't change it
+void test_save_copies() {
+
+	TempFile image("save_copies.bin");
+	std::vector<std::byte> before(300, std::byte{ 'A' });
+	std::vector<std::byte> after(300, std::byte{ 'B' });
+
+	{
+		QuietOutput quiet;
+		Ldisk<DefaultGeometry> disk;
+		FileSystem<DefaultGeometry> file_system(disk);
+
+		file_system.give_command("in");
+		file_system.create("a");
+		int handle = file_system.open("a");
+		file_system.write(handle, before);
+		file_system.give_command("sv " + image.get());
+	}
+
+	for (bool use_checkpoint : { false, true }) {
+
+		QuietOutput quiet;
+		Ldisk<DefaultGeometry> disk;
+		FileSystem<DefaultGeometry> file_system(disk);
+
+		file_system.give_command("in " + image.get());
+		FileSystem<DefaultGeometry> copy(file_system.snapshot());
+		Ldisk<DefaultGeometry> forked = file_system.snapshot();
+
+		int handle = file_system.open("a");
+		file_system.pwrite(handle, after, 0);
+		file_system.create("b");
+
+		if (use_checkpoint)
+			check(file_system.checkpoint() == 0, "checkpoint while copies read the image");
+		else
+			file_system.give_command("sv " + image.get());
+
+		FileSystem<DefaultGeometry> forked_file_system(forked);
+		check(read_back(copy, "a") == before, use_checkpoint ? "copy keeps its data after a checkpoint" : "copy keeps its data after a save");
+		check(read_back(forked_file_system, "a") == before, "snapshot keeps its data");
+		check(copy.open("b") == -1, "copy doesn't see the new file");
+
+		Ldisk<DefaultGeometry> saved_disk;
+		FileSystem<DefaultGeometry> saved(saved_disk);
+		saved.give_command("in " + image.get());
+		check(read_back(saved, "a") == after, "image has the original's data");
+
+		file_system.close(handle);
+		file_system.pwrite(file_system.open("a"), before, 0);
+		file_system.destroy("b");
+		file_system.give_command("sv " + image.get());  //back to the start for the next round
+	}
+}
+
+void test_save() {
+
+	test_save_in_place();
+	test_save_copies();
+}
+
+//checkpoint
+
+typedef DiskGeometry<64, 4096> CheckpointGeometry;
+
+//each file holds one letter throughout, a file mixing two was saved half way through a write
+template<class Geometry>
+bool uniform_file(FileSystem<Geometry> & file_system, const std::string & file_name, int size, std::byte letter = std::byte{ 0 }) {
+
+	std::vector<std::byte> data = read_back(file_system, file_name);
+
+	if ((int)data.size() != size)
+		return false;
+	if (letter == std::byte{ 0 })
+		letter = data[0];
+	return std::all_of(data.begin(), data.end(), [letter](std::byte b) { return b == letter; });
+}
+
+//saves in place and to another file while the checkpointer is writing the same image, with writers running and a journal on
+void test_checkpoint_saves() {
+
+	static const int WRITERS = 3;
+	static const int FILE_SIZE = 2000;
+	static const int SAVES = 20;
+
+	TempFile image("checkpoint.bin");
+	TempFile copy("checkpoint_copy.bin");
+	TempFile crashed("checkpoint_crash.bin");
+	std::atomic<bool> stop = false;
+	std::atomic<int> write_failures = 0;
+	std::vector<std::atomic<int>> last_letters(WRITERS);
+	std::vector<std::thread> writers;
+	Ldisk<CheckpointGeometry> disk;
+	FileSystem<CheckpointGeometry> file_system(disk, 16);
+
+	{
+		QuietOutput quiet;
+		file_system.give_command("in");
+		file_system.give_command("journal " + image.get());
+	}
+
+	//full size from the start, a save can come before a writer's first write
+	for (int i = 0; i < WRITERS; i++) {
+
+		std::string name = "f" + std::to_string(i);
+		std::vector<std::byte> data(FILE_SIZE, std::byte{ 'a' });
+		file_system.create(name);
+		int handle = file_system.open(name);
+		file_system.write(handle, data);
+		file_system.close(handle);
+		last_letters[i] = 'a';
+	}
+
+	//a save closes every file, a writer opens its file again and repeats the write
+	for (int i = 0; i < WRITERS; i++) {
+
+		writers.emplace_back([&, i] {
+
+			std::string name = "f" + std::to_string(i);
+			int handle = file_system.open(name);
+
+			for (int k = 0; !stop; ) {
+
+				char letter = (char)('a' + (k % 26));
+				std::vector<std::byte> data(FILE_SIZE, std::byte(letter));
+
+				if (file_system.pwrite(handle, data, 0) == FILE_SIZE) {
+
+					last_letters[i] = letter;
+					k++;
+				}
+				else if ((handle = file_system.open(name)) == -1)
+					write_failures++;
+			}
+		});
+	}
+
+	file_system.start_checkpointer(0, 20);
+
+	for (int i = 0; i < SAVES; i++) {
+
+		//the last file saved to is the one checkpoints write, so the copy is saved first and left alone after
+		QuietOutput quiet;
+		file_system.give_command("sv " + copy.get());
+		file_system.give_command("sv " + image.get());
+
+		Ldisk<CheckpointGeometry> saved_disk;
+		FileSystem<CheckpointGeometry> saved(saved_disk, 16);
+		saved.give_command("in " + copy.get());
+
+		for (int j = 0; j < WRITERS; j++)
+			check(uniform_file(saved, "f" + std::to_string(j), FILE_SIZE), "save during checkpoints holds whole writes");
+	}
+
+	stop = true;
+	for (auto & writer : writers)
+		writer.join();
+	file_system.stop_checkpointer();
+
+	check(write_failures == 0, "writers reopen their files after a save");
+	check(file_system.commit() == 0, "commit after the checkpointer stopped");
+
+	//the image and its journal as a crash would leave them, the replay has every committed write
+	std::filesystem::copy_file(image.get(), crashed.get());
+	std::filesystem::copy_file(image.get() + ".journal", crashed.get() + ".journal");
+
+	{
+		QuietOutput quiet;
+		Ldisk<CheckpointGeometry> crashed_disk;
+		FileSystem<CheckpointGeometry> restored(crashed_disk, 16);
+		restored.give_command("in " + crashed.get());
+
+		for (int i = 0; i < WRITERS; i++)
+			check(uniform_file(restored, "f" + std::to_string(i), FILE_SIZE, std::byte(last_letters[i].load())), "image and journal hold the last writes");
+	}
+}
+
+//a checkpoint trims the journal to what came after it, one whose commit can't be written leaves the image alone
+void test_checkpoint_journal() {
+
+	typedef DiskGeometry<64, 1024> CheckpointGeometry;   //smaller image, the journal outgrows it below
+
+	static const int FILE_SIZE = 4 * CheckpointGeometry::BLOCK_SIZE;
+
+	TempFile image("checkpoint_journal.bin");
+	TempFile crashed("checkpoint_journal_crash.bin");
+	std::string journal = image.get() + ".journal";
+	Ldisk<CheckpointGeometry> disk;
+	FileSystem<CheckpointGeometry> file_system(disk, 16);
+	std::vector<std::byte> first(FILE_SIZE, std::byte{ 'a' }), second(FILE_SIZE, std::byte{ 'b' }), third(FILE_SIZE, std::byte{ 'c' });
+
+	//the image and its journal as a crash would leave them, loaded into a new disk
+	auto check_crash = [&](std::byte letter, const char * what) {
+
+		QuietOutput quiet;
+		std::filesystem::copy_file(image.get(), crashed.get(), std::filesystem::copy_options::overwrite_existing);
+		std::filesystem::copy_file(journal, crashed.get() + ".journal", std::filesystem::copy_options::overwrite_existing);
+
+		Ldisk<CheckpointGeometry> crashed_disk;
+		FileSystem<CheckpointGeometry> restored(crashed_disk, 16);
+		restored.give_command("in " + crashed.get());
+		check(uniform_file(restored, "f", FILE_SIZE, letter), what);
+	};
+
+	{
+		QuietOutput quiet;
+		file_system.give_command("in");
+		file_system.give_command("journal " + image.get());
+	}
+
+	file_system.create("f");
+	int handle = file_system.open("f");
+	check(file_system.pwrite(handle, first, 0) == FILE_SIZE, "file written");
+	check(file_system.commit() == 0, "commit");
+	check(std::filesystem::file_size(journal) > sizeof(JOURNAL_HEADER), "commit is in the journal");
+
+	check(file_system.checkpoint() == 0, "checkpoint");
+	check(std::filesystem::file_size(journal) == sizeof(JOURNAL_HEADER), "checkpoint trims the journal");
+	check_crash(std::byte{ 'a' }, "checkpointed image holds the write");
+
+	check(file_system.pwrite(handle, second, 0) == FILE_SIZE, "file written again");
+	check(file_system.commit() == 0, "commit after the checkpoint");
+	check_crash(std::byte{ 'b' }, "transactions after a checkpoint replay onto its image");
+
+	//past the image's size, so the limit below stops the journal's writes and not the image's
+	for (int i = 0; std::filesystem::file_size(journal) <= std::filesystem::file_size(image.get()); i++) {
+
+		if ((file_system.pwrite(handle, (i % 2 == 0) ? first : second, 0) != FILE_SIZE) || (file_system.commit() != 0))
+			break;
+	}
+
+	//the journal can't grow past its size, so the checkpoint's commit fails
+	std::string before = read_file(image.get());
+	struct rlimit old_limit, limit;
+	check(file_system.pwrite(handle, third, 0) == FILE_SIZE, "file written a third time");
+
+	std::signal(SIGXFSZ, SIG_IGN);
+	getrlimit(RLIMIT_FSIZE, &old_limit);
+	limit = old_limit;
+	limit.rlim_cur = (rlim_t)std::filesystem::file_size(journal);
+	setrlimit(RLIMIT_FSIZE, &limit);
+	int result = file_system.checkpoint();
+	setrlimit(RLIMIT_FSIZE, &old_limit);
+	std::signal(SIGXFSZ, SIG_DFL);
+
+	check(result == -1, "checkpoint fails when its commit does");
+	check(read_file(image.get()) == before, "failed checkpoint leaves the image alone");
+
+	//a save still has the write, a whole image now the journal is broken
+	file_system.close(handle);
+	{
+		QuietOutput quiet;
+		file_system.give_command("sv " + image.get());
+	}
+	check_crash(std::byte{ 'c' }, "save after a failed checkpoint holds the write");
+}
+
+void test_checkpoint() {
+
+	test_checkpoint_saves();
+	test_checkpoint_journal();
+}
+
+//clone
+
+typedef DiskGeometry<64, 1024> CloneGeometry;
+
+//a clone shares every block of its source, a write copies only the blocks it touches and the other file keeps its data
+void test_clone() {
+
+	static const int BLOCK_SIZE = CloneGeometry::BLOCK_SIZE;
+	static const int FILE_BLOCKS = 10;
+
+	TempFile image("clone.bin");
+	Ldisk<CloneGeometry> disk;
+	FileSystem<CloneGeometry> file_system(disk);
+	std::vector<std::byte> source(FILE_BLOCKS * BLOCK_SIZE, std::byte{ 's' });
+	std::vector<std::byte> changed(BLOCK_SIZE, std::byte{ 'w' });
+	int empty_free, source_free;
+
+	{
+		QuietOutput quiet;
+		file_system.give_command("in");
+	}
+
+	empty_free = file_system.snapshot().get_free_blocks();
+	file_system.create("a");
+	int handle = file_system.open("a");
+	file_system.write(handle, source);
+	file_system.close(handle);
+	source_free = file_system.snapshot().get_free_blocks();
+
+	check(file_system.clone("a", "b") == 0, "clone");
+	check(file_system.clone("a", "b") == -1, "clone onto an existing name");
+	check(file_system.clone("none", "c") == -1, "clone of a missing file");
+	check(file_system.snapshot().get_shared_blocks() == FILE_BLOCKS, "clone shares every block");
+	check(file_system.snapshot().get_free_blocks() == source_free, "clone takes no blocks");
+	check(read_back(file_system, "b") == source, "clone reads the source's data");
+
+	//shares are counted again from the extents when the image is loaded
+	{
+		QuietOutput quiet;
+		file_system.give_command("sv " + image.get());
+		file_system.give_command("in " + image.get());
+	}
+	check(file_system.snapshot().get_shared_blocks() == FILE_BLOCKS, "shares rebuilt on load");
+
+	//the clone's last whole block, its extents still fit in the descriptor
+	handle = file_system.open("b");
+	check(file_system.pwrite(handle, changed, (FILE_BLOCKS - 1) * BLOCK_SIZE) == BLOCK_SIZE, "write to the clone");
+	file_system.close(handle);
+
+	std::vector<std::byte> expected = source;
+	std::copy(changed.begin(), changed.end(), expected.begin() + (FILE_BLOCKS - 1) * BLOCK_SIZE);
+	check(file_system.snapshot().get_shared_blocks() == FILE_BLOCKS - 1, "write copies the shared block");
+	check(file_system.snapshot().get_free_blocks() == source_free - 1, "copy takes one block");
+	check(read_back(file_system, "b") == expected, "clone has the write");
+	check(read_back(file_system, "a") == source, "source keeps its data");
+
+	//part of a block of the source, the rest of the block comes along into the copy
+	handle = file_system.open("a");
+	check(file_system.pwrite(handle, std::span(changed).first(10), 4 * BLOCK_SIZE + 20) == 10, "write to the source");
+	file_system.close(handle);
+
+	std::vector<std::byte> source_expected = source;
+	std::fill_n(source_expected.begin() + 4 * BLOCK_SIZE + 20, 10, std::byte{ 'w' });
+	check(file_system.snapshot().get_shared_blocks() == FILE_BLOCKS - 2, "partial write copies the shared block");
+	check(read_back(file_system, "a") == source_expected, "source has the write");
+	check(read_back(file_system, "b") == expected, "clone keeps its data");
+
+	//blocks go back to the free list only when no file holds them
+	file_system.destroy("a");
+	check(file_system.snapshot().get_shared_blocks() == 0, "destroy drops the shares");
+	check(read_back(file_system, "b") == expected, "clone outlives its source");
+	file_system.destroy("b");
+	check(file_system.snapshot().get_free_blocks() == empty_free, "every block freed");
+}
+
+//shell
+
+//output of a script, one command per line
+template<class Geometry>
+std::string run_script(FileSystem<Geometry> & file_system, const std::vector<std::string> & commands) {
+
+	QuietOutput output;
+
+	for (auto & command : commands)
+		file_system.give_command(command);
+	return output.get();
+}
+
+//the shell numbers open files by slot, a slot opened again (or after in) has the same number as before
+void test_shell() {
+
+	Ldisk<DefaultGeometry> disk;
+	FileSystem<DefaultGeometry> file_system(disk);
+
+	std::string output = run_script(file_system, { "in", "cr foo", "op foo", "wr 1 x 5", "cl 1", "op foo", "rd 1 5", "cl 1" });
+	check(output == "disk initialized\nfoo created\nfoo opened 1\n5 bytes written\n1 closed\nfoo opened 1\nxxxxx\n1 closed\n", "reopened slot keeps its number");
+
+	output = run_script(file_system, { "op foo", "in", "cr foo", "op foo", "sk 1 0", "cl 1", "cl 1", "rd 2 1" });
+	check(output == "foo opened 1\ndisk initialized\nfoo created\nfoo opened 1\nposition is 0\n1 closed\nerror\nerror\n", "slot numbers after in");
+
+	//a handle held in code still goes stale when its slot is reused
+	int handle = file_system.open("foo");
+	file_system.close(handle);
+	check(file_system.open("foo") != handle, "reused slot gets a new handle");
+}
+
+//replay
+
+//a replay from an image only reads it, the image's journal isn't appended to or truncated
+void test_replay() {
+
+	if (replay_program.empty()) {
+
+		std::cerr << "replay skipped, no fs_replay given" << std::endl;
+		return;
+	}
+
+	TempFile image("replay.bin");
+	TempFile recorded_image("replay_rec.bin");
+	TempFile trace("replay.trace");
+	TempFile output("replay.json");
+	std::vector<std::byte> data(200, std::byte{ 'r' });
+
+	{
+		QuietOutput quiet;
+		Ldisk<DefaultGeometry> disk;
+		FileSystem<DefaultGeometry> file_system(disk);
+
+		file_system.give_command("in");
+		file_system.create("a");
+		int handle = file_system.open("a");
+		file_system.write(handle, data);
+		file_system.give_command("journal " + image.get());
+		file_system.create("b");
+		file_system.pwrite(handle, std::span(data).first(50), 10);
+		check(file_system.commit() == 0, "journal commit");
+	}
+
+	std::string image_data = read_file(image.get());
+	std::string journal_data = read_file(image.get() + ".journal");
+	check(!image_data.empty() && !journal_data.empty(), "image and journal written");
+
+	//recorded against a copy, loading it there attaches (and so changes) the copy's journal
+	std::filesystem::copy_file(image.get(), recorded_image.get());
+	std::filesystem::copy_file(image.get() + ".journal", recorded_image.get() + ".journal");
+
+	{
+		QuietOutput quiet;
+		Ldisk<DefaultGeometry> disk;
+		FileSystem<DefaultGeometry> file_system(disk);
+
+		file_system.give_command("in");
+		file_system.give_command("trace " + trace.get());
+		file_system.give_command("in " + recorded_image.get());
+		int handle = file_system.open("a");
+		file_system.pread(handle, data, 0);
+		file_system.pwrite(handle, data, 100);
+		file_system.create("c");
+		file_system.close(handle);
+		file_system.give_command("in " + recorded_image.get());
+		handle = file_system.open("b");
+		file_system.write(handle, data);
+		file_system.close(handle);
+		file_system.give_command("trace off");
+	}
+
+	std::string command = replay_program + " " + trace.get() + " --image " + image.get() + " > " + output.get();
+	check(std::system(command.c_str()) == 0, "fs_replay runs");
+	check(read_file(output.get()).find("\"mismatches\": 0,") != std::string::npos, "replay matches the recorded results");
+	check(read_file(image.get()) == image_data, "image unchanged by the replay");
+	check(read_file(image.get() + ".journal") == journal_data, "journal unchanged by the replay");
+}
+
+static const TEST_GROUP groups[] = {
+
+	{ "async", test_async },
+	{ "device", test_device },
+	{ "replay", test_replay },
+	{ "journal", test_journal },
+	{ "journal_crash", test_journal_crash },
+	{ "save", test_save },
+	{ "checkpoint", test_checkpoint },
+	{ "clone", test_clone },
+	{ "shell", test_shell },
+};
+
+int main(int argc, char * argv[]) {
+
+	bool found = false;
+
+	if (argc > 2)
+		replay_program = argv[2];
+
+	for (auto & group : groups) {
+
+		if ((argc > 1) && (std::string(argv[1]) != group.name))
+			continue;
+
+		found = true;
+		group.run();
+	}
+
+	if (!found) {
+
+		std::cerr << "no test group " << argv[1] << std::endl;
+		return 1;
+	}
+	return std::min(failures, 100);
+}
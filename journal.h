@@ -0,0 +1,421 @@
+#pragma once
+
+#include "base.h"
+
+//Write-ahead journal, changed blocks are logged in transactions and replayed onto the disk image after a crash
+
+/*
+JOURNAL INFO -
+
+file - JOURNAL_HEADER, then transactions, each a JOURNAL_COMMIT followed by block_count entries
+       (block number, then the block's new contents)
+a transaction counts only when all of it is in the file and its checksum matches, replay stops at the first one that doesn't,
+so a crash during a flush loses that group of transactions, never part of one
+
+group commit - logged blocks gather in the open transaction (a block logged twice is kept once, the newest copy),
+seal() closes it, the caller makes sure no operation is half done at that point,
+wait_durable() writes every sealed transaction with one fsync, callers waiting at the same time share that flush
+
+the journal holds whole blocks, replaying one onto the image it was started from (or onto an older replay) gives the committed disk
+a checkpoint that wrote every transaction up to a sequence into the image trims them off the front, the rest replay onto that image
+*/
+
+struct JOURNAL_HEADER {
+
+	char magic[8];                 //always JOURNAL_MAGIC
+	std::uint32_t version;
+	std::uint32_t block_size;      //geometry of the disk
+	std::uint32_t num_blocks;
+	std::uint32_t reserved;
+};
+
+struct JOURNAL_COMMIT {
+
+	std::uint32_t magic;           //always JOURNAL_COMMIT_MAGIC
+	std::uint32_t block_count;
+	std::uint64_t sequence;        //one more than the transaction before it
+	std::uint64_t checksum;        //entries of the transaction, seeded with the sequence
+};
+
+static const char JOURNAL_MAGIC[8] = { 'L', 'D', 'J', 'O', 'U', 'R', 'N', 'L' };
+static const std::uint32_t JOURNAL_VERSION = 1;
+static const std::uint32_t JOURNAL_COMMIT_MAGIC = 0x4e584354;   //"TCXN"
+
+//what replay found
+struct JOURNAL_REPLAY {
+
+	bool valid;                    //header matched the geometry
+	int transactions;              //applied
+	std::uint64_t last_sequence;
+	std::int64_t length;           //bytes of the file up to the end of the last good transaction
+};
+
+//both names lead to one file (the second doesn't have to exist)
+inline bool is_same_file(const std::string & first, const std::string & second) {
+
+#ifndef _WIN32
+	struct stat first_info, second_info;
+
+	if ((stat(first.c_str(), &first_info) == 0) && (stat(second.c_str(), &second_info) == 0))
+		return (first_info.st_dev == second_info.st_dev) && (first_info.st_ino == second_info.st_ino);
+#endif
+	return first == second;
+}
+
+class Journal {
+
+private:
+
+	int block_size;
+	int entry_size;                                     //block number and block
+	int fd;
+	std::string file_name;
+
+	std::mutex lock;                                    //everything below
+	std::condition_variable flush_done;
+	std::vector<char> open_entries;                     //open transaction
+	std::unordered_map<int, std::size_t> open_blocks;   //block -> offset of its entry
+	std::vector<char> sealed;                           //sealed transactions not written yet, commit headers included
+	std::uint64_t next_sequence;                        //of the open transaction
+	std::uint64_t sealed_sequence;                      //last one sealed
+	std::uint64_t durable_sequence;                     //last one in the file and synced
+	bool flushing;                                      //a thread is writing sealed out
+	bool failed;                                        //a write failed, nothing since is durable
+
+	static std::uint64_t checksum(std::uint64_t sequence, const char * p, std::size_t length);
+	static bool write_all(int file, const char * p, std::size_t length);
+
+public:
+
+	explicit Journal(int block_bytes);
+	~Journal() { close(); }
+
+	Journal(const Journal &) = delete;
+	Journal & operator=(const Journal &) = delete;
+
+	bool create(const std::string & journal_file, int num_blocks);                  //new empty journal, false if it can't be written
+	bool append(const std::string & journal_file, const JOURNAL_REPLAY & replayed);  //carry on after a replay, a torn tail is cut off
+	void close();
+	inline const std::string & get_file() const { return file_name; }
+
+	void log_block(int block_num, const char * data);  //into the open transaction
+	std::uint64_t seal();                              //sequence to wait for, the last sealed one if nothing was logged
+	bool wait_durable(std::uint64_t sequence);         //false if the write or sync failed
+	bool reset();                                      //checkpoint, everything logged is in the image now, empties the file
+	bool trim(std::uint64_t sequence);                 //checkpoint of everything up to sequence, later transactions are kept
+
+	//calls apply(block, data) for every block of every good transaction in order
+	static JOURNAL_REPLAY replay(const std::string & journal_file, int block_bytes, int num_blocks, std::function<void(int, const char *)> apply);
+};
+
+inline Journal::Journal(int block_bytes) : block_size(block_bytes), entry_size((int)sizeof(std::int32_t) + block_bytes), fd(-1),
+	next_sequence(1), sealed_sequence(0), durable_sequence(0), flushing(false), failed(false) {}
+
+//FNV-1a
+inline std::uint64_t Journal::checksum(std::uint64_t sequence, const char * p, std::size_t length) {
+
+	std::uint64_t hash = 14695981039346656037ULL ^ sequence;
+
+	for (std::size_t i = 0; i < length; i++)
+		hash = (hash ^ (unsigned char)p[i]) * 1099511628211ULL;
+
+	return hash;
+}
+
+inline bool Journal::write_all(int file, const char * p, std::size_t length) {
+
+#ifndef _WIN32
+	while (length > 0) {
+
+		ssize_t written = ::write(file, p, length);
+		if (written < 0) {
+
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		p += written;
+		length -= written;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+inline bool Journal::create(const std::string & journal_file, int num_blocks) {
+
+	close();
+
+#ifndef _WIN32
+	fd = ::open(journal_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+	if (fd == -1)
+		return false;
+
+	JOURNAL_HEADER header = {};
+	std::memcpy(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+	header.version = JOURNAL_VERSION;
+	header.block_size = block_size;
+	header.num_blocks = num_blocks;
+
+#ifndef _WIN32
+	if (!write_all(fd, (const char *)&header, sizeof(header)) || (fsync(fd) == -1)) {
+
+		close();
+		return false;
+	}
+#endif
+
+	std::lock_guard<std::mutex> guard(lock);
+	file_name = journal_file;
+	next_sequence = 1;
+	sealed_sequence = durable_sequence = 0;
+	failed = false;
+	return true;
+}
+
+inline bool Journal::append(const std::string & journal_file, const JOURNAL_REPLAY & replayed) {
+
+	close();
+
+#ifndef _WIN32
+	fd = ::open(journal_file.c_str(), O_RDWR);
+	if ((fd != -1) && ((ftruncate(fd, (off_t)replayed.length) == -1) || (lseek(fd, 0, SEEK_END) == -1))) {
+
+		::close(fd);
+		fd = -1;
+	}
+#endif
+	if (fd == -1)
+		return false;
+
+	std::lock_guard<std::mutex> guard(lock);
+	file_name = journal_file;
+	next_sequence = replayed.last_sequence + 1;
+	sealed_sequence = durable_sequence = replayed.last_sequence;
+	failed = false;
+	return true;
+}
+
+inline void Journal::close() {
+
+	std::unique_lock<std::mutex> guard(lock);
+	flush_done.wait(guard, [this] { return !flushing; });
+
+#ifndef _WIN32
+	if (fd != -1)
+		::close(fd);
+#endif
+	fd = -1;
+	file_name.clear();
+	open_entries.clear();
+	open_blocks.clear();
+	sealed.clear();
+}
+
+inline void Journal::log_block(int block_num, const char * data) {
+
+	std::lock_guard<std::mutex> guard(lock);
+	auto entry = open_blocks.find(block_num);
+
+	if (entry != open_blocks.end()) {
+
+		std::memcpy(open_entries.data() + entry->second + sizeof(std::int32_t), data, block_size);
+		return;
+	}
+
+	std::size_t offset = open_entries.size();
+	std::int32_t block = block_num;
+	open_entries.resize(offset + entry_size);
+	std::memcpy(open_entries.data() + offset, &block, sizeof(block));
+	std::memcpy(open_entries.data() + offset + sizeof(block), data, block_size);
+	open_blocks[block_num] = offset;
+}
+
+inline std::uint64_t Journal::seal() {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (open_blocks.empty())
+		return sealed_sequence;
+
+	JOURNAL_COMMIT commit = {};
+	commit.magic = JOURNAL_COMMIT_MAGIC;
+	commit.block_count = (std::uint32_t)open_blocks.size();
+	commit.sequence = next_sequence;
+	commit.checksum = checksum(commit.sequence, open_entries.data(), open_entries.size());
+
+	sealed.insert(sealed.end(), (const char *)&commit, (const char *)&commit + sizeof(commit));
+	sealed.insert(sealed.end(), open_entries.begin(), open_entries.end());
+	open_entries.clear();
+	open_blocks.clear();
+
+	sealed_sequence = next_sequence++;
+	return sealed_sequence;
+}
+
+//the first caller to find no flush running becomes the flusher for everyone sealed so far
+inline bool Journal::wait_durable(std::uint64_t sequence) {
+
+	std::unique_lock<std::mutex> guard(lock);
+
+	while (true) {
+
+		if (failed || (fd == -1))
+			return false;
+		if (durable_sequence >= sequence)
+			return true;
+		if (!flushing)
+			break;
+		flush_done.wait(guard);
+	}
+
+	std::vector<char> batch;
+	batch.swap(sealed);
+	std::uint64_t batch_sequence = sealed_sequence;
+	flushing = true;
+	guard.unlock();
+
+	bool written = write_all(fd, batch.data(), batch.size());
+#ifndef _WIN32
+	written = written && (fdatasync(fd) == 0);
+#endif
+
+	guard.lock();
+	flushing = false;
+	if (written)
+		durable_sequence = batch_sequence;
+	else
+		failed = true;
+	flush_done.notify_all();
+
+	return written;
+}
+
+inline bool Journal::reset() {
+
+	std::unique_lock<std::mutex> guard(lock);
+	flush_done.wait(guard, [this] { return !flushing; });
+
+	open_entries.clear();
+	open_blocks.clear();
+	sealed.clear();
+	durable_sequence = sealed_sequence = next_sequence - 1;
+
+	if (fd == -1)
+		return false;
+
+#ifndef _WIN32
+	if ((ftruncate(fd, sizeof(JOURNAL_HEADER)) == -1) || (lseek(fd, 0, SEEK_END) == -1) || (fsync(fd) == -1)) {
+
+		failed = true;
+		return false;
+	}
+#endif
+
+	failed = false;
+	return true;
+}
+
+//the kept transactions are written beside the file and renamed over it, a crash leaves the old journal, which still replays right
+inline bool Journal::trim(std::uint64_t sequence) {
+
+	std::unique_lock<std::mutex> guard(lock);
+	flush_done.wait(guard, [this] { return !flushing; });
+
+	if (failed || (fd == -1))
+		return false;
+
+#ifndef _WIN32
+	//the file holds the durable transactions, find the first one after sequence
+	std::int64_t offset = sizeof(JOURNAL_HEADER);
+	std::int64_t end = lseek(fd, 0, SEEK_END);
+	JOURNAL_COMMIT commit;
+
+	while ((offset < end) && (pread(fd, &commit, sizeof(commit), offset) == (ssize_t)sizeof(commit)) && (commit.sequence <= sequence))
+		offset += (std::int64_t)(sizeof(commit) + (std::size_t)commit.block_count * entry_size);
+
+	if (offset == (std::int64_t)sizeof(JOURNAL_HEADER))
+		return true;
+
+	//nothing after it, emptied like reset but the open and sealed transactions stay
+	if (offset >= end) {
+
+		if ((ftruncate(fd, sizeof(JOURNAL_HEADER)) == -1) || (lseek(fd, 0, SEEK_END) == -1) || (fsync(fd) == -1)) {
+
+			failed = true;
+			return false;
+		}
+		return true;
+	}
+
+	std::vector<char> kept(sizeof(JOURNAL_HEADER) + (std::size_t)(end - offset));
+	std::string temp_name = file_name + ".tmp";
+	bool written = (pread(fd, kept.data(), sizeof(JOURNAL_HEADER), 0) == (ssize_t)sizeof(JOURNAL_HEADER)) &&
+		(pread(fd, kept.data() + sizeof(JOURNAL_HEADER), kept.size() - sizeof(JOURNAL_HEADER), offset) == (ssize_t)(kept.size() - sizeof(JOURNAL_HEADER)));
+	int temp = written ? ::open(temp_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644) : -1;
+
+	written = (temp != -1) && write_all(temp, kept.data(), kept.size()) && (fsync(temp) == 0) && (std::rename(temp_name.c_str(), file_name.c_str()) == 0);
+	if (!written) {
+
+		if (temp != -1) {
+
+			::close(temp);
+			std::remove(temp_name.c_str());
+		}
+		return false;
+	}
+
+	::close(fd);
+	fd = temp;  //at its end, the next flush appends there
+	return true;
+#else
+	return false;
+#endif
+}
+
+inline JOURNAL_REPLAY Journal::replay(const std::string & journal_file, int block_bytes, int num_blocks, std::function<void(int, const char *)> apply) {
+
+	JOURNAL_REPLAY replayed = { false, 0, 0, 0 };
+	std::ifstream inFile(journal_file, std::ios::binary);
+	JOURNAL_HEADER header = {};
+
+	if (!inFile.read((char *)&header, sizeof(header)) || (std::memcmp(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) ||
+		(header.version != JOURNAL_VERSION) || ((int)header.block_size != block_bytes) || ((int)header.num_blocks != num_blocks))
+		return replayed;
+
+	replayed.valid = true;
+	replayed.length = sizeof(header);
+
+	std::size_t entry_bytes = sizeof(std::int32_t) + block_bytes;
+	std::vector<char> entries;
+	JOURNAL_COMMIT commit;
+
+	while (inFile.read((char *)&commit, sizeof(commit))) {
+
+		//numbers carry on across checkpoints, so only the first one can be anything
+		bool in_order = (replayed.transactions == 0) || (commit.sequence == replayed.last_sequence + 1);
+		if ((commit.magic != JOURNAL_COMMIT_MAGIC) || !in_order || (commit.block_count > (std::uint32_t)num_blocks))
+			break;
+
+		entries.resize(commit.block_count * entry_bytes);
+		if (!inFile.read(entries.data(), (std::streamsize)entries.size()) || (checksum(commit.sequence, entries.data(), entries.size()) != commit.checksum))
+			break;
+
+		for (std::size_t offset = 0; offset < entries.size(); offset += entry_bytes) {
+
+			std::int32_t block;
+			std::memcpy(&block, entries.data() + offset, sizeof(block));
+			if ((block >= 0) && (block < num_blocks))
+				apply(block, entries.data() + offset + sizeof(block));
+		}
+
+		replayed.transactions++;
+		replayed.last_sequence = commit.sequence;
+		replayed.length += (std::int64_t)(sizeof(commit) + entries.size());
+	}
+
+	return replayed;
+}
@@ -1,403 +1,2041 @@
 #pragma once
 
 #include "base.h"
+#include "disk_geometry.h"
+#include "block_allocator.h"
+#include "block_device.h"
+#include "journal.h"
+#include "stats.h"
 
 //Logical disk for the filesystem
 
 /*
-LDISK INFO - 
+LDISK INFO -
+
+(default geometry, see disk_geometry.h)
 
 [0] - This is the bitmap, shows what blocks are open for use
 
-(EACH INDEX 16 bits)
-[1 - 6] - File descriptors, each can contain 3 integers that specify blocks the file uses and one integer for file size
+(EACH INDEX 32 bytes)
+[1 - 12] - File descriptors, file size, extent count, extent block links and the first two extents (start block, length) of the file
+
+(EACH INDEX 16 bytes)
+[13 - 15] - These are the blocks for the directory file, fixed size records of name length, name and descriptor index
+
+extents past the ones in a descriptor go in extent blocks, EXTENTS_PER_BLOCK extents and then the next extent block
+
+DISK IMAGE -
+
+binary image is a DISK_HEADER followed by the raw blocks, the text image is one line of '0'/'1' per block
+a delta is a DELTA_HEADER, the name of a binary image and the blocks that differ from it (block number, then the block)
+
+CHECKPOINTS -
+
+every block changed since the disk matched its image is marked dirty (block writes, descriptor changes, allocations and releases)
+saving over the image the disk was loaded from or last saved to writes only those blocks in place, a delta holds just them,
+unless copies of the disk still read pages of its mapped image, then the whole image is written beside it and renamed over it
+sync on a device writes only the changed cache blocks
+an in place save isn't atomic like a full one (written beside the image and renamed), a crash part way leaves a mix
+unless a journal is running, the changes are committed to it first and replayed
+
+begin_checkpoint takes a copy on write snapshot while nothing runs: the dirty bits move to the checkpoint, changed cache blocks are copied,
+write_checkpoint then writes them into the image (the device) on any thread while the disk is in use,
+a data block it hasn't reached yet is copied into the checkpoint by the first write to it, so the image gets the block as of the snapshot
+the snapshot is committed to the journal first (the checkpoint is cancelled if it can't be), once the image is synced
+the journal is trimmed to the transactions sealed after it
 
-(EACH INDEX 8 bits)
-[7 - 9] - These are the blocks for the directory file, contains file name and index of descriptor
+PAGES -
+
+in memory the blocks are held in pages of PAGE_BLOCKS blocks, shared copy on write: a copy of the disk takes the page pointers
+and both sides copy a page the first time they write it, so a copy costs a pointer per page (plus the cache) instead of the disk
+a fresh disk points every page at one zero page, a loaded image at its read only mapping, neither is written in place
+pages a disk stopped using are kept until it is reloaded, a reader that still has the old pointer never sees it freed
+
+CLONES -
+
+a clone is a new descriptor holding the same blocks as its source, each of them gains a share (files holding it besides the first)
+shares aren't stored, they are counted from the descriptors whenever the cache is read, so an image looks like any other
+a file about to write a shared block gets its own copy first (FileSystem), a file that lets go of a block only releases it
+when nothing else holds it, extent blocks are never shared
+
+DEVICE -
+
+open_device keeps the disk in a file laid out like the binary image, blocks go through a BlockDevice (block_device.h)
+and only the cache is held in memory, so the file can be far larger than RAM
+read_blocks/write_blocks put every block of a batch in flight at once, the async calls return before the I/O is done
+
+JOURNAL -
+
+start_journal saves the image (syncs the device) and logs every change after it to <image>.journal (journal.h),
+data blocks as they are written, bitmap and descriptor blocks from the cache when a transaction is sealed
+init_disk/open_device replay a journal found next to the image and keep logging to it, saving over the image empties it
+on a device data blocks reach the file before their transaction commits, the journal only makes the metadata consistent
 */
 
-//FROM http://stackoverflow.com/questions/21128331/how-do-you-efficiently-support-sub-bitstrings-in-a-bitset-like-class-in-c11
-template<size_t bits>
-std::bitset<bits> subset(std::bitset<bits> set, int min, int max) {
+struct DISK_HEADER {
 
-	const int ignore_hi = bits - max;
-	std::bitset<bits> range = (~std::bitset<bits>() << ignore_hi) >> ignore_hi;
-	set &= range;
-	return set >> min;
-}
+	char magic[8];                 //always DISK_MAGIC
+	std::uint32_t version;         //image layout version
+	std::uint32_t header_size;     //bytes before the first block
+	std::uint32_t block_size;      //bytes
+	std::uint32_t num_blocks;
+	std::uint32_t reserved[10];
+};
+
+//run of blocks in a file
+struct EXTENT {
+
+	std::int32_t start;                             //first block
+	std::int32_t length;                            //blocks
+};
+
+//one block of a batched read or write
+struct BLOCK_IO {
+
+	int block;
+	char * buffer;                                  //BLOCK_SIZE bytes
+};
+
+//file descriptor, DESC_SIZE bytes in the descriptor blocks
+template<class Geometry = DefaultGeometry>
+struct DESCRIPTOR {
 
+	std::int32_t size;                              //file size in bytes
+	std::int32_t extent_count;                      //extents in the file, 0 when the descriptor is unused
+	std::int32_t extent_block;                      //first extent block, 0 when every extent fits in the descriptor
+	std::int32_t last_extent_block;                 //extent block holding the last extent (appends go here)
+	EXTENT extents[Geometry::DIRECT_EXTENTS];       //first extents of the file
+};
+
+static const char DISK_MAGIC[8] = { 'L', 'D', 'I', 'S', 'K', 'I', 'M', 'G' };
+static const std::uint32_t DISK_VERSION = 3;
+
+struct DELTA_HEADER {
+
+	char magic[8];                 //always DELTA_MAGIC
+	std::uint32_t version;
+	std::uint32_t block_size;
+	std::uint32_t num_blocks;
+	std::uint32_t block_count;     //blocks that follow
+	std::uint32_t base_length;     //bytes of the base image's name
+	std::uint32_t reserved;
+};
+
+static const char DELTA_MAGIC[8] = { 'L', 'D', 'I', 'S', 'K', 'D', 'L', 'T' };
+static const std::uint32_t DELTA_VERSION = 1;
+
+template<class Geometry = DefaultGeometry>
 class Ldisk {
 
 private:
 
 	//ldisk defined sizes
-	static const int BLOCK_SIZE = 512;  //bits
-	static const int NUM_BLOCKS = 64;   //bits
-	static const int BYTE_SIZE = 8;     //bits
-	static const int CACHE_SIZE = 7;   //size of the cache
-
-	static const int DESC_INDEX = 16;   //bits (index in descriptor portion)
-	static const int DIR_INDEX = 8;     //bits (index in directory portion)
-	
-	static const int FILE_BLOCK_START = 7;
+	static const int BLOCK_SIZE = Geometry::BLOCK_SIZE;   //bytes
+	static const int NUM_BLOCKS = Geometry::NUM_BLOCKS;   //blocks
+	static const int BYTE_SIZE = Geometry::BYTE_SIZE;     //bits
+	static const int CACHE_SIZE = Geometry::CACHE_SIZE;   //size of the cache
 
-	//descriptor bounds
-	static const int DESCRIPTOR_START = 1;
-	static const int DESCRIPTOR_END = 6;
+	static const int DESC_SIZE = Geometry::DESC_SIZE;     //bytes (file size and file blocks)
+	static const int DESC_PER_BLOCK = Geometry::DESC_PER_BLOCK;
+	static const int NUM_DESCRIPTORS = Geometry::NUM_DESCRIPTORS;
+	static const int DIRECT_EXTENTS = Geometry::DIRECT_EXTENTS;
+	static const int EXTENTS_PER_BLOCK = Geometry::EXTENTS_PER_BLOCK;
 
-	static const int INT_SIZE = 32;  //bits
-	static const int CHAR_SIZE = 8;  //bits
+	static const int FILE_BLOCK_START = Geometry::FILE_BLOCK_START;
 
-	std::bitset<BLOCK_SIZE> ldisk[NUM_BLOCKS];  //logical disk
-	std::bitset<BLOCK_SIZE> cache[CACHE_SIZE];  //cahce for bitmap/file descriptors
+	//descriptor bounds
+	static const int DESCRIPTOR_START = Geometry::DESCRIPTOR_START;
+	static const int DESCRIPTOR_END = Geometry::DESCRIPTOR_END;
+
+	static const int INT_SIZE = Geometry::INT_SIZE;   //bytes
+	static const int CHAR_SIZE = 1;  //bytes
+
+	static constexpr int TRANSFER_BLOCKS = ((1 << 20) / BLOCK_SIZE > 0) ? (1 << 20) / BLOCK_SIZE : 1;  //blocks per request when moving whole ranges (1 MiB)
+	static constexpr int PAGE_BLOCKS = std::clamp((1 << 16) / BLOCK_SIZE, 1, NUM_BLOCKS);            //blocks per copy on write page (64 KiB)
+	static const int NUM_PAGES = (NUM_BLOCKS + PAGE_BLOCKS - 1) / PAGE_BLOCKS;
+	static constexpr std::size_t PAGE_BYTES = (std::size_t)PAGE_BLOCKS * BLOCK_SIZE;
+
+	static_assert(sizeof(DESCRIPTOR<Geometry>) == DESC_SIZE, "descriptor layout does not match the geometry");
+	static_assert(NUM_DESCRIPTORS <= 65536, "block shares have to fit in 16 bits");
+
+	mutable std::vector<unsigned char *> pages;             //blocks of each page in memory (a copied page is swapped in with an atomic store)
+	std::vector<std::shared_ptr<unsigned char[]>> page_memory;    //owner of each page, empty for pages of the mapping
+	mutable std::vector<std::uint8_t> page_owned;           //1 when no other disk has the page, it is written in place
+	std::vector<std::shared_ptr<unsigned char[]>> retired_pages;  //pages replaced by a copy, kept until the disk is reloaded
+	std::mutex page_lock;                                   //copying a page, page_memory and retired_pages
+	std::shared_ptr<unsigned char> disk_mapping;            //mapped binary image (read only), shared with copies
+	std::uint64_t mapped_device;                            //file the mapping is of (it stays that inode after a rename over its name)
+	std::uint64_t mapped_inode;
+	std::shared_ptr<BlockDevice> device;                    //file holding the disk, nullptr when it is in memory
+	Stats * stats;                                          //counters of the owner, nullptr to not count (copies don't)
+	std::string device_file;                                //file the device has open
+	std::string base_file;                                  //binary image the disk matches apart from dirty blocks, empty if none (in memory)
+	std::vector<std::uint64_t> dirty_words;                 //one bit per block changed since then (set with an atomic or)
+	std::atomic<int> dirty_count;                           //bits set in dirty_words
+	std::shared_ptr<Journal> journal;                       //nullptr when not journaling (copies don't)
+	std::vector<unsigned char> journal_bitmap;              //bitmap blocks as of the last seal
+	std::vector<std::uint8_t> journal_dirty;                //cache blocks with descriptors changed since the last seal
+	std::vector<std::uint64_t> cache;                       //cahce for bitmap/file descriptors, CACHE_SIZE blocks
+	mutable BlockAllocator<Geometry> allocator;             //free blocks in the cached bitmap (copies give back reservations first)
+
+	std::vector<std::uint64_t> descriptor_words;            //one bit per descriptor (1 = in use), claimed with compare and swap
+	std::vector<std::uint16_t> block_shares;                //files holding each block besides the first (changed with compare and swap)
+	std::atomic<int> shared_blocks;                         //blocks with a share
+
+	//snapshot being written by write_checkpoint
+	struct CHECKPOINT {
+
+		int fd;                                             //image written to, -1 on a device
+		bool whole_image;                                   //fd is a new image beside it, renamed over it once written
+		std::vector<std::uint64_t> blocks;                  //dirty bits as of the snapshot, given back if the write fails
+		std::vector<std::uint64_t> pending;                 //blocks still as of the snapshot on the disk (cleared with an atomic and)
+		std::unordered_map<int, std::vector<char>> saved;   //snapshot copies of the cache blocks and of blocks written since
+		std::mutex lock;                                    //saved and clearing pending
+		std::atomic<bool> running;                          //writes have to check pending
+	} checkpoint;
+	std::atomic<int> free_descriptor_count;
+
+	//a descriptor's contents belong to whoever holds its file, only the allocator and descriptor_words are shared
 
 	int directory_descriptor;
 
 	void clear_disk();
+	void use_memory();                                            //in memory, every page the zero page
+	void share_pages(const Ldisk & other);                        //other's pages, copy on write on both sides
+	void copy_page(int page);                                     //this disk's own copy of a shared page
+	bool mapping_shared(int fd);                                  //other disks read pages of the mapping and fd is the mapped file
+	void format_disk();                                           //empty disk with a directory, on whatever backs it now
+
+	inline unsigned char * block(int i) const { return std::atomic_ref<unsigned char *>(pages[i / PAGE_BLOCKS]).load(std::memory_order_acquire) + (std::size_t)(i % PAGE_BLOCKS) * BLOCK_SIZE; }
+	inline unsigned char * writable_block(int i);                 //block(i) in a page only this disk has
+	inline std::int64_t device_offset(int i) const { return (std::int64_t)sizeof(DISK_HEADER) + ((std::int64_t)i * BLOCK_SIZE); }
+
+	//count blocks from start, memcpy in memory, one device transfer otherwise
+	void load_blocks(int start, int count, char * p) const;
+	void store_blocks(int start, int count, const char * p);
+	void transfer_blocks(bool is_write, const BLOCK_IO * ios, int count);
+
+	void note_written(int start, int count, const char * p);       //data blocks marked dirty and logged in the open transaction
+	inline void mark_descriptor(int desc_index);                  //its cache block is dirty and goes into the next transaction
+	void mark_dirty(int start, int count);
+	inline void mark_word(std::size_t index, std::uint64_t mask);
+	inline void mark_bitmap(int block_num, int count) { if (block_num >= 0) mark_dirty(block_num / (BLOCK_SIZE * BYTE_SIZE), ((block_num + count - 1) / (BLOCK_SIZE * BYTE_SIZE)) - (block_num / (BLOCK_SIZE * BYTE_SIZE)) + 1); }
+	inline void clear_dirty() { dirty_words.assign((NUM_BLOCKS + 63) / 64, 0); dirty_count = 0; }
+	template<class Run> static void for_dirty_runs(const std::vector<std::uint64_t> & words, int first, int last, Run run);   //run(start, count) for each run of set bits in [first, last)
+	void preserve_blocks(int start, int count);                   //snapshot copies of pending blocks about to be written
+	void take_checkpoint_blocks(int start, int count, char * p);  //snapshot contents, none of them pending afterwards
+	bool end_checkpoint(bool written);                            //image closed and the snapshot dropped, its blocks dirty again unless written
+	int open_image(const std::string & file_name);                //for writing in place, -1 if it isn't an image of this geometry
+	static bool write_at(int fd, const char * p, std::size_t length, std::int64_t offset);
+
+	void write_image(const std::string & file_name);              //whole binary image, beside the file and renamed over it
+	bool write_dirty_blocks(const std::string & file_name);       //in place, false if the file isn't an image of this geometry or copies read its mapping
+	bool load_delta(std::ifstream & inFile);                      //base image and the delta's blocks
+	void reset_journal_state();                                   //the image holds everything up to now
+	JOURNAL_REPLAY replay_journal(const std::string & file_name); //journal of an image onto the blocks, before read_cache
+	void attach_journal(const std::string & file_name, const JOURNAL_REPLAY & replayed);
+	void load_disk(const std::string & file_name, bool attach);   //init_disk, the journal is reopened for appending if attach
+
+	static DISK_HEADER make_header();
+	static bool is_header(const DISK_HEADER & header);            //image of this geometry
+	inline unsigned char * cache_block(int i) { return (unsigned char *)cache.data() + (std::size_t)i * BLOCK_SIZE; }
 
 	void write_cache();
 	void read_cache();
 
-	int read_int(std::bitset<BLOCK_SIZE> block, int start);      //read int at index
-	char read_char(std::bitset<BLOCK_SIZE> block, int start);    //read char at index
+	inline unsigned char * desc_address(int desc_index);          //location of a descriptor in the cache
+	void build_descriptor_words();
+	void build_block_shares();                                    //counted from the extents of every descriptor
+	bool drop_share(int block_num);                               //false if no other file holds the block
+	int claim_descriptor();                                       //lowest free descriptor, -1 if none
+	bool has_directory();                                         //first descriptor looks like a directory (rejects images of another layout)
+
+	EXTENT last_extent(const DESCRIPTOR<Geometry> & descriptor);
+
+	inline void read_extent_block(int block_num, EXTENT * extents) { load_blocks(block_num, 1, (char *)extents); }
+	inline void write_extent_block(int block_num, const EXTENT * extents) { store_blocks(block_num, 1, (const char *)extents); }
 
-	void write_int(std::bitset<BLOCK_SIZE> * block, int start, int insert_int);
+	std::string block_to_bits(int i, const unsigned char * data); //text image line for block i holding data
+	void bits_to_block(int i, const std::string & line);
 
-	std::pair<int, int> get_desc_location(int desc_index);       //returns block index, and bit index
+	bool map_disk(std::string file_name);                         //map a binary image
+	void import_disk(std::ifstream & inFile);                     //load a text image
 
 public:
 
 	Ldisk();
+	Ldisk(const Ldisk & other);
+	Ldisk & operator=(const Ldisk & other);
 
 	void dump_disk();   //DEBUG!!!!!!!!!!!!!!!!!
 
 	void read_block(int i, char * p);
 	void write_block(int i, char * p);
-
-	int find_free_block();
-	inline void release_block(int block_num) { cache[0][block_num] = 0; }
-
-	void save_disk(std::string file_name);
+	inline void read_blocks(const BLOCK_IO * ios, int count) { transfer_blocks(false, ios, count); }   //returns once every block is done
+	inline void write_blocks(const BLOCK_IO * ios, int count) { transfer_blocks(true, ios, count); }
+
+	//on_complete gets BLOCK_SIZE or -errno, p has to stay valid until then
+	void read_block_async(int i, char * p, std::function<void(int)> on_complete);
+	void write_block_async(int i, char * p, std::function<void(int)> on_complete);
+	std::future<int> read_block_async(int i, char * p);
+	std::future<int> write_block_async(int i, char * p);
+
+	inline int find_free_block() { StatScope scope(stats, STAT_ALLOCATE); int block_num = allocator.allocate(); mark_bitmap(block_num, 1); return block_num; }                 //returns -1 when disk is full
+	inline int allocate_contiguous(int count) { StatScope scope(stats, STAT_ALLOCATE); int start = allocator.allocate_contiguous(count); mark_bitmap(start, count); return start; }  //returns first block, -1 if no run
+	inline void release_block(int block_num) { StatScope scope(stats, STAT_RELEASE); allocator.release(block_num); mark_bitmap(block_num, 1); }
+	inline void release_blocks(int start, int count) { StatScope scope(stats, STAT_RELEASE); allocator.release_contiguous(start, count); mark_bitmap(start, count); }
+	inline void return_reservations() { allocator.return_reservations(); }                  //blocks held by per thread caches
+	inline int get_free_blocks() { return allocator.get_free_blocks(); }
+
+	void save_disk(std::string file_name);                      //binary image, in place when it is the disk's own image
+	bool save_delta(std::string file_name);                     //blocks changed since the disk's image, false when it has none
+	void export_disk(std::string file_name);                    //text image
 	void init_disk(std::string file_name);
 	void init_disk();
+	void copy_disk(std::string file_name);                      //like init_disk, but the image and its journal are only read (no journal, no image to save into)
+	bool open_device(std::string file_name);                    //disk in a file (created if missing), false if it can't be used
+	bool sync_disk();                                           //cache back to the device and the file flushed, false when in memory
+	inline bool on_device() { return device != nullptr; }
+
+	//callers make sure nothing changes the disk while these run
+	bool start_journal(std::string file_name);                  //saves the image to file_name (ignored on a device) and starts logging
+	void stop_journal();                                        //the open transaction is dropped
+	std::uint64_t seal_journal();                               //changed cache blocks go in, returns the sequence to wait for
+	inline std::shared_ptr<Journal> get_journal() { return journal; }
+	inline bool is_journaling() { return journal != nullptr; }
+
+	//a checkpoint writes the disk as it was at begin_checkpoint into its image (or device), callers make sure nothing changes the disk
+	//during begin_checkpoint and that the disk isn't replaced or saved before write_checkpoint returns
+	bool begin_checkpoint();                                    //false when the disk has no image to write to
+	bool write_checkpoint();                                    //while the disk is in use, false if the write or sync failed
+	void cancel_checkpoint();                                   //instead of write_checkpoint, the image is left alone and the blocks stay dirty
+	bool trim_journal(std::uint64_t sequence);                  //after a checkpoint of a snapshot sealed at sequence, false if the journal isn't the image's
+	inline int get_dirty_blocks() { return dirty_count.load(std::memory_order_relaxed); }
 
 	int init_descriptor(int new_block);                         //create new file descriptor, return index
-	void destroy_descriptor(int desc_index);					//destroy file descriptor
-	void update_descriptor_blocks(int desc_index, int new_block);      //add a block to existing descriptor
+	void destroy_descriptor(int desc_index);					//destroy file descriptor (frees its extent blocks, not its data)
+	bool append_extent(int desc_index, EXTENT extent);          //add blocks to the end of an existing descriptor
+	EXTENT grow_descriptor(int desc_index, int count);          //allocate up to count blocks and append them, length 0 if disk is full
+	void get_extents(int desc_index, std::vector<EXTENT> & extents);   //every extent of a file in order
+	bool set_extents(int desc_index, const std::vector<EXTENT> & extents);   //replace them (size kept), false and nothing changed if the disk is full
+	int clone_descriptor(int desc_index);                       //new descriptor sharing every block of desc_index, -1 if none free or the disk is full
+	template<class Freed> void drop_blocks(int start, int count, Freed freed);   //a file lets go of blocks, the ones nothing else holds go through freed(start, count) and are released
+	inline bool is_shared(int block_num) { return std::atomic_ref<std::uint16_t>(block_shares[block_num]).load(std::memory_order_acquire) != 0; }
+	inline int get_shared_blocks() { return shared_blocks.load(std::memory_order_acquire); }
 	void update_descriptor_size(int desc_index, int new_size);         //change file size in descriptor
-	std::vector<int> get_descriptor(int desc_index);
-	
+	inline DESCRIPTOR<Geometry> get_descriptor(int desc_index);
+	inline void set_descriptor(int desc_index, const DESCRIPTOR<Geometry> & descriptor);
+	inline bool is_descriptor(int desc_index) { return (desc_index >= 0) && (desc_index < NUM_DESCRIPTORS) && (get_descriptor(desc_index).extent_count > 0); }
+	inline int get_free_descriptors() { return free_descriptor_count; }
+
 	inline int get_directory_index() { return directory_descriptor; }
+	inline bool is_formatted() { return has_directory(); }      //holds a filesystem, a FileSystem can start on it without in
+	inline void set_stats(Stats * counters) { stats = counters; }
 };
 
-Ldisk::Ldisk() {   /*need to call init to use this object */   }
+template<class Geometry>
+Ldisk<Geometry>::Ldisk() : stats(nullptr), cache((std::size_t)CACHE_SIZE * BLOCK_SIZE / sizeof(std::uint64_t)), block_shares(NUM_BLOCKS, 0), shared_blocks(0),
+	directory_descriptor(0) {
+
+	checkpoint.fd = -1;
+	checkpoint.whole_image = false;
+	checkpoint.running = false;
+	clear_dirty();
+	use_memory();
+	allocator.attach(cache.data());
+	/*need to call init to use this object */
+}
+
+template<class Geometry>
+Ldisk<Geometry>::Ldisk(const Ldisk & other) : stats(nullptr), directory_descriptor(other.directory_descriptor) {
+
+	other.allocator.return_reservations();  //reserved blocks would stay used in the copy
+	cache = other.cache;
+	checkpoint.fd = -1;
+	checkpoint.whole_image = false;
+	checkpoint.running = false;
+	clear_dirty();  //a copy has no image
+
+	share_pages(other);  //a copy of a device disk lives in memory
+	allocator.attach(cache.data());
+	build_descriptor_words();
+	block_shares = other.block_shares;
+	shared_blocks = other.shared_blocks.load();
+}
+
+template<class Geometry>
+Ldisk<Geometry> & Ldisk<Geometry>::operator=(const Ldisk & other) {
+
+	if (this != &other) {
+
+		other.allocator.return_reservations();
+		stop_journal();
+		base_file.clear();
+		clear_dirty();
+		share_pages(other);
+		cache = other.cache;
+		allocator.attach(cache.data());
+		build_descriptor_words();
+		block_shares = other.block_shares;
+		shared_blocks = other.shared_blocks.load();
+		directory_descriptor = other.directory_descriptor;
+	}
+	return *this;
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::use_memory() {
+
+	std::shared_ptr<unsigned char[]> zero_page(new unsigned char[PAGE_BYTES]());
+
+	pages.assign(NUM_PAGES, zero_page.get());
+	page_memory.assign(NUM_PAGES, zero_page);
+	page_owned.assign(NUM_PAGES, 0);
+	retired_pages.clear();
+	disk_mapping.reset();
+	device.reset();
+}
 
-std::vector<int> Ldisk::get_descriptor(int desc_index) {
+//nothing may write either disk while the pages are shared out
+template<class Geometry>
+void Ldisk<Geometry>::share_pages(const Ldisk & other) {
 
-	std::vector<int> file_blocks;
-	std::pair<int, int> desc_location = get_desc_location(desc_index);
-	int desc_integer = 0;
+	if (other.device) {
 
-	for (int i = desc_location.second; i < (desc_location.second + (4 * INT_SIZE)); i += INT_SIZE) {
+		use_memory();
+		for (int page = 0; page < NUM_PAGES; page++) {
 
-		desc_integer = read_int(cache[desc_location.first], i);
-		file_blocks.push_back(desc_integer);
+			int first = page * PAGE_BLOCKS;
+			other.load_blocks(first, std::min(PAGE_BLOCKS, NUM_BLOCKS - first), (char *)writable_block(first));
+		}
+		return;
 	}
 
-	return file_blocks;
+	device.reset();
+	pages = other.pages;
+	page_memory = other.page_memory;
+	page_owned.assign(NUM_PAGES, 0);
+	other.page_owned.assign(NUM_PAGES, 0);  //other writes its own copy from now on too
+	retired_pages.clear();
+	disk_mapping = other.disk_mapping;
+	mapped_device = other.mapped_device;
+	mapped_inode = other.mapped_inode;
 }
 
-std::pair<int, int> Ldisk::get_desc_location(int desc_index) {
+template<class Geometry>
+inline unsigned char * Ldisk<Geometry>::writable_block(int i) {
 
-	std::pair<int, int> desc_location;
+	int page = i / PAGE_BLOCKS;
 
-	//find the block its in
-	if (desc_index < 4)
-		desc_location.first = DESCRIPTOR_START;
-	else if (desc_index < 8)
-		desc_location.first = DESCRIPTOR_START + 1;
-	else if (desc_index < 12)
-		desc_location.first = DESCRIPTOR_START + 2;
-	else if (desc_index < 16)
-		desc_location.first = DESCRIPTOR_START + 3;
-	else if (desc_index < 20)
-		desc_location.first = DESCRIPTOR_START + 4;
-	else
-		desc_location.first = DESCRIPTOR_START + 5;
+	if (std::atomic_ref<std::uint8_t>(page_owned[page]).load(std::memory_order_acquire) == 0)
+		copy_page(page);
+	return block(i);
+}
 
-	//find the index in the block
+//the old page stays referenced, a reader that loaded its pointer may still be copying out of it
+template<class Geometry>
+void Ldisk<Geometry>::copy_page(int page) {
 
-	desc_location.second = (desc_index - ((desc_location.first - 1) * 4)) * (INT_SIZE * 4);
+	std::lock_guard<std::mutex> guard(page_lock);
+	std::atomic_ref<std::uint8_t> owned(page_owned[page]);
 
-	return desc_location;
+	if (owned.load(std::memory_order_relaxed))
+		return;
+
+	int blocks = std::min(PAGE_BLOCKS, NUM_BLOCKS - (page * PAGE_BLOCKS));
+	std::shared_ptr<unsigned char[]> copy(new unsigned char[PAGE_BYTES]);
+	std::memcpy(copy.get(), pages[page], (std::size_t)blocks * BLOCK_SIZE);
+
+	if (page_memory[page])
+		retired_pages.push_back(std::move(page_memory[page]));
+	page_memory[page] = copy;
+	std::atomic_ref<unsigned char *>(pages[page]).store(copy.get(), std::memory_order_release);
+	owned.store(1, std::memory_order_release);
 }
 
-int Ldisk::read_int(std::bitset<BLOCK_SIZE> block, int start) {
+//a copy of the disk reads the mapped image wherever the two haven't diverged, writing the file in place would change its blocks
+template<class Geometry>
+bool Ldisk<Geometry>::mapping_shared(int fd) {
+
+#ifndef _WIN32
+	struct stat file_info;
+
+	return disk_mapping && (disk_mapping.use_count() > 1) && (fstat(fd, &file_info) == 0) &&
+		((std::uint64_t)file_info.st_dev == mapped_device) && ((std::uint64_t)file_info.st_ino == mapped_inode);
+#else
+	return false;
+#endif
+}
 
-	int end = start + (INT_SIZE - 1);
-	//convert to integer
-	std::bitset<BLOCK_SIZE> integer_bits = subset(block, start, end);
+template<class Geometry>
+inline unsigned char * Ldisk<Geometry>::desc_address(int desc_index) {
 
-	return integer_bits.to_ulong();
+	int block_index = DESCRIPTOR_START + (desc_index / DESC_PER_BLOCK);            //find the block its in
+	return cache_block(block_index) + ((desc_index % DESC_PER_BLOCK) * DESC_SIZE);  //find the index in the block
 }
 
-void Ldisk::write_int(std::bitset<BLOCK_SIZE> * block, int start, int insert_int) {
+//descriptors are copied out as a POD in host byte order, like every other field of an image (a little endian image reads wrong on a big endian host)
+template<class Geometry>
+inline DESCRIPTOR<Geometry> Ldisk<Geometry>::get_descriptor(int desc_index) {
+
+	DESCRIPTOR<Geometry> descriptor;
+	std::memcpy(&descriptor, desc_address(desc_index), sizeof(descriptor));
+
+	return descriptor;
+}
 
-	std::bitset<INT_SIZE> integer_binary(insert_int);
+template<class Geometry>
+inline void Ldisk<Geometry>::set_descriptor(int desc_index, const DESCRIPTOR<Geometry> & descriptor) {
 
-	int j = start;
-	for (int i = 0; i < INT_SIZE; i++, j++)
-		(*block)[j] = integer_binary[i];
+	std::memcpy(desc_address(desc_index), &descriptor, sizeof(descriptor));
+	mark_descriptor(desc_index);
 }
 
-char Ldisk::read_char(std::bitset<BLOCK_SIZE> block, int start) {
+template<class Geometry>
+inline void Ldisk<Geometry>::mark_descriptor(int desc_index) {
 
-	int end = start + (BYTE_SIZE - 1);
-	//convert
-	std::bitset<BLOCK_SIZE> char_bits = subset(block, start, end);
+	int block_index = DESCRIPTOR_START + (desc_index / DESC_PER_BLOCK);
 
-	return char(char_bits.to_ulong());
+	mark_dirty(block_index, 1);
+	if (journal)
+		std::atomic_ref<std::uint8_t>(journal_dirty[block_index]).store(1, std::memory_order_relaxed);
 }
 
-int Ldisk::init_descriptor(int new_block) {  
+//a word already holding the bits isn't written, so blocks written over and over don't bounce its cache line
+template<class Geometry>
+void Ldisk<Geometry>::mark_dirty(int start, int count) {
 
-	int desc_index = 0;
+	for (int i = start; i < start + count; ) {
 
-	for (int i = DESCRIPTOR_START; i <= DESCRIPTOR_END; i++) {
+		int bit = i % 64;
+		int bits = std::min(64 - bit, start + count - i);
+		std::uint64_t mask = (bits == 64) ? ~std::uint64_t(0) : (((std::uint64_t(1) << bits) - 1) << bit);
+
+		mark_word(i / 64, mask);
+		i += bits;
+	}
+}
 
-		for (int j = 0; j < BLOCK_SIZE; j+=(4*INT_SIZE), desc_index++) {
+template<class Geometry>
+inline void Ldisk<Geometry>::mark_word(std::size_t index, std::uint64_t mask) {
 
-			int curr_block = read_int(cache[i], j);  //check integer at index
-			if (curr_block == 0) {
+	std::atomic_ref<std::uint64_t> word(dirty_words[index]);
 
-				//create new entry
-				write_int(&cache[i], j, 1);
-				write_int(&cache[i], j + INT_SIZE, new_block);
-				return desc_index;
+	if ((word.load(std::memory_order_relaxed) & mask) != mask) {
+
+		std::uint64_t old = word.fetch_or(mask, std::memory_order_relaxed);
+		dirty_count.fetch_add(std::popcount(mask & ~old), std::memory_order_relaxed);
+	}
+}
+
+template<class Geometry>
+template<class Run>
+void Ldisk<Geometry>::for_dirty_runs(const std::vector<std::uint64_t> & words, int first, int last, Run run) {
+
+	int start = -1;
+
+	for (int i = first; i < last; i++) {
+
+		bool dirty = (words[i / 64] >> (i % 64)) & 1;
+
+		if (dirty && (start == -1))
+			start = i;
+		else if (!dirty && (start != -1)) {
+
+			run(start, i - start);
+			start = -1;
+		}
+
+		if (!dirty && (words[i / 64] >> (i % 64)) == 0)  //rest of the word is clean
+			i = std::min(last, ((i / 64) + 1) * 64) - 1;
+	}
+
+	if (start != -1)
+		run(start, last - start);
+}
+
+//a descriptor is in use when it holds an extent, every file gets a block when it is created
+template<class Geometry>
+void Ldisk<Geometry>::build_descriptor_words() {
+
+	int free_count = 0;
+
+	//bits past the last descriptor stay set so they are never claimed
+	descriptor_words.assign((NUM_DESCRIPTORS + 63) / 64, ~std::uint64_t(0));
+
+	for (int desc_index = 0; desc_index < NUM_DESCRIPTORS; desc_index++) {
+
+		if (!is_descriptor(desc_index)) {
+
+			descriptor_words[desc_index / 64] &= ~(std::uint64_t(1) << (desc_index % 64));
+			free_count++;
+		}
+	}
+
+	free_descriptor_count = free_count;
+}
+
+//a block n descriptors hold has n - 1 shares, an image of another layout (rejected after this) has none,
+//extents outside the file blocks (a damaged image) are skipped
+template<class Geometry>
+void Ldisk<Geometry>::build_block_shares() {
+
+	std::vector<EXTENT> extents;
+	int shared_count = 0;
+
+	block_shares.assign(NUM_BLOCKS, 0);
+	shared_blocks = 0;
+
+	if (!has_directory())
+		return;
+
+	for (int desc_index = 0; desc_index < NUM_DESCRIPTORS; desc_index++) {
+
+		DESCRIPTOR<Geometry> descriptor = get_descriptor(desc_index);
+		if ((descriptor.extent_count <= 0) || (descriptor.extent_block < 0) || (descriptor.extent_block >= NUM_BLOCKS))
+			continue;
+
+		get_extents(desc_index, extents);
+		for (auto extent : extents) {
+
+			int first = (extent.start > FILE_BLOCK_START) ? extent.start : FILE_BLOCK_START;
+			int last = (int)std::min<std::int64_t>((std::int64_t)extent.start + extent.length, NUM_BLOCKS);
+			for (int block_num = first; block_num < last; block_num++)
+				block_shares[block_num]++;
+		}
+	}
+
+	//holders so far, every block held once has no share
+	for (auto & shares : block_shares) {
+
+		if (shares > 0)
+			shares--;
+		if (shares > 0)
+			shared_count++;
+	}
+
+	shared_blocks = shared_count;
+}
+
+template<class Geometry>
+int Ldisk<Geometry>::claim_descriptor() {
+
+	for (int word = 0; word < (int)descriptor_words.size(); word++) {
+
+		std::atomic_ref<std::uint64_t> descriptor_word(descriptor_words[word]);
+		std::uint64_t old = descriptor_word.load(std::memory_order_acquire);
+
+		while (~old != 0) {
+
+			std::uint64_t bit = ~old & (old + 1);  //lowest free
+			if (descriptor_word.compare_exchange_weak(old, old | bit, std::memory_order_acq_rel)) {
+
+				free_descriptor_count--;
+				return (word * 64) + std::countr_zero(bit);
 			}
 		}
 	}
+
 	return -1;
 }
 
-void Ldisk::destroy_descriptor(int desc_index) {
+template<class Geometry>
+int Ldisk<Geometry>::init_descriptor(int new_block) {
 
-	std::pair<int, int> desc_location = get_desc_location(desc_index); //get its location
-	int desc_end = desc_location.second + (4 * INT_SIZE);
-	int block_counter = 0;
+	int desc_index = claim_descriptor();
+
+	if (desc_index == -1)
+		return -1;
 
-	for (int i = desc_location.second; i < desc_end; i += INT_SIZE, block_counter++) {  //delete four integers from descriptor
+	//create new entry
+	DESCRIPTOR<Geometry> descriptor = {};
+	descriptor.extent_count = 1;
+	descriptor.extents[0] = { new_block, 1 };
+	set_descriptor(desc_index, descriptor);
 
-		write_int(&cache[desc_location.first], i, 0);
+	return desc_index;
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::destroy_descriptor(int desc_index) {
+
+	DESCRIPTOR<Geometry> descriptor = get_descriptor(desc_index);
+	EXTENT extents[EXTENTS_PER_BLOCK + 1];
+
+	//release the chain of extent blocks
+	for (int extent_block = descriptor.extent_block; extent_block != 0; ) {
+
+		read_extent_block(extent_block, extents);
+		release_block(extent_block);
+		extent_block = extents[EXTENTS_PER_BLOCK].start;  //link to next block
+	}
+
+	std::memset(desc_address(desc_index), 0, DESC_SIZE);
+	mark_descriptor(desc_index);
+
+	std::atomic_ref<std::uint64_t>(descriptor_words[desc_index / 64]).fetch_and(~(std::uint64_t(1) << (desc_index % 64)), std::memory_order_release);
+	free_descriptor_count++;
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::get_extents(int desc_index, std::vector<EXTENT> & extents) {
+
+	DESCRIPTOR<Geometry> descriptor = get_descriptor(desc_index);
+	EXTENT block_extents[EXTENTS_PER_BLOCK + 1];
+
+	extents.clear();
+	for (int i = 0; (i < descriptor.extent_count) && (i < DIRECT_EXTENTS); i++)
+		extents.push_back(descriptor.extents[i]);
+
+	for (int extent_block = descriptor.extent_block; extent_block != 0; extent_block = block_extents[EXTENTS_PER_BLOCK].start) {
+
+		read_extent_block(extent_block, block_extents);
+		for (int i = 0; (i < EXTENTS_PER_BLOCK) && ((int)extents.size() < descriptor.extent_count); i++)
+			extents.push_back(block_extents[i]);
 	}
 }
 
-void Ldisk::update_descriptor_blocks(int desc_index, int new_block) {
+template<class Geometry>
+EXTENT Ldisk<Geometry>::last_extent(const DESCRIPTOR<Geometry> & descriptor) {
+
+	EXTENT block_extents[EXTENTS_PER_BLOCK + 1];
+	int last = descriptor.extent_count - 1;
+
+	if (last < DIRECT_EXTENTS)
+		return descriptor.extents[last];
+
+	read_extent_block(descriptor.last_extent_block, block_extents);
+	return block_extents[(last - DIRECT_EXTENTS) % EXTENTS_PER_BLOCK];
+}
+
+template<class Geometry>
+bool Ldisk<Geometry>::append_extent(int desc_index, EXTENT extent) {
+
+	DESCRIPTOR<Geometry> descriptor = get_descriptor(desc_index);
+	EXTENT block_extents[EXTENTS_PER_BLOCK + 1];
+	int last = descriptor.extent_count - 1;
 
-	//find descriptor location
-	std::pair<int,int> desc_location = get_desc_location(desc_index);
+	//extend the last extent if the new blocks follow it
+	if (last < DIRECT_EXTENTS) {
 
-	//skip over file size
-	desc_location.second += INT_SIZE;
+		if ((last >= 0) && (descriptor.extents[last].start + descriptor.extents[last].length == extent.start)) {
 
-	//insert new block
-	int desc_count = 0;
-	for (desc_count = 1; desc_count < 4; desc_count++, desc_location.second += INT_SIZE) {
+			descriptor.extents[last].length += extent.length;
+			set_descriptor(desc_index, descriptor);
+			return true;
+		}
+	}
+	else {
 
-		if (read_int(cache[desc_location.first], desc_location.second) == 0) {
+		read_extent_block(descriptor.last_extent_block, block_extents);
+		EXTENT & tail = block_extents[(last - DIRECT_EXTENTS) % EXTENTS_PER_BLOCK];
 
-			write_int(&cache[desc_location.first], desc_location.second, new_block);
-			break;
+		if (tail.start + tail.length == extent.start) {
+
+			tail.length += extent.length;
+			write_extent_block(descriptor.last_extent_block, block_extents);
+			return true;
 		}
 	}
-}
 
-void Ldisk::update_descriptor_size(int desc_index, int new_size) {
+	//otherwise add a new extent
+	int next = descriptor.extent_count;
+	if (next < DIRECT_EXTENTS)
+		descriptor.extents[next] = extent;
+	else {
+
+		int slot = (next - DIRECT_EXTENTS) % EXTENTS_PER_BLOCK;
+		if (slot == 0) {  //need a new extent block
+
+			int new_block = find_free_block();
+			if (new_block == -1)  //disk full
+				return false;
+
+			std::memset(block_extents, 0, BLOCK_SIZE);
+			write_extent_block(new_block, block_extents);
+			if (descriptor.extent_block == 0)
+				descriptor.extent_block = new_block;
+			else {
+
+				read_extent_block(descriptor.last_extent_block, block_extents);
+				block_extents[EXTENTS_PER_BLOCK].start = new_block;  //link from the old last block
+				write_extent_block(descriptor.last_extent_block, block_extents);
+			}
+			descriptor.last_extent_block = new_block;
+		}
+
+		read_extent_block(descriptor.last_extent_block, block_extents);
+		block_extents[slot] = extent;
+		write_extent_block(descriptor.last_extent_block, block_extents);
+	}
 
-	//find descriptor location
-	std::pair<int, int> desc_location = get_desc_location(desc_index);
-	write_int(&cache[desc_location.first], desc_location.second, new_size);
+	descriptor.extent_count++;
+	set_descriptor(desc_index, descriptor);
+	return true;
 }
 
-void Ldisk::read_cache() {
+//prefers blocks right after the file's last extent, then a contiguous run anywhere, then any single block
+template<class Geometry>
+EXTENT Ldisk<Geometry>::grow_descriptor(int desc_index, int count) {
 
-	//using fast method
-	for (int i = 0; i < CACHE_SIZE; i++) {
+	DESCRIPTOR<Geometry> descriptor = get_descriptor(desc_index);
+	EXTENT added = { 0, 0 };
+
+	if (descriptor.extent_count > 0) {
 
-		for (int j = 0; j < BLOCK_SIZE; j++) 
-			cache[i][j] = ldisk[i][j];
+		EXTENT tail = last_extent(descriptor);
+		added.start = tail.start + tail.length;
+		while ((added.length < count) && allocator.allocate_at(added.start + added.length))
+			added.length++;
+		mark_bitmap(added.start, added.length);
 	}
 
-	/* using read_block() method
+	if (added.length == 0) {
 
-	std::string bit_string = "";
-	
-	char in[64];
-	for (int i = 0; i < 64; i++)
-		in[i] = 0;
+		added.start = allocate_contiguous(count);
+		added.length = count;
 
-	for (int i = 0; i < CACHE_SIZE; i++) {
+		if (added.start == -1) {
 
-		//read from disk
-		read_block(i, in);
-		
-		//convert to bit string
-		for (int j = 0; j < BLOCK_SIZE; j++)
-			bit_string += std::bitset<CHAR_SIZE>(in[j]).to_string();
+			added.start = find_free_block();
+			added.length = (added.start == -1) ? 0 : 1;
+		}
+	}
 
-		//store bits in cache
-		for (int j = 0; j < BLOCK_SIZE; j++)
-			cache[i][j] = std::stoi(std::string(1,bit_string[j]));
+	if ((added.length > 0) && !append_extent(desc_index, added)) {
 
-		bit_string = "";
+		release_blocks(added.start, added.length);
+		added.length = 0;
 	}
-	*/
+
+	return added;
 }
 
-void Ldisk::write_cache() {
-	
-	// using fast method
-	for (int i = 0; i < CACHE_SIZE; i++) {
+//the extent blocks the file has are written over, more are only taken once all of them are free
+template<class Geometry>
+bool Ldisk<Geometry>::set_extents(int desc_index, const std::vector<EXTENT> & extents) {
 
-		for (int j = 0; j < BLOCK_SIZE; j++)
-			ldisk[i][j] = cache[i][j];
+	DESCRIPTOR<Geometry> descriptor = get_descriptor(desc_index);
+	EXTENT block_extents[EXTENTS_PER_BLOCK + 1];
+	std::vector<int> chain;
+	int count = (int)extents.size();
+	int needed = (std::max(count - DIRECT_EXTENTS, 0) + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+
+	for (int extent_block = descriptor.extent_block; extent_block != 0; extent_block = block_extents[EXTENTS_PER_BLOCK].start) {
+
+		read_extent_block(extent_block, block_extents);
+		chain.push_back(extent_block);
 	}
-	
 
-	/* using write_block() method
+	int kept = (int)chain.size();
+	while ((int)chain.size() < needed) {
 
-	std::string bit_string = "";
+		int new_block = find_free_block();
+		if (new_block == -1) {  //disk full, give back what was taken
 
-	char out[64];
-	for (int i = 0; i < 64; i++)
-		out[i] = 0;
+			for (int i = kept; i < (int)chain.size(); i++)
+				release_block(chain[i]);
+			return false;
+		}
+		chain.push_back(new_block);
+	}
 
-	for (int i = 0; i < CACHE_SIZE; i++) {
+	for (int i = 0; i < needed; i++) {
+
+		std::memset(block_extents, 0, BLOCK_SIZE);
+		for (int j = 0; (j < EXTENTS_PER_BLOCK) && (DIRECT_EXTENTS + (i * EXTENTS_PER_BLOCK) + j < count); j++)
+			block_extents[j] = extents[DIRECT_EXTENTS + (i * EXTENTS_PER_BLOCK) + j];
+		block_extents[EXTENTS_PER_BLOCK].start = (i + 1 < needed) ? chain[i + 1] : 0;  //link to next block
+		write_extent_block(chain[i], block_extents);
+	}
+
+	std::memset(descriptor.extents, 0, sizeof(descriptor.extents));
+	for (int i = 0; (i < count) && (i < DIRECT_EXTENTS); i++)
+		descriptor.extents[i] = extents[i];
+	descriptor.extent_count = count;
+	descriptor.extent_block = (needed > 0) ? chain[0] : 0;
+	descriptor.last_extent_block = (needed > 0) ? chain[needed - 1] : 0;
+	set_descriptor(desc_index, descriptor);
+
+	//blocks the shorter list doesn't need
+	for (int i = needed; i < (int)chain.size(); i++)
+		release_block(chain[i]);
+
+	return true;
+}
+
+//the clone gets its own extent blocks, only data blocks are shared
+template<class Geometry>
+int Ldisk<Geometry>::clone_descriptor(int desc_index) {
+
+	std::vector<EXTENT> extents;
+	get_extents(desc_index, extents);
+
+	int clone_index = claim_descriptor();
+	if (clone_index == -1)
+		return -1;
 
-		//bit_string = cache[i].to_string();
-		int char_counter = 0;
-		for (int j = 0; j < BLOCK_SIZE; j += CHAR_SIZE, char_counter++) {
-			std::bitset<BLOCK_SIZE> sub_bits = subset(cache[i], j, j + CHAR_SIZE);
-			out[char_counter] = char(sub_bits.to_ulong());
+	set_descriptor(clone_index, {});
+	if (!set_extents(clone_index, extents)) {
+
+		destroy_descriptor(clone_index);
+		return -1;
+	}
+	update_descriptor_size(clone_index, get_descriptor(desc_index).size);
+
+	for (auto extent : extents) {
+
+		for (int block_num = extent.start; block_num < extent.start + extent.length; block_num++) {
+
+			if (std::atomic_ref<std::uint16_t>(block_shares[block_num]).fetch_add(1, std::memory_order_acq_rel) == 0)
+				shared_blocks++;
 		}
-		write_block(i, out);
 	}
-	*/
+
+	return clone_index;
 }
 
-void Ldisk::clear_disk() {
+template<class Geometry>
+bool Ldisk<Geometry>::drop_share(int block_num) {
+
+	std::atomic_ref<std::uint16_t> shares(block_shares[block_num]);
+	std::uint16_t old = shares.load(std::memory_order_acquire);
+
+	while ((old > 0) && !shares.compare_exchange_weak(old, old - 1, std::memory_order_acq_rel));
 
-	for (int i = 0; i < NUM_BLOCKS; i++)
-		ldisk[i].reset();
+	if (old == 1)
+		shared_blocks--;
+	return old > 0;
 }
 
-int Ldisk::find_free_block() {
+//with no shared blocks on the disk the whole run goes at once
+template<class Geometry>
+template<class Freed>
+void Ldisk<Geometry>::drop_blocks(int start, int count, Freed freed) {
 
-	for (int i = FILE_BLOCK_START; i < NUM_BLOCKS; i++) {
+	if (get_shared_blocks() == 0) {
 
-		if (cache[0][i] == 0) {
-			cache[0][i] = 1;
-			return i;
+		freed(start, count);
+		release_blocks(start, count);
+		return;
+	}
+
+	int run_start = start;
+	for (int block_num = start; block_num <= start + count; block_num++) {
+
+		if ((block_num == start + count) || drop_share(block_num)) {  //end of a run only this file held
+
+			if (block_num > run_start) {
+
+				freed(run_start, block_num - run_start);
+				release_blocks(run_start, block_num - run_start);
+			}
+			run_start = block_num + 1;
 		}
 	}
 }
 
-//reads an entire block into the buffer
-void Ldisk::read_block(int i, char * p) {
-
-	std::string bit_string = ldisk[i].to_string();
-	std::reverse(bit_string.begin(), bit_string.end());  //reverse because of bit ordering
-	
-	int char_counter = 0;
-	std::stringstream sstream(bit_string);
-	for (int i = 0; i < (BLOCK_SIZE/BYTE_SIZE); i++)
-	{
-		std::bitset<8> bits;
-		sstream >> bits;
-		*(p + char_counter) = char(bits.to_ulong());
+template<class Geometry>
+void Ldisk<Geometry>::update_descriptor_size(int desc_index, int new_size) {
+
+	std::int32_t size = new_size;
+	std::memcpy(desc_address(desc_index) + offsetof(DESCRIPTOR<Geometry>, size), &size, sizeof(size));
+	mark_descriptor(desc_index);
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::read_cache() {
+
+	load_blocks(0, CACHE_SIZE, (char *)cache.data());
+	allocator.rebuild();
+	build_descriptor_words();
+	build_block_shares();
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::write_cache() {
+
+	allocator.return_reservations();  //reserved blocks aren't used on disk
+	store_blocks(0, CACHE_SIZE, (const char *)cache.data());
+}
 
-		 char_counter++;
+template<class Geometry>
+void Ldisk<Geometry>::clear_disk() {
+
+	if (device) {  //fresh sparse file, every block reads back as zeros
+
+		DISK_HEADER header = make_header();
+		BLOCK_REQUEST request = { true, 0, (char *)&header, (int)sizeof(header) };
+
+		if ((device->resize(0) == -1) || (device->resize(device_offset(NUM_BLOCKS)) == -1) || (device->transfer(&request, 1) == -1))
+			std::cerr << "disk write failed" << std::endl;
 	}
-}	
+	else
+		use_memory();
+}
 
-//writes a block from the buffer
-void Ldisk::write_block(int i, char * p) {
+//large ranges are split so no single request gets too big
+template<class Geometry>
+void Ldisk<Geometry>::load_blocks(int start, int count, char * p) const {
+
+	if (stats_on(stats))
+		stats->add_blocks_read(count);
+
+	if (!device) {
 
-	std::string bit_string = "";
-	
-	//convert to binary
-	for (int j = 0; j < (BLOCK_SIZE/BYTE_SIZE); j++)
-		bit_string += std::bitset<BYTE_SIZE>(p[j]).to_string();
+		for (int i = start; i < start + count; ) {
 
-	//store binary bit by bit
-	for (int j = 0; j < BLOCK_SIZE; j++)
-		ldisk[i][j] = bit_string[j] - '0';
-	
+			int blocks = std::min(start + count - i, PAGE_BLOCKS - (i % PAGE_BLOCKS));  //rest of its page
+			std::memcpy(p + (std::size_t)(i - start) * BLOCK_SIZE, block(i), (std::size_t)blocks * BLOCK_SIZE);
+			i += blocks;
+		}
+		return;
+	}
+
+	std::vector<BLOCK_REQUEST> requests;
+	for (int i = 0; i < count; i += TRANSFER_BLOCKS) {
+
+		int blocks = (count - i < TRANSFER_BLOCKS) ? count - i : TRANSFER_BLOCKS;
+		requests.push_back({ false, device_offset(start + i), p + ((std::size_t)i * BLOCK_SIZE), blocks * BLOCK_SIZE });
+	}
+
+	if (device->transfer(requests.data(), (int)requests.size()) == -1)
+		std::cerr << "disk read failed" << std::endl;
 }
 
-void Ldisk::save_disk(std::string file_name) {
+template<class Geometry>
+void Ldisk<Geometry>::store_blocks(int start, int count, const char * p) {
 
-	std::ofstream outFile;
-	outFile.open(file_name);
-	std::string bit_string;
-	write_cache();
+	if (stats_on(stats))
+		stats->add_blocks_written(count);
+
+	note_written(start, count, p);
+	if (!device) {
 
-	for (auto block : ldisk) {
+		for (int i = start; i < start + count; ) {
+
+			int blocks = std::min(start + count - i, PAGE_BLOCKS - (i % PAGE_BLOCKS));
+			std::memcpy(writable_block(i), p + (std::size_t)(i - start) * BLOCK_SIZE, (std::size_t)blocks * BLOCK_SIZE);
+			i += blocks;
+		}
+		return;
+	}
 
-		bit_string = block.to_string();
-		std::reverse(bit_string.begin(), bit_string.end());  //reverse (maintain endianness)
+	std::vector<BLOCK_REQUEST> requests;
+	for (int i = 0; i < count; i += TRANSFER_BLOCKS) {
 
-		outFile << bit_string << std::endl;
+		int blocks = (count - i < TRANSFER_BLOCKS) ? count - i : TRANSFER_BLOCKS;
+		requests.push_back({ true, device_offset(start + i), (char *)p + ((std::size_t)i * BLOCK_SIZE), blocks * BLOCK_SIZE });
 	}
+
+	if (device->transfer(requests.data(), (int)requests.size()) == -1)
+		std::cerr << "disk write failed" << std::endl;
 }
 
-void Ldisk::init_disk(std::string file_name) {
+template<class Geometry>
+void Ldisk<Geometry>::transfer_blocks(bool is_write, const BLOCK_IO * ios, int count) {
 
-	std::ifstream inFile(file_name);
-	std::stringstream ss;
-	std::string line;
-	int block_counter = 0;
+	StatScope scope(stats, is_write ? STAT_WRITE_BLOCK : STAT_READ_BLOCK);
+	scope.result(count * BLOCK_SIZE);
 
-	if (inFile) {
+	if (stats_on(stats)) {
+
+		if (is_write)
+			stats->add_blocks_written(count);
+		else
+			stats->add_blocks_read(count);
+	}
+
+	for (int i = 0; is_write && (i < count); i++)
+		note_written(ios[i].block, 1, ios[i].buffer);
 
-		while (std::getline(inFile, line)) {
-			
-			for (int bit_counter = 0; bit_counter < BLOCK_SIZE; bit_counter++)
-				ldisk[block_counter][bit_counter] = line[bit_counter] - '0';
+	if (!device) {
 
-			block_counter++;
+		for (int i = 0; i < count; i++) {
+
+			if (is_write)
+				std::memcpy(writable_block(ios[i].block), ios[i].buffer, BLOCK_SIZE);
+			else
+				std::memcpy(ios[i].buffer, block(ios[i].block), BLOCK_SIZE);
 		}
+		return;
+	}
 
-		read_cache();
-		directory_descriptor = 0;  //always first descriptor
-		std::cout << "disk restored" << std::endl;
+	std::vector<BLOCK_REQUEST> requests(count);
+	for (int i = 0; i < count; i++)
+		requests[i] = { is_write, device_offset(ios[i].block), ios[i].buffer, BLOCK_SIZE };
+
+	if (device->transfer(requests.data(), count) == -1)
+		std::cerr << (is_write ? "disk write failed" : "disk read failed") << std::endl;
+}
+
+//reads an entire block into the buffer
+template<class Geometry>
+void Ldisk<Geometry>::read_block(int i, char * p) {
+
+	StatScope scope(stats, STAT_READ_BLOCK);
+	scope.result(BLOCK_SIZE);
+	load_blocks(i, 1, p);
+}
+
+//writes a block from the buffer
+template<class Geometry>
+void Ldisk<Geometry>::write_block(int i, char * p) {
+
+	StatScope scope(stats, STAT_WRITE_BLOCK);
+	scope.result(BLOCK_SIZE);
+	store_blocks(i, 1, p);
+}
+
+//in memory the block is copied and on_complete runs before returning
+template<class Geometry>
+void Ldisk<Geometry>::read_block_async(int i, char * p, std::function<void(int)> on_complete) {
+
+	if (device)
+		device->submit({ false, device_offset(i), p, BLOCK_SIZE }, std::move(on_complete));
+	else {
+
+		read_block(i, p);
+		on_complete(BLOCK_SIZE);
 	}
-	else
-		init_disk();
 }
 
-void Ldisk::init_disk() {
+template<class Geometry>
+void Ldisk<Geometry>::write_block_async(int i, char * p, std::function<void(int)> on_complete) {
 
-	clear_disk();
-	read_cache();
+	if (device) {
 
-	//set up directory descriptor (give three blocks)
-	directory_descriptor = init_descriptor(find_free_block());
+		note_written(i, 1, p);
+		device->submit({ true, device_offset(i), p, BLOCK_SIZE }, std::move(on_complete));
+	}
+	else {
+
+		write_block(i, p);
+		on_complete(BLOCK_SIZE);
+	}
+}
+
+template<class Geometry>
+std::future<int> Ldisk<Geometry>::read_block_async(int i, char * p) {
 
-	update_descriptor_blocks(directory_descriptor, find_free_block());
-	update_descriptor_blocks(directory_descriptor, find_free_block());
+	auto done = std::make_shared<std::promise<int>>();
+	std::future<int> result = done->get_future();
 
-	std::cout << "disk initialized" << std::endl;
+	read_block_async(i, p, [done](int bytes) { done->set_value(bytes); });
+	return result;
 }
 
+template<class Geometry>
+std::future<int> Ldisk<Geometry>::write_block_async(int i, char * p) {
 
-void Ldisk::dump_disk() {
+	auto done = std::make_shared<std::promise<int>>();
+	std::future<int> result = done->get_future();
 
-	std::cout << "CACHE " << std::endl;
-	for (auto cache_block : cache)
-		std::cout << cache_block.to_string() << std::endl;
+	write_block_async(i, p, [done](int bytes) { done->set_value(bytes); });
+	return result;
+}
+
+/*
+text image bit order - bitmap/descriptor blocks were stored one bit per index (least significant bit first),
+data blocks were stored one byte at a time (most significant bit first)
+*/
+template<class Geometry>
+std::string Ldisk<Geometry>::block_to_bits(int i, const unsigned char * data) {
+
+	std::string bit_string(BLOCK_SIZE * BYTE_SIZE, '0');
+
+	for (int j = 0; j < BLOCK_SIZE * BYTE_SIZE; j++) {
+
+		int bit = (i < CACHE_SIZE) ? (j % BYTE_SIZE) : (BYTE_SIZE - 1 - (j % BYTE_SIZE));
+		if ((data[j / BYTE_SIZE] >> bit) & 1)
+			bit_string[j] = '1';
+	}
 
-	std::cout << "DISK " << std::endl;
-	for (auto block : ldisk)
-		std::cout << block.to_string() << std::endl;
-}
\ No newline at end of file
+	return bit_string;
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::bits_to_block(int i, const std::string & line) {
+
+	std::vector<unsigned char> data(BLOCK_SIZE, 0);
+
+	for (int j = 0; (j < BLOCK_SIZE * BYTE_SIZE) && (j < (int)line.length()); j++) {
+
+		int bit = (i < CACHE_SIZE) ? (j % BYTE_SIZE) : (BYTE_SIZE - 1 - (j % BYTE_SIZE));
+		if (line[j] == '1')
+			data[j / BYTE_SIZE] |= (1 << bit);
+	}
+
+	store_blocks(i, 1, (const char *)data.data());
+}
+
+template<class Geometry>
+DISK_HEADER Ldisk<Geometry>::make_header() {
+
+	DISK_HEADER header = {};
+	std::memcpy(header.magic, DISK_MAGIC, sizeof(DISK_MAGIC));
+	header.version = DISK_VERSION;
+	header.header_size = sizeof(DISK_HEADER);
+	header.block_size = BLOCK_SIZE;
+	header.num_blocks = NUM_BLOCKS;
+
+	return header;
+}
+
+template<class Geometry>
+bool Ldisk<Geometry>::is_header(const DISK_HEADER & header) {
+
+	return (std::memcmp(header.magic, DISK_MAGIC, sizeof(DISK_MAGIC)) == 0) && (header.version == DISK_VERSION) &&
+		(header.header_size == sizeof(DISK_HEADER)) && (header.block_size == BLOCK_SIZE) && (header.num_blocks == NUM_BLOCKS);
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::save_disk(std::string file_name) {
+
+	//saving over the device's own file only has to sync it
+	if (device && device->is_file(file_name)) {
+
+		sync_disk();
+		return;
+	}
+
+	write_cache();
+
+	//the disk's own image only needs the blocks changed since, a journal gets them first to cover a crash part way,
+	//if they can't be logged the whole image is written beside it and renamed over instead
+	bool in_place = !device && !base_file.empty() && is_same_file(base_file, file_name);
+	if (in_place && journal && !journal->wait_durable(seal_journal()))
+		in_place = false;
+
+	if (!in_place || !write_dirty_blocks(file_name)) {
+
+		write_image(file_name);
+		if (!device) {
+
+			base_file = file_name;
+			clear_dirty();
+		}
+	}
+
+	//the image holds what the journal did, an older journal of it is stale
+	std::string journal_file = file_name + ".journal";
+	if (journal && is_same_file(journal->get_file(), journal_file)) {
+
+		journal->reset();
+		reset_journal_state();
+	}
+	else
+		std::remove(journal_file.c_str());
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::write_image(const std::string & file_name) {
+
+	DISK_HEADER header = make_header();
+
+	//write next to the image and rename over it, a mapping of the old image stays valid
+	std::string temp_name = file_name + ".tmp";
+	std::ofstream outFile(temp_name, std::ios::binary | std::ios::trunc);
+	outFile.write((const char *)&header, sizeof(header));
+
+	if (device) {
+
+		std::vector<char> chunk((std::size_t)TRANSFER_BLOCKS * BLOCK_SIZE);
+		for (int i = 0; i < NUM_BLOCKS; i += TRANSFER_BLOCKS) {
+
+			int count = (NUM_BLOCKS - i < TRANSFER_BLOCKS) ? NUM_BLOCKS - i : TRANSFER_BLOCKS;
+			load_blocks(i, count, chunk.data());
+			outFile.write(chunk.data(), (std::streamsize)count * BLOCK_SIZE);
+		}
+	}
+	else {
+
+		for (int page = 0; page < NUM_PAGES; page++)
+			outFile.write((const char *)block(page * PAGE_BLOCKS), (std::streamsize)std::min(PAGE_BLOCKS, NUM_BLOCKS - (page * PAGE_BLOCKS)) * BLOCK_SIZE);
+	}
+	outFile.close();
+
+#ifdef _WIN32
+	std::remove(file_name.c_str());
+#endif
+	std::rename(temp_name.c_str(), file_name.c_str());
+}
+
+//pages the disk never wrote are still in the mapping of the file and see the same blocks before and after
+template<class Geometry>
+bool Ldisk<Geometry>::write_dirty_blocks(const std::string & file_name) {
+
+#ifndef _WIN32
+	int fd = open_image(file_name);
+	bool written = (fd != -1);
+
+	if (!written)
+		return false;
+
+	if (mapping_shared(fd)) {  //saved whole beside it and renamed over it instead
+
+		::close(fd);
+		return false;
+	}
+
+	for_dirty_runs(dirty_words, 0, NUM_BLOCKS, [&](int start, int count) {
+
+		for (int i = start; written && (i < start + count); ) {
+
+			int blocks = std::min(start + count - i, PAGE_BLOCKS - (i % PAGE_BLOCKS));
+			written = write_at(fd, (const char *)block(i), (std::size_t)blocks * BLOCK_SIZE, device_offset(i));
+			i += blocks;
+		}
+	});
+
+	written = written && (fsync(fd) == 0);
+	::close(fd);
+
+	if (written)
+		clear_dirty();
+	return written;
+#else
+	return false;
+#endif
+}
+
+template<class Geometry>
+int Ldisk<Geometry>::open_image(const std::string & file_name) {
+
+#ifndef _WIN32
+	DISK_HEADER header = {};
+	int fd = ::open(file_name.c_str(), O_RDWR);
+
+	if ((fd != -1) && ((pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) || !is_header(header))) {
+
+		::close(fd);
+		fd = -1;
+	}
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+template<class Geometry>
+bool Ldisk<Geometry>::write_at(int fd, const char * p, std::size_t length, std::int64_t offset) {
+
+#ifndef _WIN32
+	while (length > 0) {
+
+		ssize_t written = pwrite(fd, p, length, (off_t)offset);
+		if (written < 0) {
+
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		p += written;
+		length -= written;
+		offset += written;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+//entries are in block order, so applying them reads the base image front to back
+template<class Geometry>
+bool Ldisk<Geometry>::save_delta(std::string file_name) {
+
+	if (device || base_file.empty() || is_same_file(base_file, file_name))
+		return false;
+
+	write_cache();
+
+	std::error_code error;
+	std::string base_name = std::filesystem::absolute(base_file, error).string();  //the delta may be read from somewhere else
+	if (error)
+		base_name = base_file;
+
+	std::vector<int> blocks;
+	for_dirty_runs(dirty_words, 0, NUM_BLOCKS, [&blocks](int start, int count) {
+
+		for (int i = start; i < start + count; i++)
+			blocks.push_back(i);
+	});
+
+	DELTA_HEADER header = {};
+	std::memcpy(header.magic, DELTA_MAGIC, sizeof(DELTA_MAGIC));
+	header.version = DELTA_VERSION;
+	header.block_size = BLOCK_SIZE;
+	header.num_blocks = NUM_BLOCKS;
+	header.block_count = (std::uint32_t)blocks.size();
+	header.base_length = (std::uint32_t)base_name.length();
+
+	std::string temp_name = file_name + ".tmp";
+	std::ofstream outFile(temp_name, std::ios::binary | std::ios::trunc);
+	outFile.write((const char *)&header, sizeof(header));
+	outFile.write(base_name.data(), (std::streamsize)base_name.length());
+
+	for (int block_num : blocks) {
+
+		std::int32_t entry = block_num;
+		outFile.write((const char *)&entry, sizeof(entry));
+		outFile.write((const char *)block(block_num), BLOCK_SIZE);
+	}
+
+	outFile.close();
+	if (!outFile) {
+
+		std::remove(temp_name.c_str());
+		return false;
+	}
+
+#ifdef _WIN32
+	std::remove(file_name.c_str());
+#endif
+	return std::rename(temp_name.c_str(), file_name.c_str()) == 0;
+}
+
+//the disk stays dirty against the base, saving over the base writes the delta's blocks into it
+template<class Geometry>
+bool Ldisk<Geometry>::load_delta(std::ifstream & inFile) {
+
+	DELTA_HEADER header = {};
+
+	if (!inFile.read((char *)&header, sizeof(header)) || (std::memcmp(header.magic, DELTA_MAGIC, sizeof(DELTA_MAGIC)) != 0) ||
+		(header.version != DELTA_VERSION) || (header.block_size != BLOCK_SIZE) || (header.num_blocks != NUM_BLOCKS) || (header.block_count > NUM_BLOCKS))
+		return false;
+
+	std::string base_name(header.base_length, '\0');
+	if (!inFile.read(base_name.data(), (std::streamsize)base_name.length()) || !map_disk(base_name))
+		return false;
+
+	std::vector<char> data(BLOCK_SIZE);
+	for (std::uint32_t i = 0; i < header.block_count; i++) {
+
+		std::int32_t block_num;
+		if (!inFile.read((char *)&block_num, sizeof(block_num)) || !inFile.read(data.data(), BLOCK_SIZE) || (block_num < 0) || (block_num >= NUM_BLOCKS))
+			return false;
+
+		store_blocks(block_num, 1, data.data());
+		mark_dirty(block_num, 1);
+	}
+
+	base_file = base_name;
+	return true;
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::export_disk(std::string file_name) {
+
+	std::ofstream outFile;
+	std::vector<unsigned char> data(BLOCK_SIZE);
+	outFile.open(file_name);
+	write_cache();
+
+	for (int i = 0; i < NUM_BLOCKS; i++) {
+
+		load_blocks(i, 1, (char *)data.data());
+		outFile << block_to_bits(i, data.data()) << '\n';
+	}
+}
+
+//maps the blocks of a binary image, only the blocks that get touched are paged in
+template<class Geometry>
+bool Ldisk<Geometry>::map_disk(std::string file_name) {
+
+	DISK_HEADER header = {};
+	std::size_t disk_size = (std::size_t)NUM_BLOCKS * BLOCK_SIZE;
+	std::ifstream inFile(file_name, std::ios::binary);
+
+	if (!inFile.read((char *)&header, sizeof(header)))
+		return false;
+
+	if (!is_header(header))
+		return false;
+
+#ifdef _WIN32
+	use_memory();
+	inFile.seekg(header.header_size);
+	for (int page = 0; page < NUM_PAGES; page++) {
+
+		int first = page * PAGE_BLOCKS;
+		if (!inFile.read((char *)writable_block(first), (std::streamsize)std::min(PAGE_BLOCKS, NUM_BLOCKS - first) * BLOCK_SIZE))
+			return false;
+	}
+	return true;
+#else
+	int fd = ::open(file_name.c_str(), O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	struct stat file_info;
+	std::size_t map_size = header.header_size + disk_size;
+	if ((fstat(fd, &file_info) == -1) || ((std::size_t)file_info.st_size < map_size)) {
+
+		::close(fd);
+		return false;
+	}
+
+	void * mapping = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);  //mapping holds its own reference
+	if (mapping == MAP_FAILED)
+		return false;
+
+	use_memory();
+	disk_mapping.reset((unsigned char *)mapping, [map_size](unsigned char * p) { munmap(p, map_size); });
+	mapped_device = (std::uint64_t)file_info.st_dev;
+	mapped_inode = (std::uint64_t)file_info.st_ino;
+	for (int page = 0; page < NUM_PAGES; page++) {
+
+		pages[page] = disk_mapping.get() + header.header_size + ((std::size_t)page * PAGE_BYTES);
+		page_memory[page].reset();
+	}
+	return true;
+#endif
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::import_disk(std::ifstream & inFile) {
+
+	std::string line;
+	int block_counter = 0;
+
+	clear_disk();
+	while (std::getline(inFile, line) && (block_counter < NUM_BLOCKS)) {
+
+		bits_to_block(block_counter, line);
+		block_counter++;
+	}
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::init_disk(std::string file_name) {
+
+	load_disk(file_name, true);
+}
+
+//the journal is replayed onto the blocks either way, attaching it is what truncates a torn tail and appends to it
+template<class Geometry>
+void Ldisk<Geometry>::copy_disk(std::string file_name) {
+
+	load_disk(file_name, false);
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::load_disk(const std::string & file_name, bool attach) {
+
+	std::ifstream inFile(file_name, std::ios::binary);
+	char magic[sizeof(DISK_MAGIC)] = {};
+
+	stop_journal();
+	device.reset();  //images are loaded into memory, open_device keeps one in its file
+	base_file.clear();
+	clear_dirty();
+	if (inFile) {
+
+		inFile.read(magic, sizeof(magic));
+
+		if (std::memcmp(magic, DISK_MAGIC, sizeof(DISK_MAGIC)) == 0) {
+
+			if (!map_disk(file_name)) {
+
+				std::cout << "invalid disk image" << '\n';
+				init_disk();
+				return;
+			}
+			base_file = file_name;
+		}
+		else if (std::memcmp(magic, DELTA_MAGIC, sizeof(DELTA_MAGIC)) == 0) {
+
+			inFile.seekg(0);
+			if (!load_delta(inFile)) {
+
+				std::cout << "invalid disk image" << '\n';
+				init_disk();
+				return;
+			}
+		}
+		else {
+
+			//old text image
+			inFile.clear();
+			inFile.seekg(0);
+			import_disk(inFile);
+		}
+
+		JOURNAL_REPLAY replayed = replay_journal(file_name);
+		read_cache();
+		directory_descriptor = 0;  //always first descriptor
+
+		if (!has_directory()) {
+
+			std::cout << "invalid disk image" << '\n';
+			init_disk();
+			return;
+		}
+		std::cout << "disk restored" << '\n';
+
+		if (attach)
+			attach_journal(file_name, replayed);
+		else {
+
+			base_file.clear();  //nothing is ever written back to the file
+			clear_dirty();
+		}
+	}
+	else
+		init_disk();
+}
+
+template<class Geometry>
+bool Ldisk<Geometry>::has_directory() {
+
+	DESCRIPTOR<Geometry> descriptor = get_descriptor(0);
+
+	if ((descriptor.extent_count <= 0) || (descriptor.extent_block < 0) || (descriptor.extent_block >= NUM_BLOCKS))
+		return false;
+
+	for (int i = 0; (i < descriptor.extent_count) && (i < DIRECT_EXTENTS); i++) {
+
+		EXTENT extent = descriptor.extents[i];
+		if ((extent.start < FILE_BLOCK_START) || (extent.length <= 0) || (extent.length > NUM_BLOCKS - extent.start))
+			return false;
+	}
+
+	return true;
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::init_disk() {
+
+	stop_journal();
+	device.reset();
+	format_disk();
+}
+
+//an empty file becomes a new disk, an image of this geometry is picked up where it was left
+template<class Geometry>
+bool Ldisk<Geometry>::open_device(std::string file_name) {
+
+	std::shared_ptr<BlockDevice> new_device = open_block_device(file_name);
+	DISK_HEADER header = {};
+	BLOCK_REQUEST request = { false, 0, (char *)&header, (int)sizeof(header) };
+
+	if (!new_device || (new_device->transfer(&request, 1) == -1))
+		return false;
+
+	bool is_empty = (new_device->size() == 0);
+	if (!is_empty && !is_header(header))  //some other file, leave it alone
+		return false;
+
+	//blocks stay in the file, only the cache is held in memory
+	stop_journal();
+	device_file = file_name;
+	pages.clear();
+	page_memory.clear();
+	page_owned.clear();
+	retired_pages.clear();
+	disk_mapping.reset();
+	device = new_device;
+	base_file.clear();
+	clear_dirty();
+
+	if (!is_empty) {
+
+		JOURNAL_REPLAY replayed = replay_journal(file_name);
+		read_cache();
+		directory_descriptor = 0;  //always first descriptor
+
+		if (has_directory()) {
+
+			std::cout << "disk restored" << '\n';
+			attach_journal(file_name, replayed);
+			return true;
+		}
+		std::cout << "invalid disk image" << '\n';
+	}
+
+	format_disk();
+	return true;
+}
+
+template<class Geometry>
+bool Ldisk<Geometry>::sync_disk() {
+
+	if (!device)
+		return false;
+
+	//data blocks are already in the file, only changed cache blocks are written
+	allocator.return_reservations();
+	for_dirty_runs(dirty_words, 0, CACHE_SIZE, [this](int start, int count) { store_blocks(start, count, (const char *)cache_block(start)); });
+	if (device->sync() != 0)
+		return false;
+	clear_dirty();
+
+	if (journal) {  //checkpoint
+
+		journal->reset();
+		reset_journal_state();
+	}
+	return true;
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::format_disk() {
+
+	clear_disk();
+	read_cache();
+	base_file.clear();  //a device's fresh file matches the zeroed blocks, changes start from here
+	clear_dirty();
+
+	//set up directory descriptor (give three blocks)
+	directory_descriptor = init_descriptor(find_free_block());
+	grow_descriptor(directory_descriptor, Geometry::DIRECTORY_BLOCKS - 1);
+	update_descriptor_size(directory_descriptor, Geometry::DIRECTORY_BLOCKS * BLOCK_SIZE);
+
+	std::cout << "disk initialized" << '\n';
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::note_written(int start, int count, const char * p) {
+
+	//cache blocks are only written out by write_cache, they are marked as they change and the journal takes them from the cache
+	if (start < CACHE_SIZE) {
+
+		p += (std::size_t)(std::min(count, CACHE_SIZE - start)) * BLOCK_SIZE;
+		count -= CACHE_SIZE - start;
+		start = CACHE_SIZE;
+	}
+
+	if (count <= 0)
+		return;
+
+	if (checkpoint.running.load(std::memory_order_acquire))  //before the blocks change
+		preserve_blocks(start, count);
+
+	mark_dirty(start, count);
+	for (int i = 0; journal && (i < count); i++)
+		journal->log_block(start + i, p + ((std::size_t)i * BLOCK_SIZE));
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::reset_journal_state() {
+
+	allocator.return_reservations();
+	journal_bitmap.assign(cache_block(0), cache_block(Geometry::BITMAP_BLOCKS));
+	journal_dirty.assign(CACHE_SIZE, 0);
+}
+
+template<class Geometry>
+JOURNAL_REPLAY Ldisk<Geometry>::replay_journal(const std::string & file_name) {
+
+	return Journal::replay(file_name + ".journal", BLOCK_SIZE, NUM_BLOCKS, [this](int block_num, const char * data) {
+
+		store_blocks(block_num, 1, data);
+		mark_dirty(block_num, 1);  //the image doesn't have it
+	});
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::attach_journal(const std::string & file_name, const JOURNAL_REPLAY & replayed) {
+
+	if (!replayed.valid)
+		return;
+
+	journal = std::make_shared<Journal>((int)BLOCK_SIZE);
+	if (!journal->append(file_name + ".journal", replayed)) {
+
+		journal.reset();
+		std::cerr << "journal can't be opened" << std::endl;
+		return;
+	}
+
+	reset_journal_state();
+	std::cout << "journal replayed " << replayed.transactions << " transactions" << '\n';
+}
+
+template<class Geometry>
+bool Ldisk<Geometry>::start_journal(std::string file_name) {
+
+	stop_journal();
+
+	if (device) {
+
+		if (!sync_disk())
+			return false;
+		file_name = device_file;
+	}
+	else if (file_name.empty())
+		return false;
+	else
+		save_disk(file_name);
+
+	journal = std::make_shared<Journal>((int)BLOCK_SIZE);
+	if (!journal->create(file_name + ".journal", NUM_BLOCKS)) {
+
+		journal.reset();
+		return false;
+	}
+
+	reset_journal_state();
+	return true;
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::stop_journal() {
+
+	if (journal)
+		journal->close();
+	journal.reset();
+	journal_bitmap.clear();
+	journal_dirty.clear();
+}
+
+//bitmap blocks are compared with their copy from the last seal, descriptor blocks were marked as they changed
+template<class Geometry>
+std::uint64_t Ldisk<Geometry>::seal_journal() {
+
+	if (!journal)
+		return 0;
+
+	allocator.return_reservations();  //reserved blocks aren't used on disk
+	for (int i = 0; i < Geometry::BITMAP_BLOCKS; i++) {
+
+		unsigned char * saved = journal_bitmap.data() + ((std::size_t)i * BLOCK_SIZE);
+		if (std::memcmp(saved, cache_block(i), BLOCK_SIZE) != 0) {
+
+			std::memcpy(saved, cache_block(i), BLOCK_SIZE);
+			journal->log_block(i, (const char *)saved);
+		}
+	}
+
+	for (int i = DESCRIPTOR_START; i <= DESCRIPTOR_END; i++) {
+
+		if (journal_dirty[i]) {
+
+			journal_dirty[i] = 0;
+			journal->log_block(i, (const char *)cache_block(i));
+		}
+	}
+
+	return journal->seal();
+}
+
+//on a device data blocks are already in the file, only the cache blocks are written (and the file synced)
+template<class Geometry>
+bool Ldisk<Geometry>::begin_checkpoint() {
+
+	int fd = -1;
+
+	if (!device && (base_file.empty() || ((fd = open_image(base_file)) == -1)))
+		return false;
+
+	//copies still read the mapped image, every block goes into a new one beside it
+	checkpoint.whole_image = !device && mapping_shared(fd);
+#ifndef _WIN32
+	if (checkpoint.whole_image) {
+
+		DISK_HEADER header = make_header();
+		std::string temp_name = base_file + ".tmp";
+
+		::close(fd);
+		fd = ::open(temp_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if ((fd == -1) || !write_at(fd, (const char *)&header, sizeof(header), 0)) {
+
+			if (fd != -1)
+				::close(fd);
+			std::remove(temp_name.c_str());
+			checkpoint.whole_image = false;
+			return false;
+		}
+	}
+#endif
+
+	allocator.return_reservations();  //reserved blocks aren't used on disk
+	checkpoint.fd = fd;
+	checkpoint.blocks = dirty_words;
+	if (checkpoint.whole_image) {
+
+		std::fill(checkpoint.blocks.begin(), checkpoint.blocks.end(), ~std::uint64_t(0));
+		if (NUM_BLOCKS % 64 != 0)
+			checkpoint.blocks.back() = (std::uint64_t(1) << (NUM_BLOCKS % 64)) - 1;
+	}
+	else if (device) {
+
+		std::size_t first_word = (CACHE_SIZE + 63) / 64;
+		if (CACHE_SIZE % 64 != 0)
+			checkpoint.blocks[CACHE_SIZE / 64] &= (std::uint64_t(1) << (CACHE_SIZE % 64)) - 1;
+		std::fill(checkpoint.blocks.begin() + first_word, checkpoint.blocks.end(), 0);
+	}
+
+	checkpoint.pending = checkpoint.blocks;
+	checkpoint.saved.clear();
+	for_dirty_runs(checkpoint.blocks, 0, CACHE_SIZE, [this](int start, int count) {
+
+		for (int i = start; i < start + count; i++) {
+
+			checkpoint.saved[i].assign((const char *)cache_block(i), (const char *)cache_block(i) + BLOCK_SIZE);
+			checkpoint.pending[i / 64] &= ~(std::uint64_t(1) << (i % 64));
+		}
+	});
+
+	clear_dirty();
+	checkpoint.running.store(!device, std::memory_order_release);
+	return true;
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::preserve_blocks(int start, int count) {
+
+	for (int i = start; i < start + count; i++) {
+
+		std::atomic_ref<std::uint64_t> word(checkpoint.pending[i / 64]);
+		std::uint64_t bit = std::uint64_t(1) << (i % 64);
+
+		if ((word.load(std::memory_order_acquire) & bit) == 0)  //written out or saved already
+			continue;
+
+		std::lock_guard<std::mutex> guard(checkpoint.lock);
+		if (word.load(std::memory_order_relaxed) & bit) {
+
+			checkpoint.saved[i].assign((const char *)block(i), (const char *)block(i) + BLOCK_SIZE);
+			word.fetch_and(~bit, std::memory_order_release);
+		}
+	}
+}
+
+//a block no longer pending can be changed the moment its bit clears, so it is copied first
+template<class Geometry>
+void Ldisk<Geometry>::take_checkpoint_blocks(int start, int count, char * p) {
+
+	std::lock_guard<std::mutex> guard(checkpoint.lock);
+
+	for (int i = start; i < start + count; i++, p += BLOCK_SIZE) {
+
+		std::atomic_ref<std::uint64_t> word(checkpoint.pending[i / 64]);
+		std::uint64_t bit = std::uint64_t(1) << (i % 64);
+
+		if (word.load(std::memory_order_relaxed) & bit) {
+
+			std::memcpy(p, block(i), BLOCK_SIZE);
+			word.fetch_and(~bit, std::memory_order_release);
+		}
+		else {
+
+			auto saved = checkpoint.saved.find(i);
+			std::memcpy(p, saved->second.data(), BLOCK_SIZE);
+			checkpoint.saved.erase(saved);
+		}
+	}
+}
+
+//blocks go out a batch at a time in block order, the checkpoint lock is only held while a batch is copied
+template<class Geometry>
+bool Ldisk<Geometry>::write_checkpoint() {
+
+	std::vector<char> batch((std::size_t)TRANSFER_BLOCKS * BLOCK_SIZE);
+	bool written = true;
+
+	for_dirty_runs(checkpoint.blocks, 0, NUM_BLOCKS, [&](int start, int count) {
+
+		for (int i = 0; written && (i < count); i += TRANSFER_BLOCKS) {
+
+			int blocks = std::min(count - i, TRANSFER_BLOCKS);
+			take_checkpoint_blocks(start + i, blocks, batch.data());
+
+			if (device) {
+
+				BLOCK_REQUEST request = { true, device_offset(start + i), batch.data(), blocks * BLOCK_SIZE };
+				written = (device->transfer(&request, 1) != -1);
+			}
+			else
+				written = write_at(checkpoint.fd, batch.data(), (std::size_t)blocks * BLOCK_SIZE, device_offset(start + i));
+		}
+	});
+
+	if (device)
+		written = written && (device->sync() == 0);
+#ifndef _WIN32
+	else
+		written = written && (fsync(checkpoint.fd) == 0);
+#endif
+
+	return end_checkpoint(written);
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::cancel_checkpoint() {
+
+	end_checkpoint(false);
+}
+
+template<class Geometry>
+bool Ldisk<Geometry>::end_checkpoint(bool written) {
+
+#ifndef _WIN32
+	if (checkpoint.fd != -1)
+		::close(checkpoint.fd);
+
+	if (checkpoint.whole_image) {
+
+		std::string temp_name = base_file + ".tmp";
+		written = written && (std::rename(temp_name.c_str(), base_file.c_str()) == 0);
+		if (!written)
+			std::remove(temp_name.c_str());
+	}
+#endif
+	checkpoint.whole_image = false;
+
+	//nothing is pending once every block has been taken, a failed write leaves some
+	{
+		std::lock_guard<std::mutex> guard(checkpoint.lock);
+		for (std::uint64_t & word : checkpoint.pending)
+			std::atomic_ref<std::uint64_t>(word).store(0, std::memory_order_relaxed);
+		checkpoint.running.store(false, std::memory_order_release);
+		checkpoint.saved.clear();
+	}
+	checkpoint.fd = -1;
+
+	//the image is missing these blocks, the next save or checkpoint writes them
+	for (std::size_t i = 0; !written && (i < checkpoint.blocks.size()); i++) {
+
+		if (checkpoint.blocks[i] != 0)
+			mark_word(i, checkpoint.blocks[i]);
+	}
+
+	return written;
+}
+
+//a journal of some other image (the disk was saved elsewhere since it started) still needs all of it
+template<class Geometry>
+bool Ldisk<Geometry>::trim_journal(std::uint64_t sequence) {
+
+	std::string image = device ? device_file : base_file;
+
+	if (!journal || image.empty() || !is_same_file(journal->get_file(), image + ".journal"))
+		return false;
+	return journal->trim(sequence);
+}
+
+template<class Geometry>
+void Ldisk<Geometry>::dump_disk() {
+
+	allocator.return_reservations();
+	std::cout << "CACHE " << '\n';
+	for (int i = 0; i < CACHE_SIZE; i++) {
+
+		for (int j = 0; j < BLOCK_SIZE; j++)
+			std::cout << std::bitset<BYTE_SIZE>(cache_block(i)[j]).to_string();
+		std::cout << '\n';
+	}
+
+	std::cout << "DISK " << '\n';
+	std::vector<unsigned char> data(BLOCK_SIZE);
+	for (int i = 0; i < NUM_BLOCKS; i++) {
+
+		load_blocks(i, 1, (char *)data.data());
+		for (int j = 0; j < BLOCK_SIZE; j++)
+			std::cout << std::bitset<BYTE_SIZE>(data[j]).to_string();
+		std::cout << '\n';
+	}
+}
@@ -1,16 +1,58 @@
-
 #include "base.h"
 #include "ldisk.h"
 #include "file_system.h"
 
 
-int main() {
+//batch mode, the whole script is read at once and the output is collected and written once at the end
+template<class Geometry>
+bool run_script(FileSystem<Geometry> & file_system, const char * file_name) {
+
+	std::ifstream inFile(file_name, std::ios::binary);
+	if (!inFile)
+		return false;
+
+	std::string script((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
+	std::string_view rest(script);
+	std::stringbuf output;
+	std::streambuf * console = std::cout.rdbuf(&output);
+
+	while (!rest.empty()) {
+
+		std::size_t end = rest.find('\n');
+		std::string_view command = rest.substr(0, end);
+		rest = (end == std::string_view::npos) ? std::string_view() : rest.substr(end + 1);
 
-	Ldisk myDisk;
-	FileSystem myFileSystem(myDisk);
+		if (command == "exit")
+			break;
+		else if (command == "")
+			std::cout << '\n';
+		else
+			file_system.give_command(command);
+	}
+
+	std::cout.rdbuf(console);
+	std::cout.write(output.view().data(), (std::streamsize)output.view().size());
+	std::cout.flush();
+	return true;
+}
+
+int main(int argc, char * argv[]) {
+
+	Ldisk<DefaultGeometry> myDisk;
+	FileSystem<DefaultGeometry> myFileSystem(myDisk);
 	bool run_system = true;
 	std::string command = "";
 
+	if (argc > 1) {  //script file
+
+		if (!run_script(myFileSystem, argv[1])) {
+
+			std::cerr << "can't open " << argv[1] << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
 	while (run_system && !std::cin.eof()) {
 
 		std::getline(std::cin, command);
@@ -21,7 +63,9 @@ int main() {
 			std::cout << "\n";
 		else
 			myFileSystem.give_command(command);
+
+		std::cout.flush();  //answer each command as it comes
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,222 @@
+#pragma once
+
+#include "base.h"
+
+//Operation counters and latency histograms for FileSystem, the buffer cache and Ldisk
+
+/*
+STATS INFO -
+
+per operation - calls, bytes moved, total time and a histogram of latencies (bucket i holds calls under 2^i ns)
+totals - blocks read/written by ldisk (metadata and extent blocks included), buffer cache hits/misses
+
+off by default, a disabled Stats costs one relaxed load per call, StatScope doesn't read the clock then
+counters are relaxed atomics, a snapshot taken while other threads run can be a few calls out of step
+*/
+
+enum STAT_OP {
+
+	STAT_CREATE,
+	STAT_DESTROY,
+	STAT_OPEN,
+	STAT_CLOSE,
+	STAT_READ,
+	STAT_WRITE,
+	STAT_READV,
+	STAT_WRITEV,
+	STAT_LSEEK,
+	STAT_CLONE,
+	STAT_READ_BLOCK,           //ldisk, batches count once per batch
+	STAT_WRITE_BLOCK,
+	STAT_ALLOCATE,             //find_free_block and allocate_contiguous
+	STAT_RELEASE,
+	STAT_OP_COUNT
+};
+
+static const char * const STAT_OP_NAMES[STAT_OP_COUNT] = {
+
+	"create", "destroy", "open", "close", "read", "write", "readv", "writev", "lseek", "clone",
+	"read_block", "write_block", "allocate", "release"
+};
+
+static const int HISTOGRAM_BUCKETS = 40;   //2^39 ns is about 9 minutes
+
+struct OP_SNAPSHOT {
+
+	std::uint64_t calls;
+	std::uint64_t bytes;
+	std::uint64_t total_ns;
+	std::uint64_t histogram[HISTOGRAM_BUCKETS];
+
+	std::uint64_t percentile(double fraction) const;   //upper bound of the bucket holding it, ns
+};
+
+struct STATS_SNAPSHOT {
+
+	bool enabled;
+	OP_SNAPSHOT ops[STAT_OP_COUNT];
+	std::uint64_t blocks_read;
+	std::uint64_t blocks_written;
+	std::uint64_t cache_hits;
+	std::uint64_t cache_misses;
+};
+
+class Stats {
+
+private:
+
+	struct OP_COUNTERS {
+
+		std::atomic<std::uint64_t> calls;
+		std::atomic<std::uint64_t> bytes;
+		std::atomic<std::uint64_t> total_ns;
+		std::atomic<std::uint64_t> histogram[HISTOGRAM_BUCKETS];
+	};
+
+	std::atomic<bool> enabled;
+	OP_COUNTERS ops[STAT_OP_COUNT];
+	std::atomic<std::uint64_t> blocks_read;
+	std::atomic<std::uint64_t> blocks_written;
+	std::atomic<std::uint64_t> cache_hits;
+	std::atomic<std::uint64_t> cache_misses;
+
+	static inline void add(std::atomic<std::uint64_t> & counter, std::uint64_t value) { counter.fetch_add(value, std::memory_order_relaxed); }
+
+public:
+
+	Stats() : enabled(false) { reset(); }
+
+	inline bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
+	inline void set_enabled(bool on) { enabled.store(on, std::memory_order_relaxed); }
+
+	void record(STAT_OP op, std::uint64_t ns, std::uint64_t bytes);
+	inline void add_blocks_read(int count) { add(blocks_read, count); }
+	inline void add_blocks_written(int count) { add(blocks_written, count); }
+	inline void add_cache_hits(int count) { add(cache_hits, count); }
+	inline void add_cache_misses(int count) { add(cache_misses, count); }
+
+	void reset();
+	STATS_SNAPSHOT snapshot() const;
+	void print(std::ostream & out) const;
+};
+
+inline bool stats_on(const Stats * stats) { return (stats != nullptr) && stats->is_enabled(); }
+
+//times one call when stats are on, does nothing otherwise
+class StatScope {
+
+private:
+
+	Stats * stats;
+	STAT_OP op;
+	std::uint64_t bytes;
+	std::chrono::steady_clock::time_point start;
+
+public:
+
+	StatScope(Stats * counters, STAT_OP stat_op) : stats(((counters != nullptr) && counters->is_enabled()) ? counters : nullptr), op(stat_op), bytes(0) {
+
+		if (stats != nullptr)
+			start = std::chrono::steady_clock::now();
+	}
+
+	~StatScope() {
+
+		if (stats != nullptr)
+			stats->record(op, (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), bytes);
+	}
+
+	StatScope(const StatScope &) = delete;
+	StatScope & operator=(const StatScope &) = delete;
+
+	//bytes moved by the call, returns result so it can wrap a return value
+	inline int result(int value) { bytes = (value > 0) ? value : 0; return value; }
+};
+
+inline void Stats::record(STAT_OP op, std::uint64_t ns, std::uint64_t bytes) {
+
+	int bucket = std::bit_width(ns);
+	if (bucket >= HISTOGRAM_BUCKETS)
+		bucket = HISTOGRAM_BUCKETS - 1;
+
+	add(ops[op].calls, 1);
+	add(ops[op].bytes, bytes);
+	add(ops[op].total_ns, ns);
+	add(ops[op].histogram[bucket], 1);
+}
+
+inline void Stats::reset() {
+
+	for (auto & counters : ops) {
+
+		counters.calls = 0;
+		counters.bytes = 0;
+		counters.total_ns = 0;
+		for (auto & bucket : counters.histogram)
+			bucket = 0;
+	}
+
+	blocks_read = 0;
+	blocks_written = 0;
+	cache_hits = 0;
+	cache_misses = 0;
+}
+
+inline STATS_SNAPSHOT Stats::snapshot() const {
+
+	STATS_SNAPSHOT snapshot = {};
+	snapshot.enabled = is_enabled();
+
+	for (int op = 0; op < STAT_OP_COUNT; op++) {
+
+		snapshot.ops[op].calls = ops[op].calls.load(std::memory_order_relaxed);
+		snapshot.ops[op].bytes = ops[op].bytes.load(std::memory_order_relaxed);
+		snapshot.ops[op].total_ns = ops[op].total_ns.load(std::memory_order_relaxed);
+		for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+			snapshot.ops[op].histogram[i] = ops[op].histogram[i].load(std::memory_order_relaxed);
+	}
+
+	snapshot.blocks_read = blocks_read.load(std::memory_order_relaxed);
+	snapshot.blocks_written = blocks_written.load(std::memory_order_relaxed);
+	snapshot.cache_hits = cache_hits.load(std::memory_order_relaxed);
+	snapshot.cache_misses = cache_misses.load(std::memory_order_relaxed);
+	return snapshot;
+}
+
+inline std::uint64_t OP_SNAPSHOT::percentile(double fraction) const {
+
+	std::uint64_t total = 0;
+	for (auto count : histogram)
+		total += count;
+
+	std::uint64_t seen = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+
+		seen += histogram[i];
+		if ((total > 0) && (seen >= fraction * total))
+			return std::uint64_t(1) << i;
+	}
+
+	return 0;
+}
+
+//one line per operation that was called, latencies are bucket bounds
+inline void Stats::print(std::ostream & out) const {
+
+	STATS_SNAPSHOT snapshot = this->snapshot();
+
+	out << "STATS " << (snapshot.enabled ? "on" : "off") << '\n';
+	for (int op = 0; op < STAT_OP_COUNT; op++) {
+
+		const OP_SNAPSHOT & counters = snapshot.ops[op];
+		if (counters.calls == 0)
+			continue;
+
+		out << STAT_OP_NAMES[op] << " calls " << counters.calls << " bytes " << counters.bytes
+			<< " avg_ns " << (counters.total_ns / counters.calls)
+			<< " p50_ns " << counters.percentile(0.5) << " p99_ns " << counters.percentile(0.99) << '\n';
+	}
+
+	out << "blocks read " << snapshot.blocks_read << " written " << snapshot.blocks_written << '\n';
+	out << "cache hits " << snapshot.cache_hits << " misses " << snapshot.cache_misses << '\n';
+}
@@ -0,0 +1,242 @@
+#pragma once
+
+#include "base.h"
+
+//Workload traces, FileSystem calls are logged with their arguments, timing and result for fs_replay
+
+/*
+TRACE INFO -
+
+a trace is a TRACE_HEADER followed by one 32 byte TRACE_RECORD per call, native byte order
+records go in the order calls finish, start_ns is when the call started (ns since tracing began)
+
+written bytes aren't kept, a write records its length and first byte and the replay writes that byte throughout
+handles are the recorded ones, the replay maps them to its own through the open calls
+a clone keeps its source name in the first half of name and the new name in the second
+in is logged (fresh or restored disk), sv/ex/dev and the printing commands are not
+
+a trace begun before in replays from a fresh disk, otherwise save an image first and give it to fs_replay --image
+off by default, a TraceRecorder that isn't recording costs one relaxed load per call
+*/
+
+enum TRACE_OP {
+
+	TRACE_CREATE = 1,          //values are stored in trace files, only add new ones at the end
+	TRACE_DESTROY,
+	TRACE_OPEN,
+	TRACE_CLOSE,
+	TRACE_READ,
+	TRACE_WRITE,
+	TRACE_READV,               //offset is the file position, length the total of the buffers
+	TRACE_WRITEV,
+	TRACE_LSEEK,
+	TRACE_DIRECTORY,           //result is the number of names
+	TRACE_INIT,                //length 1 when a disk image was loaded
+	TRACE_CLONE,
+	TRACE_OP_END
+};
+
+static const char * const TRACE_OP_NAMES[TRACE_OP_END] = {
+
+	"none", "create", "destroy", "open", "close", "read", "write", "readv", "writev", "lseek", "directory", "init", "clone"
+};
+
+static const char TRACE_MAGIC[8] = { 'F', 'S', 'T', 'R', 'A', 'C', 'E', '1' };
+static const std::uint32_t TRACE_VERSION = 1;
+static const int TRACE_NAME_SIZE = 12;             //name bytes kept, longer names can't be created anyway
+static const int TRACE_FLUSH_RECORDS = 4096;       //records buffered before they go to the file
+
+struct TRACE_HEADER {
+
+	char magic[8];                 //always TRACE_MAGIC
+	std::uint32_t version;
+	std::uint32_t record_size;     //sizeof(TRACE_RECORD)
+	std::uint32_t block_size;      //geometry of the traced disk
+	std::uint32_t num_blocks;
+};
+
+struct TRACE_RECORD {
+
+	std::uint64_t start_ns;        //since tracing began
+	std::uint32_t latency_ns;      //saturates at about 4 seconds
+	std::uint8_t op;               //TRACE_OP
+	std::uint8_t fill;             //first byte written
+	std::uint8_t name_length;      //create/destroy/open, full length (up to 255) even when the name was cut
+	std::uint8_t target_length;    //clone, full length of the new name
+
+	union {
+
+		struct {
+
+			std::int32_t handle;
+			std::int32_t length;   //bytes asked for
+			std::int32_t offset;   //readv/writev offset, lseek position
+		} io;
+		char name[TRACE_NAME_SIZE];
+	} args;
+
+	std::int32_t result;
+};
+
+static_assert(sizeof(TRACE_RECORD) == 32, "trace records must stay 32 bytes");
+
+class TraceRecorder {
+
+private:
+
+	std::atomic<bool> recording;
+	std::mutex lock;                                   //file and pending
+	std::ofstream file;
+	std::vector<TRACE_RECORD> pending;
+	std::uint64_t records;
+	std::chrono::steady_clock::time_point begin;
+
+	void flush_pending();                              //caller holds lock
+
+public:
+
+	TraceRecorder() : recording(false), records(0) {}
+	~TraceRecorder() { stop(); }
+
+	inline bool is_recording() const { return recording.load(std::memory_order_relaxed); }
+
+	bool start(const std::string & file_name, int block_size, int num_blocks);   //false if the file can't be written
+	std::uint64_t stop();                                                        //returns records written, 0 if not recording
+	void append(TRACE_RECORD record, std::chrono::steady_clock::time_point start);   //fills in start_ns
+};
+
+inline bool trace_on(const TraceRecorder * trace) { return (trace != nullptr) && trace->is_recording(); }
+
+//logs one call when tracing, does nothing otherwise, result stays -1 unless set
+class TraceScope {
+
+private:
+
+	TraceRecorder * trace;
+	TRACE_RECORD record;
+	std::chrono::steady_clock::time_point start;
+
+public:
+
+	TraceScope(TraceRecorder * recorder, TRACE_OP op) : trace(trace_on(recorder) ? recorder : nullptr) {
+
+		if (trace != nullptr) {
+
+			record = {};
+			record.op = (std::uint8_t)op;
+			record.result = -1;
+			start = std::chrono::steady_clock::now();
+		}
+	}
+
+	~TraceScope() {
+
+		if (trace != nullptr) {
+
+			std::uint64_t latency = (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+			record.latency_ns = (std::uint32_t)std::min<std::uint64_t>(latency, std::numeric_limits<std::uint32_t>::max());
+			trace->append(record, start);
+		}
+	}
+
+	TraceScope(const TraceScope &) = delete;
+	TraceScope & operator=(const TraceScope &) = delete;
+
+	inline void set_io(int handle, std::size_t length, int offset = 0, std::uint8_t fill = 0) {
+
+		if (trace != nullptr) {
+
+			record.args.io.handle = handle;
+			record.args.io.length = (std::int32_t)std::min<std::size_t>(length, (std::size_t)std::numeric_limits<std::int32_t>::max());
+			record.args.io.offset = offset;
+			record.fill = fill;
+		}
+	}
+
+	inline void set_name(const std::string & name) {
+
+		if (trace != nullptr) {
+
+			record.name_length = (std::uint8_t)std::min<std::size_t>(name.length(), 255);
+			std::memcpy(record.args.name, name.data(), std::min<std::size_t>(name.length(), TRACE_NAME_SIZE));
+		}
+	}
+
+	inline void set_names(const std::string & source, const std::string & target) {
+
+		if (trace != nullptr) {
+
+			record.name_length = (std::uint8_t)std::min<std::size_t>(source.length(), 255);
+			record.target_length = (std::uint8_t)std::min<std::size_t>(target.length(), 255);
+			std::memcpy(record.args.name, source.data(), std::min<std::size_t>(source.length(), TRACE_NAME_SIZE / 2));
+			std::memcpy(record.args.name + (TRACE_NAME_SIZE / 2), target.data(), std::min<std::size_t>(target.length(), TRACE_NAME_SIZE / 2));
+		}
+	}
+
+	//returns value so it can wrap a return value
+	inline int result(int value) { record.result = value; return value; }
+};
+
+inline bool TraceRecorder::start(const std::string & file_name, int block_size, int num_blocks) {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (recording.load(std::memory_order_relaxed)) {  //finish the old trace first
+
+		recording.store(false, std::memory_order_relaxed);
+		flush_pending();
+		file.close();
+	}
+
+	file.open(file_name, std::ios::binary | std::ios::trunc);
+	if (!file)
+		return false;
+
+	TRACE_HEADER header = {};
+	std::memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	header.version = TRACE_VERSION;
+	header.record_size = sizeof(TRACE_RECORD);
+	header.block_size = block_size;
+	header.num_blocks = num_blocks;
+	file.write((const char *)&header, sizeof(header));
+
+	pending.clear();
+	pending.reserve(TRACE_FLUSH_RECORDS);
+	records = 0;
+	begin = std::chrono::steady_clock::now();
+	recording.store(true, std::memory_order_relaxed);
+	return true;
+}
+
+inline std::uint64_t TraceRecorder::stop() {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (!recording.load(std::memory_order_relaxed))
+		return 0;
+
+	recording.store(false, std::memory_order_relaxed);
+	flush_pending();
+	file.close();
+	return records;
+}
+
+inline void TraceRecorder::append(TRACE_RECORD record, std::chrono::steady_clock::time_point start) {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (!recording.load(std::memory_order_relaxed) || (start < begin))  //stopped or restarted while the call ran
+		return;
+
+	record.start_ns = (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(start - begin).count();
+	pending.push_back(record);
+	if ((int)pending.size() >= TRACE_FLUSH_RECORDS)
+		flush_pending();
+}
+
+inline void TraceRecorder::flush_pending() {
+
+	file.write((const char *)pending.data(), (std::streamsize)(pending.size() * sizeof(TRACE_RECORD)));
+	records += pending.size();
+	pending.clear();
+}